@@ -20,12 +20,19 @@
 #include <chrono>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <tuple>
+#include <map>
+#include <unordered_map>
+#include <cstdlib>
+#include <type_traits>
 #include <iostream>
 #include <iomanip>
 #include <ctime>
 #include <climits>
 #include <cstring>
+#include <cerrno>
 
 
 //! This macro enables it all. It shouldn't be here, but specified in the command line or project configuration.
@@ -40,6 +47,10 @@
     #include <Windows.h>
 #else
     #include <unistd.h>
+    #include <poll.h>
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
 #endif
 
 
@@ -123,6 +134,8 @@ namespace axe
         TimeValue,      // Calendar date+time up to seconds
         IntValue,
         FloatValue,
+
+        ThreadName,     // The message is the name given to the thread
         _Count
     };
 
@@ -154,15 +167,17 @@ namespace axe
         Event()
         {
             m_time = 0;
-            m_thread = std::thread::id();
+            m_thread = 0;
+            m_depth = 0;
             m_level = Level::Fatal;
             m_type = EventType::Null;
         }
 
-        Event( AxeTime time, ThreadId thread, EventType type, Level level, const char* category, const std::string& message )
+        Event( AxeTime time, uint32_t thread, EventType type, Level level, const char* category, const std::string& message )
         {
             m_time = time;
             m_thread = thread;
+            m_depth = 0;
             m_type = type;
             m_level = level;
             m_category = category;
@@ -170,13 +185,24 @@ namespace axe
         }
 
         AxeTime m_time;
-        ThreadId m_thread;
+
+        //! Index of the thread, given by the kernel in order of first use
+        uint32_t m_thread;
+
+        //! Number of sections open in the thread. The begin and end events of a section have the
+        //! depth of the section that contains it.
+        uint32_t m_depth;
+
         Level m_level;
         EventType m_type;
         std::string m_category;
         std::string m_message;
         std::vector<uint8_t> m_data;
 
+        //! Format the message was built from, if it was logged with arguments. The encoded
+        //! arguments are then kept in m_data. Only valid in the process that logged the event.
+        const char* m_format = nullptr;
+
         void EncodeStringData( const std::string& value )
         {
             if (value.size())
@@ -252,333 +278,2081 @@ namespace axe
         // Ensure virtual destruction
         virtual ~Bin() {}
         virtual void Process( const Event& e ) = 0;
+
+        //! Name used to refer to the bin when setting levels.
+        virtual const char* GetName() const = 0;
+
+        //! Only events with this level or a lower one are processed.
+        Level GetLevel() const { return (Level)m_level.load(std::memory_order_relaxed); }
+        void SetLevel( Level level ) { m_level.store((uint8_t)level, std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint8_t> m_level{ (uint8_t)Level::All };
+    };
+
+    class TerminalBin : public Bin
+    {
+    public:
+
+        virtual const char* GetName() const override
+        {
+            return "terminal";
+        }
+
+        virtual void Process( const Event& e ) override
+        {
+            // Ignore spans and others.
+            if (e.m_type==EventType::Message)
+            {
+                printf( "[%8s] %s\n", e.m_category.c_str(), e.m_message.c_str() );
+                fflush(stdout);
+            }
+            else if (e.m_type==EventType::IntValue)
+            {
+                int64_t v = 0;
+                e.DecodeIntData(v);
+                printf( "[%8s] (int) %s : %lld\n", e.m_category.c_str(), e.m_message.c_str(), v );
+                fflush(stdout);
+            }
+        }
+    };
+
+    //! Typed arguments of messages that are formatted by the writer thread instead of the thread
+    //! logging them. Arguments are stored by value, including the characters of strings.
+    namespace format
+    {
+        enum class ArgType : uint8_t
+        {
+            Signed,
+            Unsigned,
+            Float,
+            String,
+            Pointer
+        };
+
+        struct Arg
+        {
+            ArgType m_type;
+            union
+            {
+                int64_t m_signed;
+                uint64_t m_unsigned;
+                double m_float;
+                const void* m_pointer;
+            };
+            const char* m_string = nullptr;
+            std::size_t m_stringSize = 0;
+        };
+
+        template<typename T>
+        inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, Arg>::type MakeArg( T value )
+        {
+            Arg a;
+            if (std::is_signed<T>::value)
+            {
+                a.m_type = ArgType::Signed;
+                a.m_signed = (int64_t)value;
+            }
+            else
+            {
+                a.m_type = ArgType::Unsigned;
+                a.m_unsigned = (uint64_t)value;
+            }
+            return a;
+        }
+
+        inline Arg MakeArg( double value )
+        {
+            Arg a;
+            a.m_type = ArgType::Float;
+            a.m_float = value;
+            return a;
+        }
+
+        inline Arg MakeArg( const char* value )
+        {
+            Arg a;
+            a.m_type = ArgType::String;
+            a.m_string = value ? value : "(null)";
+            a.m_stringSize = strlen( a.m_string );
+            return a;
+        }
+
+        inline Arg MakeArg( char* value )
+        {
+            return MakeArg( (const char*)value );
+        }
+
+        inline Arg MakeArg( const std::string& value )
+        {
+            Arg a;
+            a.m_type = ArgType::String;
+            a.m_string = value.c_str();
+            a.m_stringSize = value.size();
+            return a;
+        }
+
+        template<typename T>
+        inline Arg MakeArg( const T* value )
+        {
+            Arg a;
+            a.m_type = ArgType::Pointer;
+            a.m_pointer = value;
+            return a;
+        }
+
+        //! Size of the encoded arguments
+        inline std::size_t GetEncodedSize( const Arg* args, std::size_t count )
+        {
+            std::size_t result = 0;
+            for (std::size_t a=0; a<count; ++a)
+            {
+                result += 1 + ( args[a].m_type==ArgType::String ? 4+args[a].m_stringSize : 8 );
+            }
+            return result;
+        }
+
+        inline void Encode( uint8_t* data, const Arg* args, std::size_t count )
+        {
+            for (std::size_t a=0; a<count; ++a)
+            {
+                *data++ = (uint8_t)args[a].m_type;
+                if (args[a].m_type==ArgType::String)
+                {
+                    uint32_t size = (uint32_t)args[a].m_stringSize;
+                    memcpy( data, &size, 4 );
+                    memcpy( data+4, args[a].m_string, size );
+                    data += 4+size;
+                }
+                else
+                {
+                    memcpy( data, &args[a].m_unsigned, 8 );
+                    data += 8;
+                }
+            }
+        }
+
+        //! Read the next encoded argument. The string of string arguments points into the data.
+        inline bool Decode( const uint8_t*& data, const uint8_t* end, Arg& arg )
+        {
+            if (end-data<5)
+            {
+                return false;
+            }
+
+            arg.m_type = (ArgType)*data++;
+            if (arg.m_type==ArgType::String)
+            {
+                uint32_t size;
+                memcpy( &size, data, 4 );
+                if ( (std::size_t)(end-data)<4+size )
+                {
+                    return false;
+                }
+                arg.m_string = (const char*)data+4;
+                arg.m_stringSize = size;
+                data += 4+size;
+            }
+            else
+            {
+                if (end-data<8)
+                {
+                    return false;
+                }
+                memcpy( &arg.m_unsigned, data, 8 );
+                data += 8;
+            }
+            return true;
+        }
+
+        //! Append the result of formatting a single printf conversion.
+        inline void AppendFormatted( std::string& result, const char* spec, ... )
+        {
+            char temp[256];
+
+            va_list args;
+            va_start(args, spec);
+            int size = vsnprintf( temp, sizeof(temp), spec, args );
+            va_end(args);
+
+            if (size<0)
+            {
+                return;
+            }
+            if (size<(int)sizeof(temp))
+            {
+                result.append( temp, size );
+                return;
+            }
+
+            std::size_t start = result.size();
+            result.resize( start+size+1 );
+            va_start(args, spec);
+            vsnprintf( &result[start], size+1, spec, args );
+            va_end(args);
+            result.resize( start+size );
+        }
+
+        //! Format one argument for a conversion of the format string, converting it if the types
+        //! don't match. spec holds the flags, width and precision.
+        inline void AppendArg( std::string& result, std::string spec, char conversion, const Arg& a )
+        {
+            bool isIntegerConversion = strchr( "diouxXc", conversion )!=nullptr;
+            bool isFloatConversion = strchr( "fFeEgGaA", conversion )!=nullptr;
+
+            switch (a.m_type)
+            {
+            case ArgType::Signed:
+            case ArgType::Unsigned:
+                if (isFloatConversion)
+                {
+                    spec += conversion;
+                    AppendFormatted( result, spec.c_str(), a.m_type==ArgType::Signed ? (double)a.m_signed : (double)a.m_unsigned );
+                }
+                else if (conversion=='c')
+                {
+                    spec += 'c';
+                    AppendFormatted( result, spec.c_str(), (int)a.m_signed );
+                }
+                else
+                {
+                    if (!isIntegerConversion)
+                    {
+                        conversion = 'd';
+                    }
+                    if ( a.m_type==ArgType::Unsigned && ( conversion=='d' || conversion=='i' ) )
+                    {
+                        conversion = 'u';
+                    }
+                    spec += "ll";
+                    spec += conversion;
+                    AppendFormatted( result, spec.c_str(), a.m_unsigned );
+                }
+                break;
+
+            case ArgType::Float:
+                spec += isFloatConversion ? conversion : 'g';
+                AppendFormatted( result, spec.c_str(), a.m_float );
+                break;
+
+            case ArgType::String:
+                if (spec.size()==1)
+                {
+                    // Plain %s, the most common case
+                    result.append( a.m_string, a.m_stringSize );
+                }
+                else
+                {
+                    spec += "s";
+                    AppendFormatted( result, spec.c_str(), std::string( a.m_string, a.m_stringSize ).c_str() );
+                }
+                break;
+
+            case ArgType::Pointer:
+                spec += "p";
+                AppendFormatted( result, spec.c_str(), a.m_pointer );
+                break;
+            }
+        }
+
+        //! Format a printf style string with encoded arguments.
+        inline void Format( std::string& result, const char* format, const uint8_t* data, std::size_t size )
+        {
+            const uint8_t* end = data+size;
+            result.clear();
+
+            const char* c = format;
+            while (*c)
+            {
+                if (*c!='%')
+                {
+                    const char* b = c;
+                    while (*c && *c!='%') ++c;
+                    result.append( b, c );
+                    continue;
+                }
+
+                ++c;
+                if (*c=='%')
+                {
+                    result += '%';
+                    ++c;
+                    continue;
+                }
+
+                // Flags, width and precision. The length is given by the argument type.
+                std::string spec = "%";
+                Arg a;
+                while (*c && strchr( "-+ #0", *c )) spec += *c++;
+                for (int part=0; part<2; ++part)
+                {
+                    if (*c=='*')
+                    {
+                        spec += Decode( data, end, a ) ? std::to_string( a.m_signed ) : "0";
+                        ++c;
+                    }
+                    while (*c>='0' && *c<='9') spec += *c++;
+                    if (part==0 && *c=='.')
+                    {
+                        spec += *c++;
+                    }
+                    else
+                    {
+                        break;
+                    }
+                }
+                while (*c && strchr( "hljztLq", *c )) ++c;
+
+                char conversion = *c;
+                if (!conversion)
+                {
+                    break;
+                }
+                ++c;
+
+                if (!Decode( data, end, a ))
+                {
+                    result += "(missing)";
+                    continue;
+                }
+                AppendArg( result, spec, conversion, a );
+            }
+        }
+
+    } // namespace format
+
+    //! Small LZ77 codec for finished log segments, in the spirit of LZ4: a sequence of a token
+    //! byte with the number of literals and the match length, the literals, and the 16 bit offset
+    //! of the match. Lengths of 15 or more continue in extra bytes. The last sequence has only
+    //! literals. Inputs are compressed in blocks, so offsets never reach outside of them.
+    namespace lz
+    {
+        const std::size_t s_minMatch = 4;
+        const std::size_t s_maxOffset = 65535;
+        const int s_hashBits = 16;
+
+        inline uint32_t Read32( const uint8_t* p )
+        {
+            uint32_t v;
+            memcpy( &v, p, sizeof(v) );
+            return v;
+        }
+
+        inline void PutLength( std::vector<uint8_t>& out, std::size_t length )
+        {
+            while (length>=255)
+            {
+                out.push_back( 255 );
+                length -= 255;
+            }
+            out.push_back( uint8_t(length) );
+        }
+
+        inline void PutSequence( std::vector<uint8_t>& out, const uint8_t* literals, std::size_t literalCount,
+                                 std::size_t offset, std::size_t matchLength )
+        {
+            std::size_t matchCode = matchLength ? matchLength-s_minMatch : 0;
+            out.push_back( uint8_t( (std::min<std::size_t>(literalCount,15)<<4) | std::min<std::size_t>(matchCode,15) ) );
+            if (literalCount>=15) PutLength( out, literalCount-15 );
+            out.insert( out.end(), literals, literals+literalCount );
+            if (matchLength)
+            {
+                out.push_back( uint8_t(offset) );
+                out.push_back( uint8_t(offset>>8) );
+                if (matchCode>=15) PutLength( out, matchCode-15 );
+            }
+        }
+
+        //! Append the compressed data to out.
+        //! \param table scratch space reused between calls
+        inline void Compress( const uint8_t* src, std::size_t size, std::vector<uint8_t>& out, std::vector<uint32_t>& table )
+        {
+            table.assign( std::size_t(1)<<s_hashBits, 0 );
+
+            std::size_t anchor = 0;
+            std::size_t i = 0;
+            while (i+s_minMatch<=size)
+            {
+                uint32_t sequence = Read32( src+i );
+                uint32_t hash = (sequence*2654435761u) >> (32-s_hashBits);
+                std::size_t candidate = table[hash];
+                table[hash] = uint32_t(i+1);
+
+                if ( candidate && i-(candidate-1)<=s_maxOffset && Read32( src+candidate-1 )==sequence )
+                {
+                    std::size_t match = candidate-1;
+                    std::size_t length = s_minMatch;
+                    while (i+length<size && src[match+length]==src[i+length])
+                    {
+                        ++length;
+                    }
+
+                    PutSequence( out, src+anchor, i-anchor, i-match, length );
+                    i += length;
+                    anchor = i;
+                }
+                else
+                {
+                    // Skip faster through data that doesn't compress
+                    i += 1 + ((i-anchor)>>6);
+                }
+            }
+
+            PutSequence( out, src+anchor, size-anchor, 0, 0 );
+        }
+
+        //! \return false if the data is corrupt or doesn't decompress to exactly dstSize bytes.
+        inline bool Decompress( const uint8_t* src, std::size_t size, uint8_t* dst, std::size_t dstSize )
+        {
+            const uint8_t* end = src+size;
+            std::size_t written = 0;
+
+            auto getLength = [&]( std::size_t& length )
+            {
+                uint8_t b;
+                do
+                {
+                    if (src==end) return false;
+                    b = *src++;
+                    length += b;
+                }
+                while (b==255);
+                return true;
+            };
+
+            while (src<end)
+            {
+                uint8_t token = *src++;
+
+                std::size_t literalCount = token>>4;
+                if (literalCount==15 && !getLength( literalCount )) return false;
+                if ( std::size_t(end-src)<literalCount || dstSize-written<literalCount ) return false;
+                memcpy( dst+written, src, literalCount );
+                src += literalCount;
+                written += literalCount;
+
+                if (src==end)
+                {
+                    // Last sequence
+                    break;
+                }
+
+                if (end-src<2) return false;
+                std::size_t offset = src[0] | (std::size_t(src[1])<<8);
+                src += 2;
+
+                std::size_t length = token & 15;
+                if (length==15 && !getLength( length )) return false;
+                length += s_minMatch;
+
+                if ( offset==0 || offset>written || dstSize-written<length ) return false;
+
+                // Byte by byte, since the match may overlap what it produces
+                const uint8_t* match = dst+written-offset;
+                for (std::size_t b=0; b<length; ++b)
+                {
+                    dst[written+b] = match[b];
+                }
+                written += length;
+            }
+
+            return written==dstSize;
+        }
+
+    } // namespace lz
+
+    //! Records of the binary log file
+    enum class FileBinTag : uint8_t
+    {
+        String = 1,
+        Thread,
+        Event
+    };
+
+    struct FileBinFlags
+    {
+        enum : uint8_t
+        {
+            Interned = 1,
+            Formatted = 2
+        };
     };
 
-    class TerminalBin : public Bin
-    {
-    public:
+    //! Binary log file.
+    //! Version 3 is a header followed by a stream of records, each starting with a tag byte:
+    //!     String  varint size and characters of the next entry in the string dictionary
+    //!     Thread  uint64_t kernel index of the next entry in the thread dictionary
+    //!     Event   level and type byte, flags byte, zigzag varint time delta, varint thread index,
+    //!             varint section depth, varint category string index, message, data
+    //! The message is a varint string index if it has the Interned flag, or a varint size and the
+    //! characters otherwise. The data is a varint size followed by the bytes, unless the event has
+    //! the Formatted flag: then the message is the index of a format, and the data is the varint
+    //! count of its arguments, each one a type byte and a varint, or the size and characters of
+    //! strings, or the 8 bytes of floats.
+    //! Dictionary entries are written right before the first event that uses them, so that the
+    //! file is readable up to the last complete record if the process dies.
+    //! Big logs are split in segments that can be read on their own: the first one has the given
+    //! name, and the next ones a number appended to it. Finished segments are compressed in the
+    //! background. The names of the threads are repeated at the beginning of every segment.
+    //! Version 3 had no section depths, and std::thread::id values in the thread dictionary.
+    class FileBin : public Bin
+    {
+    protected:
+        FILE* m_pFile = nullptr;
+        uint64_t m_writtenSize = 0;
+
+        uint8_t m_fileBuffer[1024*1024];
+        uint32_t m_bufferPtr=0;
+        uint32_t m_bufferData=0;
+
+#define AXE_FILEBIN_VERSION     4
+#define AXE_FILEBIN_HEADER      "AxeLogBinaryFile"
+
+        //! Dictionaries of the strings and threads already written to the file
+        std::unordered_map<std::string,uint32_t> m_strings;
+        std::unordered_map<const char*,uint32_t> m_formats;
+        std::unordered_map<uint32_t,uint32_t> m_threads;
+        uint32_t m_stringCount = 0;
+        AxeTime m_lastTime = 0;
+
+        //! Record being encoded
+        std::vector<uint8_t> m_record;
+
+
+        static void PutVarint( std::vector<uint8_t>& out, uint64_t value )
+        {
+            while (value>=0x80)
+            {
+                out.push_back( uint8_t(value) | 0x80 );
+                value >>= 7;
+            }
+            out.push_back( uint8_t(value) );
+        }
+
+        static void PutBytes( std::vector<uint8_t>& out, const void* data, std::size_t size )
+        {
+            out.insert( out.end(), (const uint8_t*)data, (const uint8_t*)data+size );
+        }
+
+        uint32_t DefineString( const char* text, std::size_t size )
+        {
+            m_record.push_back( uint8_t(FileBinTag::String) );
+            PutVarint( m_record, size );
+            PutBytes( m_record, text, size );
+            return m_stringCount++;
+        }
+
+        uint32_t InternString( const std::string& text )
+        {
+            auto it = m_strings.find( text );
+            if (it!=m_strings.end())
+            {
+                return it->second;
+            }
+            uint32_t index = DefineString( text.data(), text.size() );
+            m_strings[text] = index;
+            return index;
+        }
+
+        //! Formats are literals, so they are identified by their address.
+        uint32_t InternFormat( const char* format )
+        {
+            auto it = m_formats.find( format );
+            if (it!=m_formats.end())
+            {
+                return it->second;
+            }
+            uint32_t index = DefineString( format, strlen(format) );
+            m_formats[format] = index;
+            return index;
+        }
+
+        uint32_t InternThread( uint32_t thread )
+        {
+            auto it = m_threads.find( thread );
+            if (it!=m_threads.end())
+            {
+                return it->second;
+            }
+            uint64_t id = thread;
+            m_record.push_back( uint8_t(FileBinTag::Thread) );
+            PutBytes( m_record, &id, sizeof(id) );
+            uint32_t index = (uint32_t)m_threads.size();
+            m_threads[thread] = index;
+            return index;
+        }
+
+        //! Write the encoded arguments of a format again with varints.
+        void PutArguments( const std::vector<uint8_t>& data )
+        {
+            std::vector<format::Arg> args;
+            const uint8_t* current = data.data();
+            format::Arg arg;
+            while (format::Decode( current, data.data()+data.size(), arg ))
+            {
+                args.push_back( arg );
+            }
+
+            PutVarint( m_record, args.size() );
+            for (const auto& a: args)
+            {
+                m_record.push_back( uint8_t(a.m_type) );
+                switch (a.m_type)
+                {
+                case format::ArgType::Signed:
+                    PutVarint( m_record, (uint64_t(a.m_signed)<<1) ^ uint64_t(a.m_signed>>63) );
+                    break;
+                case format::ArgType::String:
+                    PutVarint( m_record, a.m_stringSize );
+                    PutBytes( m_record, a.m_string, a.m_stringSize );
+                    break;
+                case format::ArgType::Float:
+                    PutBytes( m_record, &a.m_float, sizeof(a.m_float) );
+                    break;
+                default:
+                    PutVarint( m_record, a.m_unsigned );
+                    break;
+                }
+            }
+        }
+
+        bool file_write(const void* src, int size)
+        {
+            if (!m_pFile) return false;
+
+            // does it fit?
+            int dataLeft = sizeof(m_fileBuffer)-m_bufferPtr;
+            if (dataLeft<size)
+            {
+                flush_write_buffer();
+            }
+
+            // big write?
+            if (size>sizeof(m_fileBuffer))
+            {
+                // direct write
+                int written = (int)fwrite( src, size, 1 , m_pFile );
+                if (written!=1)
+                {
+                    fclose(m_pFile);
+                    m_pFile = nullptr;
+                    return false;
+                }
+                return true;
+            }
+
+            memcpy(&m_fileBuffer[m_bufferPtr], src, size);
+            m_bufferPtr+=size;
+            return true;
+        }
+
+        void flush_write_buffer()
+        {
+            if (m_pFile && m_bufferPtr)
+            {
+                fwrite( m_fileBuffer, 1, m_bufferPtr, m_pFile );
+                m_bufferPtr = 0;
+            }
+        }
+
+
+        //! Segments
+        std::string m_path;
+        uint64_t m_segmentSize = 64*1024*1024;
+        uint32_t m_segmentCount = 16;
+        uint32_t m_segment = 0;
+
+        //! Finished segments waiting to be compressed, and older segments to delete after that.
+        struct CompressJob
+        {
+            std::string m_compress;
+            std::string m_remove;
+        };
+
+        std::thread m_compressor;
+        std::mutex m_compressMutex;
+        std::condition_variable m_compressCondition;
+        std::vector<CompressJob> m_compressJobs;
+        bool m_stopCompressor = false;
+
+#define AXE_FILEBIN_COMPRESSED_HEADER   "AxeLogCompressed"
+#define AXE_FILEBIN_COMPRESSED_VERSION  1
+#define AXE_FILEBIN_COMPRESSED_BLOCK    (1024*1024)
+
+
+        FileBin()
+        {
+        }
+
+        std::string GetSegmentPath( uint32_t segment ) const
+        {
+            return segment ? m_path+"."+std::to_string(segment) : m_path;
+        }
+
+        void OpenSegment()
+        {
+            m_pFile = fopen( GetSegmentPath(m_segment).c_str(), "wb" );
+            if( !m_pFile )
+            {
+//                throw FileNotFoundException
+//                        ( boost::str( boost::format("File not found : %s") % strFile ).c_str() );
+
+//                return boost::shared_array<uint8_t>();
+            }
+            else
+            {
+                fwrite( AXE_FILEBIN_HEADER, 16, 1 , m_pFile );
+
+                uint32_t ver = AXE_FILEBIN_VERSION;
+                fwrite( &ver, sizeof(uint32_t), 1 , m_pFile );
+
+                m_writtenSize = 20;
+            }
+
+            // Every segment can be read on its own
+            m_strings.clear();
+            m_formats.clear();
+            m_threads.clear();
+            m_stringCount = 0;
+            m_lastTime = 0;
+        }
+
+        //! Close the current segment and continue in a new one. Segments are numbered in order
+        //! after the first one, which is always kept. Only the most recent ones are kept after it.
+        void Rotate()
+        {
+            flush_write_buffer();
+            fclose(m_pFile);
+            m_pFile = nullptr;
+
+            CompressJob job;
+            job.m_compress = GetSegmentPath(m_segment);
+
+            ++m_segment;
+            if (m_segmentCount && m_segment>=m_segmentCount)
+            {
+                job.m_remove = GetSegmentPath( m_segment-(m_segmentCount-1) );
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_compressMutex);
+                m_compressJobs.push_back( job );
+                if (!m_compressor.joinable())
+                {
+                    m_compressor = std::thread( [this](){ CompressorLoop(); } );
+                }
+            }
+            m_compressCondition.notify_one();
+
+            OpenSegment();
+        }
+
+        void CompressorLoop()
+        {
+            std::vector<uint8_t> raw( AXE_FILEBIN_COMPRESSED_BLOCK );
+            std::vector<uint8_t> compressed;
+            std::vector<uint32_t> table;
+
+            std::unique_lock<std::mutex> lock(m_compressMutex);
+            while (true)
+            {
+                if (m_compressJobs.empty())
+                {
+                    if (m_stopCompressor)
+                    {
+                        break;
+                    }
+                    m_compressCondition.wait( lock );
+                    continue;
+                }
+
+                CompressJob job = m_compressJobs.front();
+                m_compressJobs.erase( m_compressJobs.begin() );
+                lock.unlock();
+
+                if (job.m_compress!=job.m_remove)
+                {
+                    CompressSegment( job.m_compress, raw, compressed, table );
+                }
+                if (job.m_remove.size())
+                {
+                    remove( job.m_remove.c_str() );
+                }
+
+                lock.lock();
+            }
+        }
+
+        //! Replace a finished segment with its compressed version:
+        //!     header      16 characters and the uint32_t codec version
+        //!     blocks      uint32_t raw size, uint32_t stored size and the data, which is stored
+        //!                 uncompressed if both sizes are the same.
+        //! The decompressed blocks are the original segment.
+        static bool CompressSegment( const std::string& path, std::vector<uint8_t>& raw,
+                                     std::vector<uint8_t>& compressed, std::vector<uint32_t>& table )
+        {
+            FILE* source = fopen( path.c_str(), "rb" );
+            if (!source)
+            {
+                return false;
+            }
+
+            std::string temporaryPath = path+".tmp";
+            FILE* target = fopen( temporaryPath.c_str(), "wb" );
+            if (!target)
+            {
+                fclose(source);
+                return false;
+            }
+
+            bool result = fwrite( AXE_FILEBIN_COMPRESSED_HEADER, 16, 1, target )==1;
+            uint32_t version = AXE_FILEBIN_COMPRESSED_VERSION;
+            result = result && fwrite( &version, sizeof(version), 1, target )==1;
+
+            while (result)
+            {
+                uint32_t rawSize = (uint32_t)fread( &raw[0], 1, raw.size(), source );
+                if (!rawSize)
+                {
+                    result = !ferror(source);
+                    break;
+                }
+
+                compressed.clear();
+                lz::Compress( &raw[0], rawSize, compressed, table );
+
+                const uint8_t* data = &compressed[0];
+                uint32_t storedSize = (uint32_t)compressed.size();
+                if (storedSize>=rawSize)
+                {
+                    data = &raw[0];
+                    storedSize = rawSize;
+                }
+
+                result = fwrite( &rawSize, sizeof(rawSize), 1, target )==1
+                        && fwrite( &storedSize, sizeof(storedSize), 1, target )==1
+                        && fwrite( data, storedSize, 1, target )==1;
+            }
+
+            fclose(source);
+            result = ( fclose(target)==0 ) && result;
+
+            if (result)
+            {
+#ifdef _WIN32
+                remove( path.c_str() );
+#endif
+                result = rename( temporaryPath.c_str(), path.c_str() )==0;
+            }
+
+            if (!result)
+            {
+                remove( temporaryPath.c_str() );
+            }
+            return result;
+        }
+
+    public:
+
+        //! \param segmentSize the log continues in a new file after this many bytes.
+        //! \param segmentCount maximum number of files, or 0 to keep all of them. The first one is
+        //! always kept, and then the most recent ones.
+        FileBin(const char* strFileName, uint64_t segmentSize = 64*1024*1024, uint32_t segmentCount = 16)
+        {
+            m_path = strFileName;
+            m_segmentSize = segmentSize;
+            m_segmentCount = segmentCount ? std::max<uint32_t>( segmentCount, 2 ) : 0;
+            OpenSegment();
+        }
+
+        ~FileBin()
+        {
+            if (m_pFile)
+            {
+                flush_write_buffer();
+                fclose(m_pFile);
+            }
+
+            // Finish the pending compressions. The last segment is left as it is.
+            if (m_compressor.joinable())
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_compressMutex);
+                    m_stopCompressor = true;
+                }
+                m_compressCondition.notify_one();
+                m_compressor.join();
+            }
+        }
+
+        virtual const char* GetName() const override
+        {
+            return "file";
+        }
+
+        virtual void Process( const Event& e ) override
+        {
+            if (m_pFile)
+            {
+                if (e.m_type==EventType::ThreadName)
+                {
+                    m_threadNames[e.m_thread] = e.m_message;
+                }
+
+                EncodeEvent( e );
+
+                // Keep at least one event in every segment, even if it is too big.
+                if (m_writtenSize+m_record.size()>m_segmentSize && m_writtenSize>20)
+                {
+                    Rotate();
+                    WriteThreadNames( e.m_time );
+
+                    // References to the dictionaries of the previous segment are not valid anymore
+                    EncodeEvent( e );
+                }
+
+                if (m_pFile)
+                {
+                    file_write( &m_record[0], (int)m_record.size() );
+                    m_writtenSize += m_record.size();
+                }
+            }
+        }
+
+    protected:
+
+        std::map<uint32_t,std::string> m_threadNames;
+
+        void WriteThreadNames( AxeTime time )
+        {
+            for (const auto& name: m_threadNames)
+            {
+                Event e( time, name.first, EventType::ThreadName, Level::Info, "axe", name.second );
+                EncodeEvent( e );
+                if (m_pFile)
+                {
+                    file_write( &m_record[0], (int)m_record.size() );
+                    m_writtenSize += m_record.size();
+                }
+            }
+        }
+
+        //! Encode an event in m_record, preceded by the dictionary entries it needs.
+        void EncodeEvent( const Event& e )
+        {
+            m_record.clear();
+
+            uint32_t category = InternString( e.m_category );
+            uint32_t thread = InternThread( e.m_thread );
+
+            // Messages of spans and values are names that repeat a lot. Plain messages are
+            // usually unique, unless they come from a format.
+            uint8_t flags = 0;
+            uint32_t message = 0;
+            if (e.m_format)
+            {
+                flags = FileBinFlags::Interned|FileBinFlags::Formatted;
+                message = InternFormat( e.m_format );
+            }
+            else if (e.m_type!=EventType::Message)
+            {
+                flags = FileBinFlags::Interned;
+                message = InternString( e.m_message );
+            }
+
+            m_record.push_back( uint8_t(FileBinTag::Event) );
+            m_record.push_back( uint8_t(uint8_t(e.m_level) | (uint8_t(e.m_type)<<4)) );
+            m_record.push_back( flags );
+
+            // Events are mostly in time order, but not always across threads.
+            int64_t delta = int64_t(e.m_time-m_lastTime);
+            PutVarint( m_record, (uint64_t(delta)<<1) ^ uint64_t(delta>>63) );
+            m_lastTime = e.m_time;
+
+            PutVarint( m_record, thread );
+            PutVarint( m_record, e.m_depth );
+            PutVarint( m_record, category );
+            if (flags & FileBinFlags::Interned)
+            {
+                PutVarint( m_record, message );
+            }
+            else
+            {
+                PutVarint( m_record, e.m_message.size() );
+                PutBytes( m_record, e.m_message.data(), e.m_message.size() );
+            }
+
+            if (flags & FileBinFlags::Formatted)
+            {
+                PutArguments( e.m_data );
+            }
+            else
+            {
+                PutVarint( m_record, e.m_data.size() );
+                if (e.m_data.size()) PutBytes( m_record, &e.m_data[0], e.m_data.size() );
+            }
+        }
+
+     };
+
+
+
+    //!
+    //! \brief Level threshold of a category, cached where it is logged.
+    //! Each logging call site has a static instance, that is registered in the kernel the first time
+    //! it is used and updated when the levels change. Checking if an event is enabled is a single
+    //! relaxed atomic load, done before formatting or creating anything.
+    //!
+    class CategoryFilter
+    {
+    public:
+
+        constexpr CategoryFilter() : m_level( s_unregistered ) {}
+
+        inline bool IsEnabled( const char* category, Level level );
+
+        void SetLevel( Level level ) { m_level.store( (uint8_t)level, std::memory_order_relaxed ); }
+        void Reset() { m_level.store( s_unregistered, std::memory_order_relaxed ); }
+
+    private:
+
+        static const uint8_t s_unregistered = 0xff;
+
+        std::atomic<uint8_t> m_level;
+    };
+
+    enum class MetricType : uint8_t
+    {
+        Counter,        // Only increases, like the number of processes started
+        Gauge,          // Current value, like the number of processes running
+        Histogram       // Distribution of values, like the durations of the processes
+    };
+
+    //!
+    //! \brief Named value aggregated in memory, and exported as a whole instead of as events.
+    //! Counters and histograms are split in shards, and every thread updates its own one with
+    //! relaxed atomic operations, so that hot paths don't contend on a cache line. Histograms have
+    //! logarithmic buckets with 8 linear sub-buckets per power of two, so that any value from 0 to
+    //! 2^64 is kept with an error below 12.5%.
+    //!
+    class Metric
+    {
+    public:
+
+        static const int s_shardCount = 16;
+        static const int s_subBucketBits = 3;
+        static const int s_bucketCount = (64-s_subBucketBits+1)<<s_subBucketBits;
+
+        Metric( MetricType type ) : m_type( type )
+        {
+            if (type==MetricType::Histogram)
+            {
+                m_buckets.reset( new std::atomic<uint64_t>[s_shardCount*s_bucketCount] );
+                for (int b=0; b<s_shardCount*s_bucketCount; ++b)
+                {
+                    m_buckets[b].store( 0, std::memory_order_relaxed );
+                }
+            }
+        }
+
+        MetricType GetType() const { return m_type; }
+
+        //! Increase a counter, or change a gauge.
+        void Add( int64_t value )
+        {
+            if (m_type==MetricType::Gauge)
+            {
+                m_shards[0].m_value.fetch_add( value, std::memory_order_relaxed );
+            }
+            else
+            {
+                m_shards[GetShard()].m_value.fetch_add( value, std::memory_order_relaxed );
+            }
+        }
+
+        //! Set the value of a gauge.
+        void Set( int64_t value )
+        {
+            m_shards[0].m_value.store( value, std::memory_order_relaxed );
+        }
+
+        //! Add a value to the distribution of a histogram. Negative values are counted as 0.
+        void Record( int64_t value )
+        {
+            if (!m_buckets) return;
+
+            uint64_t v = value>0 ? (uint64_t)value : 0;
+            uint32_t shard = GetShard();
+            m_buckets[shard*s_bucketCount+GetBucket(v)].fetch_add( 1, std::memory_order_relaxed );
+            m_shards[shard].m_value.fetch_add( (int64_t)v, std::memory_order_relaxed );
+        }
+
+        //! Value of a counter or gauge, or sum of the values of a histogram.
+        int64_t GetValue() const
+        {
+            int64_t result = 0;
+            for (const auto& s: m_shards)
+            {
+                result += s.m_value.load( std::memory_order_relaxed );
+            }
+            return result;
+        }
+
+        //! Number of values of a histogram in every bucket.
+        std::vector<uint64_t> GetBucketCounts() const
+        {
+            std::vector<uint64_t> result( m_buckets ? s_bucketCount : 0, 0 );
+            for (int s=0; s<s_shardCount && m_buckets; ++s)
+            {
+                for (int b=0; b<s_bucketCount; ++b)
+                {
+                    result[b] += m_buckets[s*s_bucketCount+b].load( std::memory_order_relaxed );
+                }
+            }
+            return result;
+        }
+
+        static int GetBucket( uint64_t value )
+        {
+            if (value < (1u<<s_subBucketBits)) return (int)value;
+
+            int exponent = 63;
+            while (!(value>>exponent)) --exponent;
+            int subBucket = (int)(value>>(exponent-s_subBucketBits)) & ((1<<s_subBucketBits)-1);
+            return ((exponent-s_subBucketBits+1)<<s_subBucketBits) + subBucket;
+        }
+
+        //! Smallest value that goes in a bucket.
+        static uint64_t GetBucketLowerBound( int bucket )
+        {
+            if (bucket < (1<<s_subBucketBits)) return (uint64_t)bucket;
+
+            int exponent = (bucket>>s_subBucketBits)+s_subBucketBits-1;
+            uint64_t subBucket = (uint64_t)(bucket & ((1<<s_subBucketBits)-1));
+            return ((uint64_t(1)<<s_subBucketBits)+subBucket)<<(exponent-s_subBucketBits);
+        }
+
+        //! Append the metric in OpenMetrics text format.
+        void Write( const std::string& name, std::string& out ) const
+        {
+            static const char* types[] = { "counter", "gauge", "histogram" };
+            char line[256];
+            snprintf( line, sizeof(line), "# TYPE %s %s\n", name.c_str(), types[(int)m_type] );
+            out += line;
+
+            if (m_type==MetricType::Counter)
+            {
+                snprintf( line, sizeof(line), "%s_total %lld\n", name.c_str(), (long long)GetValue() );
+                out += line;
+            }
+            else if (m_type==MetricType::Gauge)
+            {
+                snprintf( line, sizeof(line), "%s %lld\n", name.c_str(), (long long)GetValue() );
+                out += line;
+            }
+            else
+            {
+                // Buckets are cumulative, and only the ones with values are listed.
+                std::vector<uint64_t> counts = GetBucketCounts();
+                uint64_t count = 0;
+                for (int b=0; b<s_bucketCount; ++b)
+                {
+                    if (!counts[b]) continue;
+                    count += counts[b];
+                    if (b+1<s_bucketCount)
+                    {
+                        snprintf( line, sizeof(line), "%s_bucket{le=\"%llu\"} %llu\n", name.c_str(),
+                                  (unsigned long long)(GetBucketLowerBound(b+1)-1), (unsigned long long)count );
+                        out += line;
+                    }
+                }
+                snprintf( line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %lld\n%s_count %llu\n",
+                          name.c_str(), (unsigned long long)count,
+                          name.c_str(), (long long)GetValue(),
+                          name.c_str(), (unsigned long long)count );
+                out += line;
+            }
+        }
+
+    private:
+
+        //! Shard of the calling thread
+        static uint32_t GetShard()
+        {
+            static std::atomic<uint32_t> s_nextShard{0};
+            static thread_local uint32_t s_shard = s_nextShard++ % s_shardCount;
+            return s_shard;
+        }
+
+        //! Padded to its own cache line
+        struct Shard
+        {
+            std::atomic<int64_t> m_value{0};
+            char m_padding[64-sizeof(std::atomic<int64_t>)];
+        };
+
+        MetricType m_type;
+        Shard m_shards[s_shardCount];
+
+        //! Bucket counts of the histograms, shard after shard
+        std::unique_ptr<std::atomic<uint64_t>[]> m_buckets;
+    };
+
+    //! Metric used at a call site, registered in the kernel the first time it is used.
+    class MetricHandle
+    {
+    public:
+
+        constexpr MetricHandle() : m_metric( nullptr ), m_instance( 0 ) {}
+
+        inline Metric* Get( const char* name, MetricType type );
+
+    private:
+
+        std::atomic<Metric*> m_metric;
+
+        //! Kernel instance that owns the metric
+        std::atomic<uint64_t> m_instance;
+    };
+
+    //! Fixed size slot of the queue of events waiting to be processed by the bins.
+    //! The category, message and data are stored one after the other in the payload, or in a heap
+    //! buffer if they don't fit.
+    struct EventRecord
+    {
+        std::atomic<uint64_t> m_sequence;
+
+        AxeTime m_time;
+        uint32_t m_thread;
+        uint32_t m_depth;
+        Level m_level;
+        EventType m_type;
+        uint32_t m_categorySize;
+        uint32_t m_messageSize;
+        uint32_t m_dataSize;
+        char* m_overflow;
+
+        //! The data holds the pointer to a format string and its encoded arguments, and the message
+        //! has to be formatted.
+        bool m_deferred;
+
+        char m_payload[192];
+    };
+
+    class Kernel
+    {
+    public:
+
+        Kernel(const char* strAppName, const char* strVersion, uint64_t options)
+        {
+            startWallTime = std::chrono::steady_clock::now();
+
+            m_records.reset( new EventRecord[s_queueSize] );
+            for (uint64_t r=0; r<s_queueSize; ++r)
+            {
+                m_records[r].m_sequence.store( r, std::memory_order_relaxed );
+            }
+
+            // Gather system information
+            std::string machineName = platform::GetHostName();
+            std::string programName = strAppName ? strAppName : "";
+            std::string programVersion = strVersion ? strVersion : "";
+
+            auto t = std::time(nullptr);
+            auto tm = *std::gmtime(&t);
+
+            std::ostringstream oss;
+            oss << std::put_time(&tm, "%Y_%m_%d-%H_%M_%S");
+            std::string nowStr = oss.str();
+
+            // Default setup
+            m_bins.push_back( std::make_shared<TerminalBin>() );
+
+            char logFileName[256];
+            if (programVersion.size())
+            {
+                snprintf( logFileName, sizeof(logFileName), "%s-%s-%s-%s.axe_log", programName.c_str(), strVersion, machineName.c_str(), nowStr.c_str() );
+            }
+            else
+            {
+                snprintf( logFileName, sizeof(logFileName), "%s-%s-%s.axe_log", programName.c_str(), machineName.c_str(), nowStr.c_str() );
+            }
+
+            // Size in megabytes and maximum number of the log file segments
+            uint64_t segmentSize = 64;
+            uint32_t segmentCount = 16;
+            if (const char* size = getenv("AXE_SEGMENT_SIZE"))
+            {
+                segmentSize = std::max<uint64_t>( strtoull( size, nullptr, 10 ), 1 );
+            }
+            if (const char* count = getenv("AXE_SEGMENT_COUNT"))
+            {
+                segmentCount = (uint32_t)strtoul( count, nullptr, 10 );
+            }
+            m_bins.push_back( std::make_shared<FileBin>(logFileName, segmentSize*1024*1024, segmentCount) );
+
+            // Metrics are written next to the log at the end, unless another file is given.
+            if (const char* metricsPath = getenv("AXE_METRICS_FILE"))
+            {
+                m_metricsPath = metricsPath;
+            }
+            else
+            {
+                m_metricsPath = logFileName;
+                m_metricsPath.replace( m_metricsPath.size()-strlen(".axe_log"), std::string::npos, ".axe_metrics" );
+            }
+
+            // Levels from the environment, with the same format as SetLevels.
+            const char* levels = getenv("AXE_LEVELS");
+            if (levels)
+            {
+                SetLevels( levels );
+            }
+
+            // The bins are only used from the writer thread from now on.
+            m_writer = std::thread( [this](){ WriterLoop(); } );
+
+            // Initial system logs
+            AddStringValue( "system", Level::Info, "Program", programName );
+            AddStringValue( "system", Level::Info, "Version", programVersion );
+            AddStringValue( "system", Level::Info, "Machine", machineName );
+            AddTimeValue( "system", Level::Info, "StartTime", t );
+
+            // Metrics can be scraped while the program runs
+            if (const char* port = getenv("AXE_METRICS_PORT"))
+            {
+                StartMetricsServer( (int)strtol( port, nullptr, 10 ) );
+            }
+        }
+
+        ~Kernel()
+        {
+            if (m_metricsServer.joinable())
+            {
+                m_stopMetricsServer = true;
+                m_metricsServer.join();
+            }
+            WriteMetrics();
+
+            Flush();
+
+            {
+                std::lock_guard<std::mutex> lock(m_writerMutex);
+                m_stopWriter = true;
+            }
+            m_writerCondition.notify_one();
+            m_writer.join();
+
+            // Filters outlive the kernel and have to be registered again in a new one.
+            std::lock_guard<std::mutex> lock(m_levelsMutex);
+            for ( auto& f: m_filters )
+            {
+                f.first->Reset();
+            }
+        }
+
+        //! Set the levels of categories and bins from a comma separated list of assignments:
+        //!     level               default level of all categories
+        //!     category=level      level of a category
+        //!     bin:name=level      level of a bin, like "terminal" or "file"
+        //! Levels are fatal, error, warning, info, debug, verbose or all.
+        //! \return false if any of the assignments is not valid.
+        bool SetLevels( const std::string& spec )
+        {
+            bool result = true;
+
+            std::lock_guard<std::mutex> lock(m_levelsMutex);
+
+            std::string::size_type begin = 0;
+            while (begin<=spec.size())
+            {
+                std::string::size_type end = spec.find( ',', begin );
+                if (end==std::string::npos) end = spec.size();
+                std::string entry = spec.substr( begin, end-begin );
+                begin = end+1;
+
+                if (entry.empty())
+                {
+                    continue;
+                }
+
+                std::string::size_type equal = entry.find( '=' );
+                std::string name = equal==std::string::npos ? "" : entry.substr( 0, equal );
+                Level level;
+                if (!ParseLevel( entry.substr( equal==std::string::npos ? 0 : equal+1 ), level ))
+                {
+                    result = false;
+                }
+                else if (name.empty())
+                {
+                    m_defaultLevel = level;
+                }
+                else if (name.compare( 0, 4, "bin:" )==0)
+                {
+                    bool found = false;
+                    for ( auto& bin: m_bins )
+                    {
+                        if (name.compare( 4, std::string::npos, bin->GetName() )==0)
+                        {
+                            bin->SetLevel( level );
+                            found = true;
+                        }
+                    }
+                    result = result && found;
+                }
+                else
+                {
+                    m_categoryLevels[name] = level;
+                }
+            }
+
+            for ( auto& f: m_filters )
+            {
+                f.first->SetLevel( GetCategoryLevel( f.second ) );
+            }
+
+            return result;
+        }
+
+        //! Register a logging call site, and return its current level.
+        Level RegisterFilter( CategoryFilter* filter, const char* category )
+        {
+            std::lock_guard<std::mutex> lock(m_levelsMutex);
+
+            m_filters[filter] = category ? category : "";
+            Level level = GetCategoryLevel( m_filters[filter] );
+            filter->SetLevel( level );
+            return level;
+        }
+
+        //! Find or create a metric. The metrics live as long as the kernel.
+        //! \return null if a metric with the same name and another type exists.
+        Metric* GetMetric( const char* name, MetricType type )
+        {
+            std::lock_guard<std::mutex> lock(m_metricsMutex);
+            std::unique_ptr<Metric>& metric = m_metrics[name];
+            if (!metric)
+            {
+                metric.reset( new Metric(type) );
+            }
+            return metric->GetType()==type ? metric.get() : nullptr;
+        }
+
+        uint64_t GetInstance() const { return m_instance; }
+
+        //! Current values of all the metrics, in OpenMetrics text format.
+        std::string GetMetricsText()
+        {
+            std::string result;
+            {
+                std::lock_guard<std::mutex> lock(m_metricsMutex);
+                for ( const auto& m: m_metrics )
+                {
+                    m.second->Write( m.first, result );
+                }
+            }
+            result += "# EOF\n";
+            return result;
+        }
+
+        //! Wait until all the events added so far have been processed by the bins.
+        void Flush()
+        {
+            uint64_t target = m_enqueuePos.load(std::memory_order_acquire);
+
+            std::unique_lock<std::mutex> lock(m_writerMutex);
+            m_writerCondition.notify_one();
+            m_flushedCondition.wait( lock, [&](){ return m_processed.load()>=target; } );
+        }
+
+    private:
 
-        virtual void Process( const Event& e ) override
+        static bool ParseLevel( const std::string& text, Level& level )
         {
-            // Ignore spans and others.
-            if (e.m_type==EventType::Message)
+            static const char* names[] = { "fatal", "error", "warning", "info", "debug", "verbose", "all" };
+            for (int l=0; l<=(int)Level::All; ++l)
             {
-                printf( "[%8s] %s\n", e.m_category.c_str(), e.m_message.c_str() );
-                fflush(stdout);
-            }
-            else if (e.m_type==EventType::IntValue)
-            {
-                int64_t v = 0;
-                e.DecodeIntData(v);
-                printf( "[%8s] (int) %s : %lld\n", e.m_category.c_str(), e.m_message.c_str(), v );
-                fflush(stdout);
+                if (text==names[l])
+                {
+                    level = (Level)l;
+                    return true;
+                }
             }
+            return false;
         }
-    };
 
-    class FileBin : public Bin
-    {
-    protected:
-        FILE* m_pFile = nullptr;
-        uint64_t m_writtenSize = 0;
-        uint64_t m_writeLimit = 64*1024*1024;
+        //! Maximum level of the events of a category that any bin will process.
+        //! m_levelsMutex must be locked.
+        Level GetCategoryLevel( const std::string& category ) const
+        {
+            auto it = m_categoryLevels.find( category );
+            Level result = it!=m_categoryLevels.end() ? it->second : m_defaultLevel;
 
-        uint8_t m_fileBuffer[1024*1024];
-        uint32_t m_bufferPtr=0;
-        uint32_t m_bufferData=0;
+            Level binsLevel = Level::Fatal;
+            for ( const auto& bin: m_bins )
+            {
+                binsLevel = std::max( binsLevel, bin->GetLevel() );
+            }
 
-#define AXE_FILEBIN_VERSION     2
-#define AXE_FILEBIN_HEADER      "AxeLogBinaryFile"
+            return std::min( result, binsLevel );
+        }
 
+        //! Number of records in the queue. It must be a power of two.
+        static const uint64_t s_queueSize = 8192;
 
-        bool file_write(const void* src, int size)
+        //! Add an event to the queue without taking any lock. It only waits if the queue is full.
+        //! See Dmitry Vyukov's bounded MPMC queue.
+        void AddEvent( EventType type, Level level, const char* category,
+                       const char* message, std::size_t messageSize,
+                       const void* data, std::size_t dataSize )
         {
-            if (!m_pFile) return false;
+            uint64_t pos;
+            EventRecord* record = BeginEvent( pos );
 
-            // does it fit?
-            int dataLeft = sizeof(m_fileBuffer)-m_bufferPtr;
-            if (dataLeft<size)
-            {
-                flush_write_buffer();
-            }
+            char* payload = InitRecord( *record, type, level, category, messageSize, dataSize );
+            if (messageSize) memcpy( payload, message, messageSize );
+            if (dataSize) memcpy( payload+messageSize, data, dataSize );
 
-            // big write?
-            if (size>sizeof(m_fileBuffer))
+            EndEvent( *record, pos, level );
+        }
+
+        //! Claim the next record of the queue.
+        EventRecord* BeginEvent( uint64_t& pos )
+        {
+            EventRecord* record = nullptr;
+            pos = m_enqueuePos.load(std::memory_order_relaxed);
+            while (true)
             {
-                // direct write
-                int written = (int)fwrite( src, size, 1 , m_pFile );
-                if (written!=1)
+                record = &m_records[pos & (s_queueSize-1)];
+                uint64_t sequence = record->m_sequence.load(std::memory_order_acquire);
+                int64_t dif = (int64_t)sequence - (int64_t)pos;
+                if (dif==0)
                 {
-                    fclose(m_pFile);
-                    m_pFile = nullptr;
-                    return false;
+                    if (m_enqueuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (dif<0)
+                {
+                    // Full: wait for the writer.
+                    WakeWriter();
+                    std::this_thread::yield();
+                    pos = m_enqueuePos.load(std::memory_order_relaxed);
+                }
+                else
+                {
+                    pos = m_enqueuePos.load(std::memory_order_relaxed);
                 }
-                return true;
             }
 
-            memcpy(&m_fileBuffer[m_bufferPtr], src, size);
-            m_bufferPtr+=size;
-            return true;
+            return record;
         }
 
-        void flush_write_buffer()
+        //! Fill in a claimed record and copy the category.
+        //! \return where the message and then the data have to be copied.
+        char* InitRecord( EventRecord& record, EventType type, Level level, const char* category,
+                          std::size_t messageSize, std::size_t dataSize )
         {
-            if (m_pFile && m_bufferPtr)
+            auto now = std::chrono::steady_clock::now();
+            std::size_t categorySize = category ? strlen(category) : 0;
+
+            record.m_time = std::chrono::duration_cast<std::chrono::microseconds>(now - startWallTime).count();
+            ThreadState& thread = GetThreadState();
+            record.m_thread = thread.m_index;
+            record.m_depth = (uint32_t)thread.m_sections.size();
+            record.m_level = level;
+            record.m_type = type;
+            record.m_categorySize = (uint32_t)categorySize;
+            record.m_messageSize = (uint32_t)messageSize;
+            record.m_dataSize = (uint32_t)dataSize;
+            record.m_overflow = nullptr;
+            record.m_deferred = false;
+
+            char* payload = record.m_payload;
+            if ( categorySize+messageSize+dataSize > sizeof(record.m_payload) )
             {
-                fwrite( m_fileBuffer, 1, m_bufferPtr, m_pFile );
-                m_bufferPtr = 0;
+                record.m_overflow = new char[categorySize+messageSize+dataSize];
+                payload = record.m_overflow;
             }
-        }
+            if (categorySize) memcpy( payload, category, categorySize );
 
+            return payload+categorySize;
+        }
 
-        FileBin()
+        //! Publish a filled record to the writer.
+        void EndEvent( EventRecord& record, uint64_t pos, Level level )
         {
+            // Sequentially consistent, so that it can't be reordered with the check below while the
+            // writer is checking the queue after announcing that it is going to wait.
+            record.m_sequence.store(pos+1, std::memory_order_seq_cst);
+
+            if (m_writerWaiting.load())
+            {
+                WakeWriter();
+            }
+
+            // Make sure that fatal errors are out before the program has a chance to abort. Other
+            // levels never wait for the writer.
+            if (level==Level::Fatal)
+            {
+                Flush();
+            }
         }
 
-    public:
+        void WakeWriter()
+        {
+            std::lock_guard<std::mutex> lock(m_writerMutex);
+            m_writerCondition.notify_one();
+        }
 
-        FileBin(const char* strFileName)
+        //! Take the next event from the queue, if there is one ready.
+        bool PopEvent( Event& e )
         {
-            m_pFile = fopen( strFileName, "wb" );
-            if( !m_pFile )
+            EventRecord& record = m_records[m_dequeuePos & (s_queueSize-1)];
+            uint64_t sequence = record.m_sequence.load(std::memory_order_acquire);
+            if (sequence!=m_dequeuePos+1)
             {
-//                throw FileNotFoundException
-//                        ( boost::str( boost::format("File not found : %s") % strFile ).c_str() );
+                return false;
+            }
 
-//                return boost::shared_array<uint8_t>();
+            const char* payload = record.m_overflow ? record.m_overflow : record.m_payload;
+            e.m_time = record.m_time;
+            e.m_thread = record.m_thread;
+            e.m_depth = record.m_depth;
+            e.m_level = record.m_level;
+            e.m_type = record.m_type;
+            e.m_category.assign( payload, record.m_categorySize );
+            if (record.m_deferred)
+            {
+                const uint8_t* data = (const uint8_t*)payload+record.m_categorySize;
+                const char* formatString;
+                memcpy( &formatString, data, sizeof(formatString) );
+                format::Format( e.m_message, formatString, data+sizeof(formatString), record.m_dataSize-sizeof(formatString) );
+                e.m_format = formatString;
+                e.m_data.assign( data+sizeof(formatString), data+record.m_dataSize );
             }
             else
             {
-                fwrite( AXE_FILEBIN_HEADER, 16, 1 , m_pFile );
-
-                uint32_t ver = AXE_FILEBIN_VERSION;
-                fwrite( &ver, sizeof(uint32_t), 1 , m_pFile );
-
-                m_writtenSize = 20;
+                e.m_format = nullptr;
+                e.m_message.assign( payload+record.m_categorySize, record.m_messageSize );
+                e.m_data.assign( (const uint8_t*)payload+record.m_categorySize+record.m_messageSize,
+                                 (const uint8_t*)payload+record.m_categorySize+record.m_messageSize+record.m_dataSize );
             }
 
+            delete[] record.m_overflow;
+            record.m_overflow = nullptr;
+
+            record.m_sequence.store(m_dequeuePos+s_queueSize, std::memory_order_release);
+            ++m_dequeuePos;
+            return true;
         }
 
-        ~FileBin()
+        //! Feed the queued events to the bins, in the order they were added.
+        void WriterLoop()
         {
-            if (m_pFile)
+            Event e;
+            while (true)
             {
-                flush_write_buffer();
-                fclose(m_pFile);
+                while (PopEvent(e))
+                {
+                    for( auto& bin: m_bins )
+                    {
+                        if (e.m_level<=bin->GetLevel())
+                        {
+                            bin->Process( e );
+                        }
+                    }
+                    m_processed.store( m_dequeuePos );
+                }
+
+                std::unique_lock<std::mutex> lock(m_writerMutex);
+                m_flushedCondition.notify_all();
+
+                if (m_stopWriter)
+                {
+                    break;
+                }
+
+                // Check again after announcing that we are waiting, so that no event is missed.
+                m_writerWaiting.store(true);
+                EventRecord& next = m_records[m_dequeuePos & (s_queueSize-1)];
+                if (next.m_sequence.load()!=m_dequeuePos+1)
+                {
+                    m_writerCondition.wait_for( lock, std::chrono::milliseconds(100) );
+                }
+                m_writerWaiting.store(false);
             }
+
+            // Release the bins in this thread
+            std::lock_guard<std::mutex> lock(m_levelsMutex);
+            m_bins.clear();
         }
 
-        virtual void Process( const Event& e ) override
+        //! Write the metrics file, if there are any metrics.
+        void WriteMetrics()
         {
-            if (m_pFile)
             {
-                uint64_t eventSize =
-                        8   // time
-                        +4  // thread
-                        +1  // level
-                        +1  // type
-                        +4+e.m_category.size()
-                        +4+e.m_message.size()
-                        +4+e.m_data.size()
-                        ;
-                if (m_writtenSize+eventSize>m_writeLimit)
+                std::lock_guard<std::mutex> lock(m_metricsMutex);
+                if (m_metrics.empty() || m_metricsPath.empty())
                 {
-                    fclose(m_pFile);
-                    m_pFile = nullptr;
+                    return;
                 }
-                else
-                {
-                    file_write( &eventSize, sizeof(uint64_t) );
-
-                    file_write( &e.m_time, sizeof(uint64_t) );
-                    file_write( &e.m_thread, sizeof(uint32_t) );
-                    file_write( &e.m_level, sizeof(Level) );
-                    file_write( &e.m_type, sizeof(EventType) );
+            }
 
-                    uint32_t s;
+            std::string text = GetMetricsText();
+            FILE* file = fopen( m_metricsPath.c_str(), "wb" );
+            if (!file)
+            {
+                AddMessage( "axe", EventType::Message, Level::Warning, "Failed to write the metrics to ["+m_metricsPath+"]." );
+                return;
+            }
+            fwrite( text.data(), 1, text.size(), file );
+            fclose( file );
+        }
 
-                    s = (uint32_t)e.m_category.size();
-                    file_write( &s, sizeof(uint32_t) );
-                    if (s>0) file_write( &e.m_category[0], s );
+        //! Serve the metrics over HTTP on a port of the local host. Any request gets them.
+        void StartMetricsServer( int port )
+        {
+#ifdef _WIN32
+            (void)port;
+            AddMessage( "axe", EventType::Message, Level::Warning, "Serving metrics is not supported in this platform." );
+#else
+            int listener = socket( AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0 );
+            int reuse = 1;
+            sockaddr_in address;
+            memset( &address, 0, sizeof(address) );
+            address.sin_family = AF_INET;
+            address.sin_port = htons( (uint16_t)port );
+            address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+            if ( listener<0
+                 || setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse) )!=0
+                 || bind( listener, (sockaddr*)&address, sizeof(address) )!=0
+                 || listen( listener, 8 )!=0 )
+            {
+                AddMessage( "axe", EventType::Message, Level::Warning, "Failed to serve the metrics on port "+std::to_string(port)+": "+strerror(errno) );
+                if (listener>=0) close( listener );
+                return;
+            }
 
-                    s = (uint32_t)e.m_message.size();
-                    file_write( &s, sizeof(uint32_t) );
-                    if (s>0) file_write( &e.m_message[0], s );
+            AddMessage( "axe", EventType::Message, Level::Info, "Serving metrics on http://127.0.0.1:"+std::to_string(port)+"/metrics" );
+            m_metricsServer = std::thread( [this,listener](){ MetricsServerLoop( listener ); } );
+#endif
+        }
 
-                    s = (uint32_t)e.m_data.size();
-                    file_write( &s, sizeof(uint32_t) );
-                    if (s>0) file_write( &e.m_data[0], s );
+#ifndef _WIN32
+        void MetricsServerLoop( int listener )
+        {
+            while (!m_stopMetricsServer)
+            {
+                pollfd p;
+                p.fd = listener;
+                p.events = POLLIN;
+                p.revents = 0;
+                if ( poll( &p, 1, 100 )<=0 )
+                {
+                    continue;
+                }
 
-                    m_writtenSize += sizeof(uint64_t)+eventSize;
+                int client = accept4( listener, nullptr, nullptr, SOCK_CLOEXEC );
+                if (client<0)
+                {
+                    continue;
                 }
-            }
-        }
 
+                // Read until the end of the request headers, but don't wait forever for it.
+                timeval timeout = { 1, 0 };
+                setsockopt( client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout) );
+                std::string request;
+                char buffer[1024];
+                while ( request.find( "\r\n\r\n" )==std::string::npos && request.size()<16*1024 )
+                {
+                    ssize_t count = recv( client, buffer, sizeof(buffer), 0 );
+                    if (count<=0) break;
+                    request.append( buffer, (std::size_t)count );
+                }
 
-     };
+                std::string body = GetMetricsText();
+                std::string response = "HTTP/1.0 200 OK\r\n"
+                                       "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                                       "Content-Length: "+std::to_string(body.size())+"\r\n"
+                                       "Connection: close\r\n\r\n"+body;
+                std::size_t sent = 0;
+                while (sent<response.size())
+                {
+                    ssize_t count = send( client, response.data()+sent, response.size()-sent, MSG_NOSIGNAL );
+                    if (count<=0) break;
+                    sent += (std::size_t)count;
+                }
+                close( client );
+            }
 
-    class Kernel
-    {
-    public:
+            close( listener );
+        }
+#endif
 
-        Kernel(const char* strAppName, const char* strVersion, uint64_t options)
+        //! State of a thread that logs. It is kept by the kernel and not in thread local storage,
+        //! so that all the modules sharing the kernel agree on it.
+        struct ThreadState
         {
-            startWallTime = std::chrono::steady_clock::now();
-
-            // Gather system information
-            std::string machineName = platform::GetHostName();
-            std::string programName = strAppName ? strAppName : "";
-            std::string programVersion = strVersion ? strVersion : "";
+            //! Dense index, in order of first use
+            uint32_t m_index = 0;
 
-            auto t = std::time(nullptr);
-            auto tm = *std::gmtime(&t);
+            //! Names of the sections open in the thread
+            std::vector<std::string> m_sections;
+        };
 
-            std::ostringstream oss;
-            oss << std::put_time(&tm, "%Y_%m_%d-%H_%M_%S");
-            std::string nowStr = oss.str();
+        static uint64_t NewInstance()
+        {
+            static std::atomic<uint64_t> s_instances{0};
+            return ++s_instances;
+        }
 
-            // Default setup
-            m_bins.push_back( std::make_shared<TerminalBin>() );
+        //! Cache of the state of the calling thread, which tells the kernel when the thread ends so
+        //! that a new thread with the same system id gets a new index.
+        struct ThreadCache
+        {
+            Kernel* m_kernel = nullptr;
+            uint64_t m_instance = 0;
+            ThreadState* m_state = nullptr;
 
-            char logFileName[256];
-            if (programVersion.size())
+            ~ThreadCache()
             {
-                snprintf( logFileName, sizeof(logFileName), "%s-%s-%s-%s.axe_log", programName.c_str(), strVersion, machineName.c_str(), nowStr.c_str() );
+                if (m_kernel && m_kernel==s_kernel && m_kernel->m_instance==m_instance)
+                {
+                    m_kernel->ForgetThread();
+                }
             }
-            else
+        };
+
+        ThreadState& GetThreadState()
+        {
+            static thread_local ThreadCache s_cache;
+            if (s_cache.m_kernel!=this || s_cache.m_instance!=m_instance)
             {
-                snprintf( logFileName, sizeof(logFileName), "%s-%s-%s.axe_log", programName.c_str(), machineName.c_str(), nowStr.c_str() );
+                std::lock_guard<std::mutex> lock(m_threadsMutex);
+                std::unique_ptr<ThreadState>& state = m_threadStates[std::this_thread::get_id()];
+                if (!state)
+                {
+                    state.reset( new ThreadState() );
+                    state->m_index = m_nextThreadIndex++;
+                }
+                s_cache.m_kernel = this;
+                s_cache.m_instance = m_instance;
+                s_cache.m_state = state.get();
             }
-            m_bins.push_back( std::make_shared<FileBin>(logFileName) );
+            return *s_cache.m_state;
+        }
 
-            // Initial system logs
-            AddStringValue( "system", Level::Info, "Program", programName );
-            AddStringValue( "system", Level::Info, "Version", programVersion );
-            AddStringValue( "system", Level::Info, "Machine", machineName );
-            AddTimeValue( "system", Level::Info, "StartTime", t );
+        void ForgetThread()
+        {
+            std::lock_guard<std::mutex> lock(m_threadsMutex);
+            m_threadStates.erase( std::this_thread::get_id() );
         }
 
-    private:
+    public:
 
-        inline void AddEvent( const Event& e )
+        void BeginSection( Level level, const char* name )
         {
-            while (m_binsLock.test_and_set(std::memory_order_acquire))  // acquire lock
-                 ; // spin
+            AddMessage( "code", EventType::RecursiveSpanBegin, level, name );
+            GetThreadState().m_sections.push_back( name );
+        }
 
-            for( auto bin: m_bins )
+        //! The end event has the name of the section.
+        void EndSection( Level level )
+        {
+            ThreadState& state = GetThreadState();
+            std::string name;
+            if (state.m_sections.size())
             {
-                bin->Process( e );
+                name.swap( state.m_sections.back() );
+                state.m_sections.pop_back();
             }
+            AddMessage( "code", EventType::RecursiveSpanEnd, level, name );
+        }
 
-            m_binsLock.clear(std::memory_order_release);               // release lock
+        //! Name the calling thread, like "worker-3", in the logs.
+        void SetThreadName( const std::string& name )
+        {
+            AddMessage( "axe", EventType::ThreadName, Level::Info, name );
         }
 
-        void InitEvent( Event& e )
+        void AddMessage( const char* category, EventType type, Level level, const std::string& message )
         {
-            auto now = std::chrono::steady_clock::now();
-            e.m_time = std::chrono::duration_cast<std::chrono::microseconds>(now - startWallTime).count();
-            e.m_thread = std::this_thread::get_id();
+            AddEvent( type, level, category, message.data(), message.size(), nullptr, 0 );
         }
 
-    public:
+        void AddMessage( const char* category, EventType type, Level level, const char* message )
+        {
+            AddEvent( type, level, category, message, message ? strlen(message) : 0, nullptr, 0 );
+        }
 
-        void AddMessage( const char* category, EventType type, Level level, const std::string& message )
+        //! Add a message to be formatted by the writer thread. Only the arguments are copied here,
+        //! so the format string must live as long as the kernel, like string literals do.
+        void AddFormattedMessage( const char* category, Level level, const char* formatString,
+                                  const format::Arg* args, std::size_t count )
         {
-            Event e;
-            InitEvent(e);
-            e.m_type = type;
-            e.m_level = level;
-            e.m_category = category;
-            e.m_message = message;
-            AddEvent(e);
+            std::size_t dataSize = sizeof(formatString) + format::GetEncodedSize( args, count );
+
+            uint64_t pos;
+            EventRecord* record = BeginEvent( pos );
+
+            uint8_t* data = (uint8_t*)InitRecord( *record, EventType::Message, level, category, 0, dataSize );
+            memcpy( data, &formatString, sizeof(formatString) );
+            format::Encode( data+sizeof(formatString), args, count );
+            record->m_deferred = true;
+
+            EndEvent( *record, pos, level );
         }
 
         void AddStringValue( const char* category, Level level, const std::string& field, const std::string& value )
         {
-            Event e;
-            InitEvent(e);
-            e.m_type = EventType::StringValue;
-            e.m_level = level;
-            e.m_category = category;
-            e.m_message = field;
-            e.EncodeStringData(value);
-            AddEvent(e);
+            AddEvent( EventType::StringValue, level, category, field.data(), field.size(), value.data(), value.size() );
         }
 
         void AddTimeValue( const char* category, Level level, const std::string& field, const std::time_t& value )
         {
-            Event e;
-            InitEvent(e);
-            e.m_type = EventType::TimeValue;
-            e.m_level = level;
-            e.m_category = category;
-            e.m_message = field;
-            e.EncodeTimeData(value);
-            AddEvent(e);
+            uint64_t seconds = (uint64_t)value;
+            AddEvent( EventType::TimeValue, level, category, field.data(), field.size(), &seconds, sizeof(seconds) );
         }
 
         void AddIntValue( const char* category, Level level, const std::string& field, int64_t value )
         {
-            Event e;
-            InitEvent(e);
-            e.m_type = EventType::IntValue;
-            e.m_level = level;
-            e.m_category = category;
-            e.m_message = field;
-            e.EncodeIntData(value);
-            AddEvent(e);
+            AddEvent( EventType::IntValue, level, category, field.data(), field.size(), &value, sizeof(value) );
         }
 
         void AddFloatValue( const char* category, Level level, const std::string& field, float value )
         {
-            Event e;
-            InitEvent(e);
-            e.m_type = EventType::IntValue;
-            e.m_level = level;
-            e.m_category = category;
-            e.m_message = field;
-            e.EncodeFloatData(value);
-            AddEvent(e);
+            AddEvent( EventType::IntValue, level, category, field.data(), field.size(), &value, sizeof(value) );
         }
 
     private:
 
-        std::atomic_flag m_binsLock = ATOMIC_FLAG_INIT;
+        std::unique_ptr<EventRecord[]> m_records;
+        std::atomic<uint64_t> m_enqueuePos{0};
+
+        //! Only used by the writer thread
+        uint64_t m_dequeuePos = 0;
+
+        //! Number of events already processed by the bins
+        std::atomic<uint64_t> m_processed{0};
+
+        std::thread m_writer;
+        std::mutex m_writerMutex;
+        std::condition_variable m_writerCondition;
+        std::condition_variable m_flushedCondition;
+        std::atomic<bool> m_writerWaiting{false};
+        bool m_stopWriter = false;
 
         std::vector< std::shared_ptr<Bin> > m_bins;
 
+        //! Runtime levels, and the logging call sites using them.
+        std::mutex m_levelsMutex;
+        Level m_defaultLevel = Level::All;
+        std::map<std::string,Level> m_categoryLevels;
+        std::map<CategoryFilter*,std::string> m_filters;
+
+        //! Running threads that logged something, by system id
+        uint64_t m_instance = NewInstance();
+        std::mutex m_threadsMutex;
+        std::unordered_map<ThreadId,std::unique_ptr<ThreadState>> m_threadStates;
+        uint32_t m_nextThreadIndex = 0;
+
+        //! Metrics by name, sorted for the export
+        std::mutex m_metricsMutex;
+        std::map<std::string,std::unique_ptr<Metric>> m_metrics;
+        std::string m_metricsPath;
+        std::thread m_metricsServer;
+        std::atomic<bool> m_stopMetricsServer{false};
+
         std::chrono::time_point<std::chrono::steady_clock> startWallTime;
     };
 
 
-    inline void log( const char* category, Level level, const char* message, ... )
+    inline bool CategoryFilter::IsEnabled( const char* category, Level level )
     {
-        if (s_kernel)
+        uint8_t threshold = m_level.load( std::memory_order_relaxed );
+        if (threshold==s_unregistered)
         {
-            va_list args;
-            va_start(args, message);
+            if (!s_kernel)
+            {
+                return false;
+            }
+            threshold = (uint8_t)s_kernel->RegisterFilter( this, category );
+        }
+        return (uint8_t)level<=threshold;
+    }
 
-            char temp[256];
-            vsnprintf( temp, sizeof(temp), message, args );
-            s_kernel->AddMessage( category, EventType::Message, level, temp );
 
-            va_end(args);
+    inline Metric* MetricHandle::Get( const char* name, MetricType type )
+    {
+        if (!s_kernel)
+        {
+            return nullptr;
+        }
+
+        // The kernel may have been replaced since the metric was registered.
+        uint64_t instance = s_kernel->GetInstance();
+        if (m_instance.load( std::memory_order_acquire )!=instance)
+        {
+            m_metric.store( s_kernel->GetMetric( name, type ), std::memory_order_relaxed );
+            m_instance.store( instance, std::memory_order_release );
+        }
+        return m_metric.load( std::memory_order_relaxed );
+    }
+
+
+    inline void set_thread_name( const char* name )
+    {
+        if (s_kernel && name)
+        {
+            s_kernel->SetThreadName( name );
         }
     }
 
+    //! Set the runtime levels of categories and bins. See Kernel::SetLevels.
+    inline bool set_levels( const char* spec )
+    {
+        return s_kernel && spec && s_kernel->SetLevels( spec );
+    }
+
 
-    inline void log( const char* category, Level level, std::string message, ... )
+    inline void log( const char* category, Level level, const char* message )
     {
         if (s_kernel)
         {
-            va_list args;
-            va_start(args, message);
+            s_kernel->AddMessage( category, EventType::Message, level, message );
+        }
+    }
 
-            char temp[256];
-            vsnprintf( temp, sizeof(temp), message.c_str(), args );
-            s_kernel->AddMessage( category, EventType::Message, level, temp );
 
-            va_end(args);
+    //! Log a printf style message. The arguments are copied with their types and the message is
+    //! only formatted by the writer thread.
+    template<typename... Args>
+    inline void log( const char* category, Level level, const char* message, const Args&... args )
+    {
+        if (s_kernel)
+        {
+            format::Arg list[] = { format::MakeArg(args)..., format::Arg() };
+            s_kernel->AddFormattedMessage( category, level, message, list, sizeof...(Args) );
+        }
+    }
+
+
+    //! Log a printf style message with a format string that may not outlive the call, so it is
+    //! formatted right away.
+    template<typename... Args>
+    inline void log( const char* category, Level level, const std::string& message, const Args&... args )
+    {
+        if (s_kernel)
+        {
+            format::Arg list[] = { format::MakeArg(args)..., format::Arg() };
+            std::vector<uint8_t> data( format::GetEncodedSize( list, sizeof...(Args) ) );
+            format::Encode( data.data(), list, sizeof...(Args) );
+
+            std::string text;
+            format::Format( text, message.c_str(), data.data(), data.size() );
+            s_kernel->AddMessage( category, EventType::Message, level, text );
         }
     }
 
@@ -638,7 +2412,7 @@ namespace axe
     {
         if (s_kernel)
         {
-            s_kernel->AddMessage( "code", axe::EventType::RecursiveSpanBegin, level, name );
+            s_kernel->BeginSection( level, name );
         }
     }
 
@@ -647,7 +2421,7 @@ namespace axe
     {
         if (s_kernel)
         {
-            s_kernel->AddMessage( "code", axe::EventType::RecursiveSpanEnd, level, "" );
+            s_kernel->EndSection( level );
         }
     }
 
@@ -719,6 +2493,12 @@ namespace axe
 #define AXE_STRING_VALUE(CAT,LEVEL,KEY,VALUE)
 #define AXE_INT_VALUE(CAT,LEVEL,KEY,VALUE)
 #define AXE_FLOAT_VALUE(CAT,LEVEL,KEY,VALUE)
+#define AXE_SET_LEVELS(SPEC)
+#define AXE_SET_THREAD_NAME(NAME)
+#define AXE_COUNTER_ADD(NAME,VALUE)
+#define AXE_GAUGE_ADD(NAME,VALUE)
+#define AXE_GAUGE_SET(NAME,VALUE)
+#define AXE_HISTOGRAM_RECORD(NAME,VALUE)
 
 #else
 
@@ -741,24 +2521,36 @@ namespace axe
 #define AXE_NUMARGS(...) (std::tuple_size<decltype(std::make_tuple(__VA_ARGS__))>::value)
 
 
+//! Compile time and runtime level check of a logging call site, done before evaluating anything
+#define AXE_IS_ENABLED(CAT,LEVEL)                                       \
+    (LEVEL<=AXE_COMPILE_LEVEL_LIMIT                                     \
+     && [](const char* c, axe::Level l)                                 \
+        { static axe::CategoryFilter f; return f.IsEnabled(c,l); }(CAT,LEVEL))
+
 #define AXE_LOG(CAT,LEVEL,...)                          \
-    if (LEVEL<=AXE_COMPILE_LEVEL_LIMIT)                 \
+    do                                                  \
     {                                                   \
-        if (AXE_NUMARGS(__VA_ARGS__)>1)                 \
-        {                                               \
-            axe::log( CAT, LEVEL, __VA_ARGS__);         \
-        }                                               \
-        else                                            \
+        if (AXE_IS_ENABLED(CAT,LEVEL))                  \
         {                                               \
-            axe::log_single( CAT, LEVEL, __VA_ARGS__ ); \
+            if (AXE_NUMARGS(__VA_ARGS__)>1)             \
+            {                                           \
+                axe::log( CAT, LEVEL, __VA_ARGS__);     \
+            }                                           \
+            else                                        \
+            {                                           \
+                axe::log_single( CAT, LEVEL, __VA_ARGS__ ); \
+            }                                           \
         }                                               \
-    }
+    } while (0)
 
 #define AXE_LOG_LINES(CAT,LEVEL,TEXT)                   \
-    if (LEVEL<=AXE_COMPILE_LEVEL_LIMIT)                 \
+    do                                                  \
     {                                                   \
-        axe::log_lines( CAT, LEVEL, TEXT);              \
-    }
+        if (AXE_IS_ENABLED(CAT,LEVEL))                  \
+        {                                               \
+            axe::log_lines( CAT, LEVEL, TEXT);          \
+        }                                               \
+    } while (0)
 
 #define AXE_DECLARE_SECTION(TAG,NAME)
 #define AXE_BEGIN_SECTION(TAG)                      axe::begin_section(TAG,axe::Level::Debug)
@@ -772,9 +2564,22 @@ namespace axe
 
 #define AXE_DECLARE_CATEGORY(TAG,NAME)
 
-#define AXE_STRING_VALUE(CAT,LEVEL,KEY,VALUE)       axe::log_string_value(CAT,LEVEL,KEY,VALUE)
-#define AXE_INT_VALUE(CAT,LEVEL,KEY,VALUE)          axe::log_int_value(CAT,LEVEL,KEY,VALUE)
-#define AXE_FLOAT_VALUE(CAT,LEVEL,KEY,VALUE)        axe::log_float_value(CAT,LEVEL,KEY,VALUE)
+#define AXE_STRING_VALUE(CAT,LEVEL,KEY,VALUE)       do { if (AXE_IS_ENABLED(CAT,LEVEL)) axe::log_string_value(CAT,LEVEL,KEY,VALUE); } while (0)
+#define AXE_INT_VALUE(CAT,LEVEL,KEY,VALUE)          do { if (AXE_IS_ENABLED(CAT,LEVEL)) axe::log_int_value(CAT,LEVEL,KEY,VALUE); } while (0)
+#define AXE_FLOAT_VALUE(CAT,LEVEL,KEY,VALUE)        do { if (AXE_IS_ENABLED(CAT,LEVEL)) axe::log_float_value(CAT,LEVEL,KEY,VALUE); } while (0)
+
+#define AXE_SET_LEVELS(SPEC)                        axe::set_levels(SPEC)
+#define AXE_SET_THREAD_NAME(NAME)                   axe::set_thread_name(NAME)
+
+//! Metric of a call site. The name has to be a constant, like "craft_process_spawns".
+#define AXE_METRIC(NAME,TYPE)                                           \
+    [](const char* n, axe::MetricType t)                                \
+        { static axe::MetricHandle h; return h.Get(n,t); }(NAME,TYPE)
+
+#define AXE_COUNTER_ADD(NAME,VALUE)         do { if (axe::Metric* axe_metric = AXE_METRIC(NAME,axe::MetricType::Counter)) axe_metric->Add(VALUE); } while (0)
+#define AXE_GAUGE_ADD(NAME,VALUE)           do { if (axe::Metric* axe_metric = AXE_METRIC(NAME,axe::MetricType::Gauge)) axe_metric->Add(VALUE); } while (0)
+#define AXE_GAUGE_SET(NAME,VALUE)           do { if (axe::Metric* axe_metric = AXE_METRIC(NAME,axe::MetricType::Gauge)) axe_metric->Set(VALUE); } while (0)
+#define AXE_HISTOGRAM_RECORD(NAME,VALUE)    do { if (axe::Metric* axe_metric = AXE_METRIC(NAME,axe::MetricType::Histogram)) axe_metric->Record(VALUE); } while (0)
 
 #endif //AXE_ENABLE
 
@@ -28,17 +28,123 @@
 #include <climits>
 #include <cstring>
 
+#include <limits>
+#include <map>
+#include <cmath>
+#include <unordered_map>
+
+#include <sys/stat.h>
+
+#ifndef _WIN32
+    #include <dirent.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+#endif
+
 
 namespace axe
 {
 
+    //! Find the numbers of the segments that continue a log file, in order.
+    inline std::vector<uint32_t> FindLogSegments(const std::string& filePath)
+    {
+        std::vector<uint32_t> result;
+
+        std::string::size_type separator = filePath.find_last_of("/\\");
+        std::string folder = separator==std::string::npos ? "." : filePath.substr(0, separator+1);
+        std::string prefix = (separator==std::string::npos ? filePath : filePath.substr(separator+1)) + ".";
+
+        auto check = [&](const char* name)
+        {
+            if (strncmp(name, prefix.c_str(), prefix.size())) return;
+            const char* number = name+prefix.size();
+            if (!*number || strspn(number, "0123456789")!=strlen(number)) return;
+            result.push_back((uint32_t)strtoul(number, nullptr, 10));
+        };
+
+#ifdef _WIN32
+        WIN32_FIND_DATAA data;
+        HANDLE find = FindFirstFileA((filePath+".*").c_str(), &data);
+        if (find!=INVALID_HANDLE_VALUE)
+        {
+            do
+            {
+                check(data.cFileName);
+            }
+            while (FindNextFileA(find, &data));
+            FindClose(find);
+        }
+#else
+        DIR* dir = opendir(folder.c_str());
+        if (dir)
+        {
+            while (dirent* entry = readdir(dir))
+            {
+                check(entry->d_name);
+            }
+            closedir(dir);
+        }
+#endif
+
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    //! Decompress a segment compressed by FileBin, given the data after its header.
+    inline bool DecompressLogSegment(const uint8_t* data, std::size_t size, std::vector<uint8_t>& result)
+    {
+        const uint8_t* end = data+size;
+        uint32_t version;
+        if (size<sizeof(version)) return false;
+        memcpy(&version, data, sizeof(version));
+        data += sizeof(version);
+        if (version!=AXE_FILEBIN_COMPRESSED_VERSION) return false;
+
+        result.clear();
+        while (data<end)
+        {
+            uint32_t rawSize, storedSize;
+            if (std::size_t(end-data)<2*sizeof(uint32_t)) return false;
+            memcpy(&rawSize, data, sizeof(rawSize));
+            memcpy(&storedSize, data+sizeof(rawSize), sizeof(storedSize));
+            data += 2*sizeof(uint32_t);
+            if (std::size_t(end-data)<storedSize) return false;
+
+            std::size_t offset = result.size();
+            result.resize(offset+rawSize);
+            if (storedSize==rawSize)
+            {
+                if (rawSize) memcpy(&result[offset], data, rawSize);
+            }
+            else if (!lz::Decompress(data, storedSize, &result[offset], rawSize))
+            {
+                return false;
+            }
+            data += storedSize;
+        }
+        return true;
+    }
+
 
     class ReadableFileBin : public FileBin
     {
     private:
 
+        //! Decompressed segment, read instead of the file if m_fromMemory is set.
+        std::vector<uint8_t> m_memory;
+        std::size_t m_memoryPtr = 0;
+        bool m_fromMemory = false;
+
         bool file_read(void* dst, int size)
         {
+            if (m_fromMemory)
+            {
+                if (m_memory.size()-m_memoryPtr<(std::size_t)size) return false;
+                memcpy(dst, m_memory.data()+m_memoryPtr, size);
+                m_memoryPtr+=size;
+                return true;
+            }
+
             if (!m_pFile) return false;
 
             // partial copy
@@ -88,44 +194,68 @@ namespace axe
         }
 
 
-        bool InternalLoadEvents(const char* filePath, std::vector<Event>& result)
+        bool file_read_varint(uint64_t& value)
         {
-            m_pFile = fopen( filePath, "rb" );
-            if( !m_pFile )
-            {
-                return false;
-            }
-
-            char header[16];
-            if (!file_read(header, 16))
+            value = 0;
+            for (int shift=0; shift<64; shift+=7)
             {
-                fclose(m_pFile);
-                m_pFile = nullptr;
-                return false;
+                uint8_t byte;
+                if (!file_read(&byte, 1)) return false;
+                value |= uint64_t(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) return true;
             }
+            return false;
+        }
 
-            if (memcmp(header,AXE_FILEBIN_HEADER,16))
-            {
-                fclose(m_pFile);
-                m_pFile = nullptr;
-                return false;
-            }
+        bool file_read_string(std::string& text)
+        {
+            uint64_t size;
+            if (!file_read_varint(size)) return false;
+            text.resize((std::size_t)size);
+            return !size || file_read(&text[0], (int)size);
+        }
 
-            uint32_t version=0;
-            if (!file_read(&version, sizeof(uint32_t)))
+        //! Read the varint arguments of a format back into the encoding of axe::format.
+        bool file_read_arguments(std::vector<uint8_t>& data)
+        {
+            uint64_t count;
+            if (!file_read_varint(count)) return false;
+            for (uint64_t a=0; a<count; ++a)
             {
-                fclose(m_pFile);
-                m_pFile = nullptr;
-                return false;
-            }
+                uint8_t type;
+                if (!file_read(&type, 1)) return false;
+                data.push_back(type);
 
-            if (version!=AXE_FILEBIN_VERSION)
-            {
-                fclose(m_pFile);
-                m_pFile = nullptr;
-                return false;
+                uint64_t value = 0;
+                if (type==uint8_t(format::ArgType::String))
+                {
+                    std::string text;
+                    if (!file_read_string(text)) return false;
+                    uint32_t size = (uint32_t)text.size();
+                    data.insert(data.end(), (const uint8_t*)&size, (const uint8_t*)&size+4);
+                    data.insert(data.end(), text.begin(), text.end());
+                    continue;
+                }
+                else if (type==uint8_t(format::ArgType::Float))
+                {
+                    if (!file_read(&value, 8)) return false;
+                }
+                else
+                {
+                    if (!file_read_varint(value)) return false;
+                    if (type==uint8_t(format::ArgType::Signed))
+                    {
+                        value = uint64_t( int64_t(value>>1) ^ -int64_t(value&1) );
+                    }
+                }
+                data.insert(data.end(), (const uint8_t*)&value, (const uint8_t*)&value+8);
             }
+            return true;
+        }
 
+        //! Fixed size events with inline strings.
+        void LoadEventsV2(std::vector<Event>& result)
+        {
             while (true)
             {
                 // read one event
@@ -166,12 +296,190 @@ namespace axe
                     if (!file_read( &e.m_data[0], textSize)) break;
                 }
             }
+        }
+
+        //! Thread indices given to the system thread ids of version 3 logs
+        std::unordered_map<uint64_t,uint32_t> m_threadIndices;
+
+        //! Records with dictionaries of strings and threads, see FileBin.
+        void LoadEventsV3(std::vector<Event>& result, uint32_t version)
+        {
+            std::vector<std::string> strings;
+            std::vector<uint32_t> threads;
+            AxeTime time = 0;
+
+            while (true)
+            {
+                uint8_t tag;
+                if (!file_read(&tag, 1)) break;
+
+                if (tag==uint8_t(FileBinTag::String))
+                {
+                    strings.push_back(std::string());
+                    if (!file_read_string(strings.back())) break;
+                    continue;
+                }
+
+                if (tag==uint8_t(FileBinTag::Thread))
+                {
+                    uint64_t id;
+                    if (!file_read(&id, sizeof(id))) break;
+                    if (version<4)
+                    {
+                        id = m_threadIndices.insert(std::make_pair(id, (uint32_t)m_threadIndices.size())).first->second;
+                    }
+                    threads.push_back((uint32_t)id);
+                    continue;
+                }
+
+                if (tag!=uint8_t(FileBinTag::Event)) break;
+
+                uint8_t levelAndType, flags;
+                uint64_t delta, thread, depth=0, category, message, dataSize;
+                if (!file_read(&levelAndType, 1)) break;
+                if (!file_read(&flags, 1)) break;
+                if (!file_read_varint(delta)) break;
+                if (!file_read_varint(thread) || thread>=threads.size()) break;
+                if (version>=4 && !file_read_varint(depth)) break;
+                if (!file_read_varint(category) || category>=strings.size()) break;
+
+                Event e;
+                e.m_level = Level(levelAndType & 0xf);
+                e.m_type = EventType(levelAndType >> 4);
+                time += AxeTime( int64_t(delta>>1) ^ -int64_t(delta&1) );
+                e.m_time = time;
+                e.m_thread = threads[thread];
+                e.m_depth = (uint32_t)depth;
+                e.m_category = strings[category];
+
+                if (flags & FileBinFlags::Interned)
+                {
+                    if (!file_read_varint(message) || message>=strings.size()) break;
+                }
+                else
+                {
+                    // Formats are always interned
+                    if (flags & FileBinFlags::Formatted) break;
+                    if (!file_read_string(e.m_message)) break;
+                }
+
+                if (flags & FileBinFlags::Formatted)
+                {
+                    if (!file_read_arguments(e.m_data)) break;
+                    format::Format(e.m_message, strings[message].c_str(), e.m_data.data(), e.m_data.size());
+                    e.m_data.clear();
+                }
+                else
+                {
+                    if (!file_read_varint(dataSize)) break;
+                    e.m_data.resize((std::size_t)dataSize);
+                    if (dataSize && !file_read(&e.m_data[0], (int)dataSize)) break;
+
+                    if (flags & FileBinFlags::Interned)
+                    {
+                        e.m_message = strings[message];
+                    }
+                }
+
+                result.push_back(std::move(e));
+            }
+        }
+
+
+        //! Replace the open file with its decompressed contents in memory.
+        bool decompress_segment()
+        {
+            std::vector<uint8_t> compressed;
+            uint8_t block[64*1024];
+            while (true)
+            {
+                int dataLeft = m_bufferData-m_bufferPtr;
+                if (dataLeft>0)
+                {
+                    compressed.insert(compressed.end(), &m_fileBuffer[m_bufferPtr], &m_fileBuffer[m_bufferPtr]+dataLeft);
+                    m_bufferPtr = m_bufferData;
+                }
+                std::size_t count = fread(block, 1, sizeof(block), m_pFile);
+                if (!count) break;
+                compressed.insert(compressed.end(), block, block+count);
+            }
+
+            fclose(m_pFile);
+            m_pFile = nullptr;
+
+            if (!DecompressLogSegment(compressed.data(), compressed.size(), m_memory))
+            {
+                return false;
+            }
+            m_fromMemory = true;
+            m_memoryPtr = 0;
+            return true;
+        }
+
+        //! Load the events of a single segment, compressed or not.
+        bool LoadSegment(const std::string& filePath, std::vector<Event>& result)
+        {
+            m_bufferPtr = 0;
+            m_bufferData = 0;
+            m_fromMemory = false;
+
+            m_pFile = fopen( filePath.c_str(), "rb" );
+            if( !m_pFile )
+            {
+                return false;
+            }
+
+            bool valid = true;
+            char header[16];
+            if (!file_read(header, 16))
+            {
+                valid = false;
+            }
+            else if (!memcmp(header,AXE_FILEBIN_COMPRESSED_HEADER,16))
+            {
+                valid = decompress_segment() && file_read(header, 16);
+            }
+
+            uint32_t version=0;
+            valid = valid
+                    && !memcmp(header,AXE_FILEBIN_HEADER,16)
+                    && file_read(&version, sizeof(uint32_t));
+
+            if (valid && version==2)
+            {
+                LoadEventsV2(result);
+            }
+            else if (valid && version>=3 && version<=AXE_FILEBIN_VERSION)
+            {
+                LoadEventsV3(result, version);
+            }
+            else
+            {
+                valid = false;
+            }
 
             if (m_pFile)
             {
                 fclose(m_pFile);
                 m_pFile = nullptr;
             }
+            m_fromMemory = false;
+            m_memory.clear();
+            return valid;
+        }
+
+        bool InternalLoadEvents(const char* filePath, std::vector<Event>& result)
+        {
+            if (!LoadSegment(filePath, result))
+            {
+                return false;
+            }
+
+            // The rest of the segments, if the log was long enough to be split
+            for (uint32_t segment: FindLogSegments(filePath))
+            {
+                LoadSegment(std::string(filePath)+"."+std::to_string(segment), result);
+            }
             return true;
         }
 
@@ -192,5 +500,1165 @@ namespace axe
 
      };
 
+    //! Characters inside the data of a MappedLog.
+    struct StringView
+    {
+        const char* m_data = nullptr;
+        std::size_t m_size = 0;
+
+        std::string str() const { return std::string(m_data, m_size); }
+        bool operator==(const char* text) const { return strlen(text)==m_size && !memcmp(m_data, text, m_size); }
+        bool operator!=(const char* text) const { return !(*this==text); }
+    };
+
+    //! Event pointing inside the data of a MappedLog, valid while the log is open.
+    struct EventView
+    {
+        AxeTime m_time = 0;
+        uint32_t m_thread = 0;
+        uint32_t m_depth = 0;
+        Level m_level = Level::Fatal;
+        EventType m_type = EventType::Null;
+        StringView m_category;
+
+        //! The format if m_formatted is set, with the arguments in m_data as written by FileBin.
+        StringView m_message;
+        bool m_formatted = false;
+
+        const uint8_t* m_data = nullptr;
+        std::size_t m_dataSize = 0;
+
+        //! Message of the event, formatting it if needed.
+        std::string GetMessage() const;
+    };
+
+    //!
+    //! \brief Log reader for big files. The segments of the log are memory mapped, and a sparse
+    //! index of them is built the first time and saved next to the log. Events are returned as
+    //! views of the mapped data, and only the blocks of events that can match a query are decoded.
+    //! Logs older than version 3 are not supported; they can be read with ReadableFileBin.
+    //!
+    class MappedLog
+    {
+    public:
+
+        //! Events in a time range, optionally of a single category and thread.
+        struct Query
+        {
+            AxeTime m_begin = std::numeric_limits<AxeTime>::min();
+            AxeTime m_end = std::numeric_limits<AxeTime>::max();
+            const char* m_category = nullptr;
+            int m_thread = -1;
+        };
+
+        MappedLog() {}
+        MappedLog(const MappedLog&) = delete;
+        MappedLog& operator=(const MappedLog&) = delete;
+
+        ~MappedLog()
+        {
+            Close();
+        }
+
+        //! Map a log and all its segments, and load or build its index.
+        bool Open(const std::string& filePath)
+        {
+            Close();
+
+            std::vector<uint32_t> numbers = FindLogSegments(filePath);
+            numbers.insert(numbers.begin(), 0);
+            for (uint32_t number: numbers)
+            {
+                std::string path = number ? filePath+"."+std::to_string(number) : filePath;
+                m_segments.push_back(Segment());
+                Segment& segment = m_segments.back();
+                segment.m_number = number;
+                if (!MapSegment(path, segment))
+                {
+                    if (!number)
+                    {
+                        Close();
+                        return false;
+                    }
+                    m_segments.pop_back();
+                }
+            }
+
+            std::string indexPath = filePath+".axe_index";
+            if (!LoadIndex(indexPath))
+            {
+                BuildIndex();
+                SaveIndex(indexPath);
+            }
+            return true;
+        }
+
+        void Close()
+        {
+            for (auto& segment: m_segments)
+            {
+                UnmapSegment(segment);
+            }
+            m_segments.clear();
+            m_blocks.clear();
+            m_categories.clear();
+            m_categoryBlocks.clear();
+            m_threads.clear();
+            m_threadBlocks.clear();
+        }
+
+        //! Call a function with every event matching the query, in the order of the log.
+        template<class F>
+        void ForEach(const Query& query, F function) const
+        {
+            const std::vector<uint32_t>* candidates = nullptr;
+            if (query.m_category)
+            {
+                auto it = std::find(m_categories.begin(), m_categories.end(), std::string(query.m_category));
+                if (it==m_categories.end()) return;
+                candidates = &m_categoryBlocks[it-m_categories.begin()];
+            }
+            if (query.m_thread>=0)
+            {
+                if ((std::size_t)query.m_thread>=m_threads.size()) return;
+                const std::vector<uint32_t>& threadBlocks = m_threadBlocks[query.m_thread];
+                if (!candidates || threadBlocks.size()<candidates->size())
+                {
+                    candidates = &threadBlocks;
+                }
+            }
+
+            auto visit = [&](uint32_t b)
+            {
+                const Block& block = m_blocks[b];
+                if (block.m_maxTime<query.m_begin || block.m_minTime>query.m_end) return;
+                DecodeBlock(block, [&](const EventView& e)
+                {
+                    if (e.m_time<query.m_begin || e.m_time>query.m_end) return;
+                    if (query.m_thread>=0 && e.m_thread!=(uint32_t)query.m_thread) return;
+                    if (query.m_category && e.m_category!=query.m_category) return;
+                    function(e);
+                });
+            };
+
+            if (candidates)
+            {
+                for (uint32_t b: *candidates) visit(b);
+            }
+            else
+            {
+                for (uint32_t b=0; b<m_blocks.size(); ++b) visit(b);
+            }
+        }
+
+        std::vector<EventView> Find(const Query& query) const
+        {
+            std::vector<EventView> result;
+            ForEach(query, [&](const EventView& e){ result.push_back(e); });
+            return result;
+        }
+
+        std::size_t GetEventCount() const
+        {
+            std::size_t result = 0;
+            for (const auto& block: m_blocks) result += block.m_eventCount;
+            return result;
+        }
+
+        //! Ids of the threads as written by FileBin, by the index used in the events. They are the
+        //! thread indices of the kernel since version 4.
+        const std::vector<uint64_t>& GetThreads() const { return m_threads; }
+
+        const std::vector<std::string>& GetCategories() const { return m_categories; }
+
+        //! Varint helpers shared with the event views
+        static bool ReadVarint(const uint8_t*& p, const uint8_t* end, uint64_t& value)
+        {
+            value = 0;
+            for (int shift=0; shift<64 && p<end; shift+=7)
+            {
+                uint8_t byte = *p++;
+                value |= uint64_t(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) return true;
+            }
+            return false;
+        }
+
+        //! Convert the varint arguments of a format back into the encoding of axe::format.
+        static bool DecodeArguments(const uint8_t*& p, const uint8_t* end, std::vector<uint8_t>& data)
+        {
+            uint64_t count;
+            if (!ReadVarint(p, end, count)) return false;
+            for (uint64_t a=0; a<count; ++a)
+            {
+                if (p==end) return false;
+                uint8_t type = *p++;
+                data.push_back(type);
+
+                uint64_t value = 0;
+                if (type==uint8_t(format::ArgType::String))
+                {
+                    uint64_t size;
+                    if (!ReadVarint(p, end, size) || uint64_t(end-p)<size) return false;
+                    uint32_t size32 = (uint32_t)size;
+                    data.insert(data.end(), (const uint8_t*)&size32, (const uint8_t*)&size32+4);
+                    data.insert(data.end(), p, p+size);
+                    p += size;
+                    continue;
+                }
+                else if (type==uint8_t(format::ArgType::Float))
+                {
+                    if (end-p<8) return false;
+                    memcpy(&value, p, 8);
+                    p += 8;
+                }
+                else
+                {
+                    if (!ReadVarint(p, end, value)) return false;
+                    if (type==uint8_t(format::ArgType::Signed))
+                    {
+                        value = uint64_t( int64_t(value>>1) ^ -int64_t(value&1) );
+                    }
+                }
+                data.insert(data.end(), (const uint8_t*)&value, (const uint8_t*)&value+8);
+            }
+            return true;
+        }
+
+    private:
+
+#define AXE_INDEX_HEADER        "AxeLogIndexFile"
+#define AXE_INDEX_VERSION       1
+
+        //! Number of events in each indexed block
+        static const uint32_t s_blockSize = 1024;
+
+        struct Segment
+        {
+            uint32_t m_number = 0;
+            uint32_t m_version = 0;
+            uint64_t m_fileSize = 0;
+            int64_t m_fileTime = 0;
+
+            const uint8_t* m_data = nullptr;
+            std::size_t m_size = 0;
+
+            //! Mapping of the file, or its decompressed contents
+            void* m_mapping = nullptr;
+            std::size_t m_mappingSize = 0;
+            std::vector<uint8_t> m_decompressed;
+
+            //! Offsets of the characters and sizes of the dictionary strings
+            std::vector<uint64_t> m_stringOffsets;
+            std::vector<uint32_t> m_stringSizes;
+
+            //! Global index of the dictionary threads
+            std::vector<uint32_t> m_threads;
+        };
+
+        struct Block
+        {
+            uint32_t m_segment;
+            uint32_t m_eventCount;
+            uint64_t m_offset;
+
+            //! Time of the event before the block, which the first time delta refers to
+            AxeTime m_baseTime;
+            AxeTime m_minTime;
+            AxeTime m_maxTime;
+        };
+
+        //! Event record fields, with dictionary indices local to the segment
+        struct Record
+        {
+            uint8_t m_levelAndType;
+            uint8_t m_flags;
+            int64_t m_delta;
+            uint64_t m_thread;
+            uint64_t m_depth;
+            uint64_t m_category;
+            uint64_t m_message;
+            const uint8_t* m_messageText;
+            const uint8_t* m_data;
+            std::size_t m_dataSize;
+        };
+
+        std::vector<Segment> m_segments;
+        std::vector<Block> m_blocks;
+        std::vector<std::string> m_categories;
+        std::vector<std::vector<uint32_t>> m_categoryBlocks;
+        std::vector<uint64_t> m_threads;
+        std::vector<std::vector<uint32_t>> m_threadBlocks;
+
+
+        static bool GetFileState(const std::string& path, uint64_t& size, int64_t& time)
+        {
+            struct stat info;
+            if (stat(path.c_str(), &info)) return false;
+            size = (uint64_t)info.st_size;
+            time = (int64_t)info.st_mtime;
+            return true;
+        }
+
+        static bool MapSegment(const std::string& path, Segment& segment)
+        {
+            if (!GetFileState(path, segment.m_fileSize, segment.m_fileTime) || segment.m_fileSize<20)
+            {
+                return false;
+            }
+
+#ifdef _WIN32
+            HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,
+                                      nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (file==INVALID_HANDLE_VALUE) return false;
+            HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            CloseHandle(file);
+            if (!mapping) return false;
+            void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+            if (!data) return false;
+#else
+            int file = open(path.c_str(), O_RDONLY);
+            if (file<0) return false;
+            void* data = mmap(nullptr, segment.m_fileSize, PROT_READ, MAP_SHARED, file, 0);
+            close(file);
+            if (data==MAP_FAILED) return false;
+#endif
+            segment.m_mapping = data;
+            segment.m_mappingSize = segment.m_fileSize;
+            segment.m_data = (const uint8_t*)data;
+            segment.m_size = segment.m_fileSize;
+
+            bool valid = true;
+            if (!memcmp(segment.m_data, AXE_FILEBIN_COMPRESSED_HEADER, 16))
+            {
+                valid = DecompressLogSegment(segment.m_data+16, segment.m_size-16, segment.m_decompressed)
+                        && segment.m_decompressed.size()>=20;
+                UnmapSegment(segment);
+                segment.m_data = segment.m_decompressed.data();
+                segment.m_size = segment.m_decompressed.size();
+            }
+
+            uint32_t version = 0;
+            if (valid)
+            {
+                memcpy(&version, segment.m_data+16, sizeof(version));
+            }
+            if (!valid || memcmp(segment.m_data, AXE_FILEBIN_HEADER, 16) || version<3 || version>AXE_FILEBIN_VERSION)
+            {
+                UnmapSegment(segment);
+                return false;
+            }
+            segment.m_version = version;
+            return true;
+        }
+
+        static void UnmapSegment(Segment& segment)
+        {
+            if (segment.m_mapping)
+            {
+#ifdef _WIN32
+                UnmapViewOfFile(segment.m_mapping);
+#else
+                munmap(segment.m_mapping, segment.m_mappingSize);
+#endif
+                segment.m_mapping = nullptr;
+            }
+        }
+
+        //! Parse the event record after its tag.
+        static bool ParseRecord(const uint8_t*& p, const uint8_t* end, uint32_t version, Record& r)
+        {
+            if (end-p<2) return false;
+            r.m_levelAndType = *p++;
+            r.m_flags = *p++;
+
+            uint64_t delta;
+            if (!ReadVarint(p, end, delta)) return false;
+            r.m_delta = int64_t(delta>>1) ^ -int64_t(delta&1);
+            if (!ReadVarint(p, end, r.m_thread)) return false;
+            r.m_depth = 0;
+            if (version>=4 && !ReadVarint(p, end, r.m_depth)) return false;
+            if (!ReadVarint(p, end, r.m_category)) return false;
+
+            r.m_messageText = nullptr;
+            if (r.m_flags & FileBinFlags::Interned)
+            {
+                if (!ReadVarint(p, end, r.m_message)) return false;
+            }
+            else
+            {
+                if (!ReadVarint(p, end, r.m_message) || uint64_t(end-p)<r.m_message) return false;
+                r.m_messageText = p;
+                p += r.m_message;
+            }
+
+            r.m_data = p;
+            if (r.m_flags & FileBinFlags::Formatted)
+            {
+                // Skip the arguments
+                uint64_t count;
+                if (!ReadVarint(p, end, count)) return false;
+                for (uint64_t a=0; a<count; ++a)
+                {
+                    if (p==end) return false;
+                    uint8_t type = *p++;
+                    uint64_t value;
+                    if (type==uint8_t(format::ArgType::Float))
+                    {
+                        if (end-p<8) return false;
+                        p += 8;
+                    }
+                    else if (!ReadVarint(p, end, value))
+                    {
+                        return false;
+                    }
+                    else if (type==uint8_t(format::ArgType::String))
+                    {
+                        if (uint64_t(end-p)<value) return false;
+                        p += value;
+                    }
+                }
+            }
+            else
+            {
+                uint64_t size;
+                if (!ReadVarint(p, end, size) || uint64_t(end-p)<size) return false;
+                r.m_data = p;
+                p += size;
+            }
+            r.m_dataSize = p-r.m_data;
+            return true;
+        }
+
+        //! Walk the records of a segment from an offset, calling a function for every event and
+        //! another one for every dictionary entry.
+        template<class D, class F>
+        static void WalkSegment(const Segment& segment, uint64_t offset, AxeTime time, uint32_t maxEvents, D dictionary, F function)
+        {
+            const uint8_t* p = segment.m_data+offset;
+            const uint8_t* end = segment.m_data+segment.m_size;
+
+            uint32_t events = 0;
+            while (p<end && events<maxEvents)
+            {
+                const uint8_t* start = p;
+                uint8_t tag = *p++;
+                if (tag==uint8_t(FileBinTag::String))
+                {
+                    uint64_t size;
+                    if (!ReadVarint(p, end, size) || uint64_t(end-p)<size) break;
+                    dictionary(FileBinTag::String, p, size);
+                    p += size;
+                }
+                else if (tag==uint8_t(FileBinTag::Thread))
+                {
+                    uint64_t id;
+                    if (end-p<(int)sizeof(id)) break;
+                    memcpy(&id, p, sizeof(id));
+                    p += sizeof(id);
+                    dictionary(FileBinTag::Thread, p, id);
+                }
+                else if (tag==uint8_t(FileBinTag::Event))
+                {
+                    Record r;
+                    if (!ParseRecord(p, end, segment.m_version, r)) break;
+                    if (r.m_thread>=segment.m_threads.size() || r.m_category>=segment.m_stringOffsets.size()) break;
+                    if ((r.m_flags & FileBinFlags::Interned) && r.m_message>=segment.m_stringOffsets.size()) break;
+                    time += r.m_delta;
+                    function(start, time, r);
+                    ++events;
+                }
+                else
+                {
+                    break;
+                }
+            }
+        }
+
+        void AddThread(Segment& segment, uint64_t id)
+        {
+            auto it = std::find(m_threads.begin(), m_threads.end(), id);
+            if (it==m_threads.end())
+            {
+                m_threads.push_back(id);
+                m_threadBlocks.push_back(std::vector<uint32_t>());
+                it = m_threads.end()-1;
+            }
+            segment.m_threads.push_back(uint32_t(it-m_threads.begin()));
+        }
+
+        StringView GetString(const Segment& segment, uint64_t index) const
+        {
+            StringView result;
+            result.m_data = (const char*)segment.m_data+segment.m_stringOffsets[index];
+            result.m_size = segment.m_stringSizes[index];
+            return result;
+        }
+
+        template<class F>
+        void DecodeBlock(const Block& block, F function) const
+        {
+            const Segment& segment = m_segments[block.m_segment];
+            WalkSegment(segment, block.m_offset, block.m_baseTime, block.m_eventCount,
+                        [](FileBinTag, const uint8_t*, uint64_t) {},
+                        [&](const uint8_t*, AxeTime time, const Record& r)
+            {
+                EventView e;
+                e.m_time = time;
+                e.m_thread = segment.m_threads[r.m_thread];
+                e.m_depth = (uint32_t)r.m_depth;
+                e.m_level = Level(r.m_levelAndType & 0xf);
+                e.m_type = EventType(r.m_levelAndType >> 4);
+                e.m_category = GetString(segment, r.m_category);
+                if (r.m_flags & FileBinFlags::Interned)
+                {
+                    e.m_message = GetString(segment, r.m_message);
+                }
+                else
+                {
+                    e.m_message.m_data = (const char*)r.m_messageText;
+                    e.m_message.m_size = r.m_message;
+                }
+                e.m_formatted = (r.m_flags & FileBinFlags::Formatted)!=0;
+                e.m_data = r.m_data;
+                e.m_dataSize = r.m_dataSize;
+                function(e);
+            });
+        }
+
+        void BuildIndex()
+        {
+            std::unordered_map<std::string,uint32_t> categoryIndices;
+
+            for (uint32_t s=0; s<m_segments.size(); ++s)
+            {
+                Segment& segment = m_segments[s];
+                AxeTime lastTime = 0;
+                auto dictionary = [&](FileBinTag tag, const uint8_t* p, uint64_t value)
+                {
+                    if (tag==FileBinTag::String)
+                    {
+                        segment.m_stringOffsets.push_back(p-segment.m_data);
+                        segment.m_stringSizes.push_back((uint32_t)value);
+                    }
+                    else
+                    {
+                        AddThread(segment, value);
+                    }
+                };
+
+                WalkSegment(segment, 20, 0, UINT32_MAX, dictionary, [&](const uint8_t* start, AxeTime time, const Record& r)
+                {
+                    if (m_blocks.empty() || m_blocks.back().m_segment!=s || m_blocks.back().m_eventCount==s_blockSize)
+                    {
+                        Block block;
+                        block.m_segment = s;
+                        block.m_eventCount = 0;
+                        block.m_offset = start-segment.m_data;
+                        block.m_baseTime = lastTime;
+                        block.m_minTime = time;
+                        block.m_maxTime = time;
+                        m_blocks.push_back(block);
+                    }
+
+                    uint32_t b = uint32_t(m_blocks.size()-1);
+                    Block& block = m_blocks.back();
+                    ++block.m_eventCount;
+                    block.m_minTime = std::min(block.m_minTime, time);
+                    block.m_maxTime = std::max(block.m_maxTime, time);
+                    lastTime = time;
+
+                    std::string category = GetString(segment, r.m_category).str();
+                    auto it = categoryIndices.find(category);
+                    if (it==categoryIndices.end())
+                    {
+                        it = categoryIndices.insert(std::make_pair(category, (uint32_t)m_categories.size())).first;
+                        m_categories.push_back(category);
+                        m_categoryBlocks.push_back(std::vector<uint32_t>());
+                    }
+
+                    std::vector<uint32_t>& categoryBlocks = m_categoryBlocks[it->second];
+                    if (categoryBlocks.empty() || categoryBlocks.back()!=b) categoryBlocks.push_back(b);
+
+                    std::vector<uint32_t>& threadBlocks = m_threadBlocks[segment.m_threads[r.m_thread]];
+                    if (threadBlocks.empty() || threadBlocks.back()!=b) threadBlocks.push_back(b);
+                });
+            }
+        }
+
+        //! Index file: a header and arrays of plain values, each preceded by its uint64_t size.
+        template<class T>
+        static void PutArray(std::vector<uint8_t>& out, const std::vector<T>& values)
+        {
+            uint64_t count = values.size();
+            out.insert(out.end(), (const uint8_t*)&count, (const uint8_t*)&count+sizeof(count));
+            if (count) out.insert(out.end(), (const uint8_t*)&values[0], (const uint8_t*)&values[0]+count*sizeof(T));
+        }
+
+        template<class T>
+        static bool GetArray(const uint8_t*& p, const uint8_t* end, std::vector<T>& values)
+        {
+            uint64_t count;
+            if (uint64_t(end-p)<sizeof(count)) return false;
+            memcpy(&count, p, sizeof(count));
+            p += sizeof(count);
+            if (uint64_t(end-p)/sizeof(T)<count) return false;
+            values.resize((std::size_t)count);
+            if (count) memcpy(&values[0], p, (std::size_t)count*sizeof(T));
+            p += count*sizeof(T);
+            return true;
+        }
+
+        void SaveIndex(const std::string& indexPath) const
+        {
+            std::vector<uint8_t> out(AXE_INDEX_HEADER, AXE_INDEX_HEADER+16);
+            std::vector<uint32_t> version(1, AXE_INDEX_VERSION);
+            PutArray(out, version);
+
+            std::vector<uint64_t> state;
+            for (const auto& segment: m_segments)
+            {
+                state.push_back(segment.m_number);
+                state.push_back(segment.m_fileSize);
+                state.push_back((uint64_t)segment.m_fileTime);
+            }
+            PutArray(out, state);
+
+            for (const auto& segment: m_segments)
+            {
+                PutArray(out, segment.m_stringOffsets);
+                PutArray(out, segment.m_stringSizes);
+                PutArray(out, segment.m_threads);
+            }
+
+            PutArray(out, m_blocks);
+            PutArray(out, m_threads);
+            for (const auto& blocks: m_threadBlocks) PutArray(out, blocks);
+
+            std::vector<char> names;
+            for (const auto& category: m_categories) names.insert(names.end(), category.c_str(), category.c_str()+category.size()+1);
+            PutArray(out, names);
+            for (const auto& blocks: m_categoryBlocks) PutArray(out, blocks);
+
+            // The log may be in a read only folder: the index is only a cache.
+            std::string temporaryPath = indexPath+".tmp";
+            FILE* file = fopen(temporaryPath.c_str(), "wb");
+            if (!file) return;
+            bool written = fwrite(&out[0], out.size(), 1, file)==1;
+            written = (fclose(file)==0) && written;
+#ifdef _WIN32
+            if (written) remove(indexPath.c_str());
+#endif
+            if (!written || rename(temporaryPath.c_str(), indexPath.c_str()))
+            {
+                remove(temporaryPath.c_str());
+            }
+        }
+
+        //! \return false if there is no index or it doesn't match the current segments.
+        bool LoadIndex(const std::string& indexPath)
+        {
+            std::vector<uint8_t> content;
+            FILE* file = fopen(indexPath.c_str(), "rb");
+            if (!file) return false;
+            uint8_t buffer[64*1024];
+            while (std::size_t count = fread(buffer, 1, sizeof(buffer), file))
+            {
+                content.insert(content.end(), buffer, buffer+count);
+            }
+            fclose(file);
+
+            const uint8_t* p = content.data();
+            const uint8_t* end = p+content.size();
+            if (content.size()<16 || memcmp(p, AXE_INDEX_HEADER, 16)) return false;
+            p += 16;
+
+            std::vector<uint32_t> version;
+            if (!GetArray(p, end, version) || version.size()!=1 || version[0]!=AXE_INDEX_VERSION) return false;
+
+            std::vector<uint64_t> state;
+            if (!GetArray(p, end, state) || state.size()!=m_segments.size()*3) return false;
+            for (std::size_t s=0; s<m_segments.size(); ++s)
+            {
+                if (state[s*3]!=m_segments[s].m_number
+                    || state[s*3+1]!=m_segments[s].m_fileSize
+                    || (int64_t)state[s*3+2]!=m_segments[s].m_fileTime)
+                {
+                    return false;
+                }
+            }
+
+            bool valid = true;
+            for (auto& segment: m_segments)
+            {
+                valid = valid
+                        && GetArray(p, end, segment.m_stringOffsets)
+                        && GetArray(p, end, segment.m_stringSizes)
+                        && GetArray(p, end, segment.m_threads);
+            }
+
+            valid = valid && GetArray(p, end, m_blocks) && GetArray(p, end, m_threads);
+            m_threadBlocks.resize(m_threads.size());
+            for (auto& blocks: m_threadBlocks) valid = valid && GetArray(p, end, blocks);
+
+            std::vector<char> names;
+            valid = valid && GetArray(p, end, names);
+            for (std::size_t begin=0; valid && begin<names.size(); )
+            {
+                std::size_t nameEnd = std::find(names.begin()+begin, names.end(), 0)-names.begin();
+                m_categories.push_back(std::string(&names[begin], nameEnd-begin));
+                begin = nameEnd+1;
+            }
+            m_categoryBlocks.resize(m_categories.size());
+            for (auto& blocks: m_categoryBlocks) valid = valid && GetArray(p, end, blocks);
+
+            // Check what the index refers to, in case it is corrupt
+            for (std::size_t s=0; valid && s<m_segments.size(); ++s)
+            {
+                const Segment& segment = m_segments[s];
+                valid = segment.m_stringOffsets.size()==segment.m_stringSizes.size();
+                for (std::size_t i=0; valid && i<segment.m_stringOffsets.size(); ++i)
+                {
+                    valid = segment.m_stringOffsets[i]+segment.m_stringSizes[i]<=segment.m_size;
+                }
+                for (std::size_t i=0; valid && i<segment.m_threads.size(); ++i)
+                {
+                    valid = segment.m_threads[i]<m_threads.size();
+                }
+            }
+            for (std::size_t b=0; valid && b<m_blocks.size(); ++b)
+            {
+                valid = m_blocks[b].m_segment<m_segments.size() && m_blocks[b].m_offset<m_segments[m_blocks[b].m_segment].m_size;
+            }
+            for (const auto& list: { &m_threadBlocks, &m_categoryBlocks })
+            {
+                for (const auto& blocks: *list)
+                {
+                    for (uint32_t b: blocks) valid = valid && b<m_blocks.size();
+                }
+            }
+
+            if (!valid)
+            {
+                for (auto& segment: m_segments)
+                {
+                    segment.m_stringOffsets.clear();
+                    segment.m_stringSizes.clear();
+                    segment.m_threads.clear();
+                }
+                m_blocks.clear();
+                m_threads.clear();
+                m_threadBlocks.clear();
+                m_categories.clear();
+                m_categoryBlocks.clear();
+            }
+            return valid;
+        }
+    };
+
+
+    inline std::string EventView::GetMessage() const
+    {
+        if (!m_formatted)
+        {
+            return m_message.str();
+        }
+
+        std::vector<uint8_t> arguments;
+        const uint8_t* p = m_data;
+        MappedLog::DecodeArguments(p, m_data+m_dataSize, arguments);
+
+        std::string format = m_message.str();
+        std::string result;
+        format::Format(result, format.c_str(), arguments.data(), arguments.size());
+        return result;
+    }
+
+
+    //!
+    //! \brief Writes events as Chrome trace events in JSON, which can be opened in chrome://tracing
+    //! or in the Perfetto UI. Every thread is a track in which sections are nested spans, messages
+    //! are instant events and numeric values are counters.
+    //!
+    class ChromeTraceWriter
+    {
+    public:
+
+        ~ChromeTraceWriter()
+        {
+            Close();
+        }
+
+        bool Open(const char* path)
+        {
+            m_pFile = fopen(path, "wb");
+            if (!m_pFile) return false;
+            fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", m_pFile);
+            m_first = true;
+            return true;
+        }
+
+        //! Finish the spans that never ended and the file.
+        bool Close()
+        {
+            if (!m_pFile) return true;
+
+            for (std::size_t t=0; t<m_threads.size(); ++t)
+            {
+                for (; m_threads[t].m_depth>0; --m_threads[t].m_depth)
+                {
+                    BeginEvent('E', m_lastTime, (uint32_t)t);
+                    fputs("}", m_pFile);
+                }
+
+                std::string name = m_threads[t].m_name.size() ? m_threads[t].m_name : "thread "+std::to_string(t);
+                BeginEvent('M', 0, (uint32_t)t);
+                fputs(",\"name\":\"thread_name\",\"args\":{\"name\":", m_pFile);
+                AddString(name.data(), name.size());
+                fputs("}}", m_pFile);
+            }
+
+            fputs("\n]}\n", m_pFile);
+            bool result = fclose(m_pFile)==0;
+            m_pFile = nullptr;
+            return result;
+        }
+
+        void Add(const Event& e)
+        {
+            Add(e.m_time, e.m_thread, e.m_type, e.m_category.data(), e.m_category.size(),
+                e.m_message, e.m_data.data(), e.m_data.size());
+        }
+
+        //! \param thread any value that identifies the thread
+        void Add(AxeTime time, uint64_t thread, EventType type, const char* category, std::size_t categorySize,
+                 const std::string& message, const uint8_t* data, std::size_t dataSize)
+        {
+            if (!m_pFile) return;
+
+            auto it = m_threadIndices.find(thread);
+            if (it==m_threadIndices.end())
+            {
+                it = m_threadIndices.insert(std::make_pair(thread, (uint32_t)m_threads.size())).first;
+                m_threads.push_back(Thread());
+            }
+            Thread& t = m_threads[it->second];
+            m_lastTime = std::max(m_lastTime, time);
+
+            switch (type)
+            {
+            case EventType::RecursiveSpanBegin:
+                BeginEvent('B', time, it->second);
+                AddField("name", message.data(), message.size());
+                AddField("cat", category, categorySize);
+                fputs("}", m_pFile);
+                ++t.m_depth;
+                break;
+
+            case EventType::RecursiveSpanEnd:
+                // The beginning may be in a segment that was deleted
+                if (t.m_depth>0)
+                {
+                    BeginEvent('E', time, it->second);
+                    fputs("}", m_pFile);
+                    --t.m_depth;
+                }
+                break;
+
+            case EventType::Message:
+            case EventType::StringValue:
+                BeginEvent('i', time, it->second);
+                if (type==EventType::Message)
+                {
+                    AddField("name", message.data(), message.size());
+                }
+                else
+                {
+                    std::string name = message + " = " + std::string((const char*)data, dataSize);
+                    AddField("name", name.data(), name.size());
+                }
+                AddField("cat", category, categorySize);
+                fputs(",\"s\":\"t\"}", m_pFile);
+                break;
+
+            case EventType::IntValue:
+            case EventType::FloatValue:
+            {
+                double value = 0;
+                if (dataSize==sizeof(int64_t))
+                {
+                    int64_t v;
+                    memcpy(&v, data, sizeof(v));
+                    value = (double)v;
+                }
+                else if (dataSize==sizeof(float))
+                {
+                    float v;
+                    memcpy(&v, data, sizeof(v));
+                    value = v;
+                }
+                BeginEvent('C', time, it->second);
+                AddField("name", message.data(), message.size());
+                AddField("cat", category, categorySize);
+                fprintf(m_pFile, ",\"args\":{\"value\":%.17g}}", value);
+                break;
+            }
+
+            case EventType::ThreadName:
+                t.m_name = message;
+                break;
+
+            default:
+                break;
+            }
+        }
+
+    private:
+
+        struct Thread
+        {
+            //! Spans begun and not ended
+            uint32_t m_depth = 0;
+
+            std::string m_name;
+        };
+
+        FILE* m_pFile = nullptr;
+        bool m_first = true;
+        AxeTime m_lastTime = 0;
+        std::unordered_map<uint64_t,uint32_t> m_threadIndices;
+        std::vector<Thread> m_threads;
+
+        void BeginEvent(char phase, AxeTime time, uint32_t thread)
+        {
+            fprintf(m_pFile, "%s{\"ph\":\"%c\",\"ts\":%lld,\"pid\":1,\"tid\":%u",
+                    m_first ? "" : ",\n", phase, (long long)time, (unsigned)thread);
+            m_first = false;
+        }
+
+        void AddField(const char* name, const char* text, std::size_t size)
+        {
+            fprintf(m_pFile, ",\"%s\":", name);
+            AddString(text, size);
+        }
+
+        void AddString(const char* text, std::size_t size)
+        {
+            fputc('"', m_pFile);
+            for (std::size_t c=0; c<size; ++c)
+            {
+                unsigned char ch = (unsigned char)text[c];
+                if (ch=='"' || ch=='\\')
+                {
+                    fputc('\\', m_pFile);
+                    fputc(ch, m_pFile);
+                }
+                else if (ch<0x20)
+                {
+                    fprintf(m_pFile, "\\u%04x", ch);
+                }
+                else
+                {
+                    fputc(ch, m_pFile);
+                }
+            }
+            fputc('"', m_pFile);
+        }
+    };
+
+
+    //! Convert a log to a Chrome trace, see ChromeTraceWriter.
+    inline bool ExportChromeTrace(const char* logPath, const char* tracePath)
+    {
+        ChromeTraceWriter writer;
+
+        // Logs of the current version can be streamed without loading them
+        MappedLog log;
+        if (log.Open(logPath))
+        {
+            if (!writer.Open(tracePath)) return false;
+            log.ForEach(MappedLog::Query(), [&](const EventView& e)
+            {
+                writer.Add(e.m_time, log.GetThreads()[e.m_thread], e.m_type, e.m_category.m_data, e.m_category.m_size,
+                           e.GetMessage(), e.m_formatted ? nullptr : e.m_data, e.m_formatted ? 0 : e.m_dataSize);
+            });
+            return writer.Close();
+        }
+
+        std::vector<Event> events;
+        if (!ReadableFileBin::LoadEvents(logPath, events)) return false;
+        if (!writer.Open(tracePath)) return false;
+        for (const auto& e: events)
+        {
+            writer.Add(e);
+        }
+        return writer.Close();
+    }
+
+
+    //!
+    //! \brief Profile of the sections of a log. Begin and end events are paired in every thread,
+    //! and the durations of every section name are aggregated: the total includes the nested
+    //! sections, and the self time doesn't.
+    //!
+    class SpanProfile
+    {
+    public:
+
+        struct Section
+        {
+            uint64_t m_count = 0;
+            AxeTime m_total = 0;
+            AxeTime m_self = 0;
+            std::vector<AxeTime> m_durations;
+
+            //! Nearest rank percentile of the durations, which have to be sorted.
+            AxeTime GetPercentile(double percentile) const
+            {
+                if (m_durations.empty()) return 0;
+                std::size_t rank = (std::size_t)std::ceil(percentile/100.0*m_durations.size());
+                return m_durations[std::min(std::max<std::size_t>(rank,1), m_durations.size())-1];
+            }
+        };
+
+        //! \param thread any value that identifies the thread
+        void Add(AxeTime time, uint64_t thread, EventType type, const std::string& name)
+        {
+            if (type==EventType::RecursiveSpanBegin)
+            {
+                Open open;
+                open.m_name = name;
+                open.m_begin = time;
+                m_open[thread].push_back(open);
+            }
+            else if (type==EventType::RecursiveSpanEnd)
+            {
+                // The beginning may be in a segment that was deleted
+                std::vector<Open>& stack = m_open[thread];
+                if (stack.empty()) return;
+
+                Open open = stack.back();
+                stack.pop_back();
+
+                AxeTime duration = time-open.m_begin;
+                Section& section = m_sections[open.m_name];
+                ++section.m_count;
+                section.m_total += duration;
+                section.m_self += duration-open.m_children;
+                section.m_durations.push_back(duration);
+                m_sorted = false;
+
+                if (stack.size())
+                {
+                    stack.back().m_children += duration;
+                }
+            }
+        }
+
+        bool Load(const char* logPath)
+        {
+            MappedLog log;
+            if (log.Open(logPath))
+            {
+                log.ForEach(MappedLog::Query(), [&](const EventView& e)
+                {
+                    if (e.m_type==EventType::RecursiveSpanBegin || e.m_type==EventType::RecursiveSpanEnd)
+                    {
+                        Add(e.m_time, log.GetThreads()[e.m_thread], e.m_type, e.m_message.str());
+                    }
+                });
+                return true;
+            }
+
+            std::vector<Event> events;
+            if (!ReadableFileBin::LoadEvents(logPath, events)) return false;
+            for (const auto& e: events)
+            {
+                Add(e.m_time, e.m_thread, e.m_type, e.m_message);
+            }
+            return true;
+        }
+
+        const std::map<std::string,Section>& GetSections() const
+        {
+            if (!m_sorted)
+            {
+                for (auto& section: m_sections)
+                {
+                    std::sort(section.second.m_durations.begin(), section.second.m_durations.end());
+                }
+                m_sorted = true;
+            }
+            return m_sections;
+        }
+
+        //! Print a table of the sections, the ones with the longest total time first.
+        void Print(FILE* file) const
+        {
+            std::vector<const std::pair<const std::string,Section>*> sections;
+            for (const auto& section: GetSections()) sections.push_back(&section);
+            std::sort(sections.begin(), sections.end(), [](const std::pair<const std::string,Section>* a,
+                                                           const std::pair<const std::string,Section>* b)
+            {
+                return a->second.m_total>b->second.m_total;
+            });
+
+            fprintf(file, "%-32s %8s %12s %12s %10s %10s %10s\n", "section", "count", "total ms", "self ms", "p50 ms", "p95 ms", "p99 ms");
+            for (const auto* s: sections)
+            {
+                const Section& section = s->second;
+                fprintf(file, "%-32s %8llu %12.1f %12.1f %10.2f %10.2f %10.2f\n", s->first.c_str(),
+                        (unsigned long long)section.m_count, section.m_total/1000.0, section.m_self/1000.0,
+                        section.GetPercentile(50)/1000.0, section.GetPercentile(95)/1000.0, section.GetPercentile(99)/1000.0);
+            }
+        }
+
+        //! Print the sections of two profiles side by side, with the change of their times.
+        static void PrintDiff(const SpanProfile& before, const SpanProfile& after, FILE* file)
+        {
+            std::map<std::string,std::pair<const Section*,const Section*>> sections;
+            for (const auto& s: before.GetSections()) sections[s.first].first = &s.second;
+            for (const auto& s: after.GetSections()) sections[s.first].second = &s.second;
+
+            auto change = [](double a, double b)
+            {
+                char text[32];
+                if (a>0) snprintf(text, sizeof(text), "%+.1f%%", (b-a)*100.0/a);
+                else snprintf(text, sizeof(text), "%s", b>0 ? "new" : "");
+                return std::string(text);
+            };
+
+            Section none;
+            fprintf(file, "%-32s %17s %27s %9s %23s %9s\n", "section", "count", "total ms", "", "p95 ms", "");
+            for (const auto& s: sections)
+            {
+                const Section& a = s.second.first ? *s.second.first : none;
+                const Section& b = s.second.second ? *s.second.second : none;
+                fprintf(file, "%-32s %8llu %8llu %13.1f %13.1f %9s %11.2f %11.2f %9s\n", s.first.c_str(),
+                        (unsigned long long)a.m_count, (unsigned long long)b.m_count,
+                        a.m_total/1000.0, b.m_total/1000.0, change((double)a.m_total, (double)b.m_total).c_str(),
+                        a.GetPercentile(95)/1000.0, b.GetPercentile(95)/1000.0,
+                        change((double)a.GetPercentile(95), (double)b.GetPercentile(95)).c_str());
+            }
+        }
+
+    private:
+
+        struct Open
+        {
+            std::string m_name;
+            AxeTime m_begin = 0;
+
+            //! Time spent in the sections nested in this one
+            AxeTime m_children = 0;
+        };
+
+        std::unordered_map<uint64_t,std::vector<Open>> m_open;
+        mutable std::map<std::string,Section> m_sections;
+        mutable bool m_sorted = true;
+    };
+
+
 } // axe namespace
 
@@ -0,0 +1,300 @@
+#include "build_database.h"
+
+#include "axe.h"
+#include "platform.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+
+#define CRAFT_BUILD_DATABASE_HEADER     "CraftBuildState"
+#define CRAFT_BUILD_DATABASE_VERSION    2
+
+
+namespace
+{
+    struct FileHeader
+    {
+        char m_magic[16];
+        uint32_t m_version;
+        uint32_t m_recordCount;
+        uint32_t m_dependencyCount;
+        uint32_t m_stringsSize;
+    };
+
+    struct FileRecord
+    {
+        uint32_t m_output;
+        uint32_t m_firstDependency;
+        uint32_t m_dependencyCount;
+        uint32_t m_padding;
+        uint64_t m_commandHash;
+        int64_t m_outputTime;
+        uint64_t m_outputSize;
+
+        // Since version 2
+        uint64_t m_outputHash;
+    };
+
+    //! Size of the records of version 1, without content hash
+    const std::size_t FileRecordSizeVersion1 = offsetof( FileRecord, m_outputHash );
+
+    // Read a string from the string table at the given offset
+    bool ReadString( const uint8_t* strings, uint32_t stringsSize, uint32_t offset, std::string& result )
+    {
+        uint32_t length = 0;
+        if ( uint64_t(offset)+sizeof(length)>stringsSize )
+        {
+            return false;
+        }
+        memcpy( &length, strings+offset, sizeof(length) );
+
+        if ( uint64_t(offset)+sizeof(length)+length>stringsSize )
+        {
+            return false;
+        }
+        result.assign( (const char*)strings+offset+sizeof(length), length );
+        return true;
+    }
+}
+
+
+bool BuildDatabase::load( const std::string& path )
+{
+    std::string content;
+    if ( !FileRead( path, content ) )
+    {
+        return false;
+    }
+
+    const uint8_t* data = (const uint8_t*)content.data();
+    uint64_t size = content.size();
+
+    FileHeader header;
+    if ( size<sizeof(header) )
+    {
+        return false;
+    }
+    memcpy( &header, data, sizeof(header) );
+
+    if ( memcmp( header.m_magic, CRAFT_BUILD_DATABASE_HEADER, sizeof(header.m_magic) )
+         || header.m_version<1 || header.m_version>CRAFT_BUILD_DATABASE_VERSION )
+    {
+        AXE_LOG( "build_db", axe::Level::Warning, "Ignoring incompatible build state [%s]", path.c_str() );
+        return false;
+    }
+
+    uint64_t recordsOffset = sizeof(header);
+    std::size_t recordSize = header.m_version==1 ? FileRecordSizeVersion1 : sizeof(FileRecord);
+    uint64_t dependenciesOffset = recordsOffset + uint64_t(header.m_recordCount)*recordSize;
+    uint64_t stringsOffset = dependenciesOffset + uint64_t(header.m_dependencyCount)*sizeof(uint32_t);
+    if ( stringsOffset+header.m_stringsSize>size )
+    {
+        AXE_LOG( "build_db", axe::Level::Warning, "Ignoring truncated build state [%s]", path.c_str() );
+        return false;
+    }
+
+    const uint8_t* strings = data+stringsOffset;
+
+    std::unordered_map<std::string,Record> records;
+    records.reserve( header.m_recordCount );
+
+    std::vector<std::string> decodedStrings;
+    std::unordered_map<uint32_t,std::size_t> decodedStringIndices;
+    auto getString = [&]( uint32_t offset, std::string& result )
+    {
+        auto it = decodedStringIndices.find( offset );
+        if ( it!=decodedStringIndices.end() )
+        {
+            result = decodedStrings[it->second];
+            return true;
+        }
+
+        if ( !ReadString( strings, header.m_stringsSize, offset, result ) )
+        {
+            return false;
+        }
+        decodedStringIndices[offset] = decodedStrings.size();
+        decodedStrings.push_back( result );
+        return true;
+    };
+
+    for ( uint32_t r=0; r<header.m_recordCount; ++r )
+    {
+        FileRecord fileRecord;
+        memset( &fileRecord, 0, sizeof(fileRecord) );
+        memcpy( &fileRecord, data+recordsOffset+r*recordSize, recordSize );
+
+        if ( uint64_t(fileRecord.m_firstDependency)+fileRecord.m_dependencyCount>header.m_dependencyCount )
+        {
+            return false;
+        }
+
+        std::string output;
+        if ( !getString( fileRecord.m_output, output ) )
+        {
+            return false;
+        }
+
+        Record& record = records[output];
+        record.m_commandHash = fileRecord.m_commandHash;
+        record.m_outputTime = fileRecord.m_outputTime;
+        record.m_outputSize = fileRecord.m_outputSize;
+        record.m_outputHash = fileRecord.m_outputHash;
+        record.m_dependencies.resize( fileRecord.m_dependencyCount );
+        for ( uint32_t d=0; d<fileRecord.m_dependencyCount; ++d )
+        {
+            uint32_t stringOffset;
+            memcpy( &stringOffset, data+dependenciesOffset+(fileRecord.m_firstDependency+d)*sizeof(uint32_t), sizeof(stringOffset) );
+            if ( !getString( stringOffset, record.m_dependencies[d] ) )
+            {
+                return false;
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_records.swap( records );
+    m_changed = false;
+
+    return true;
+}
+
+
+bool BuildDatabase::save( const std::string& path )
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if ( !m_changed )
+    {
+        return true;
+    }
+
+    // Build the string table, storing every path only once
+    std::vector<uint8_t> strings;
+    std::unordered_map<std::string,uint32_t> stringOffsets;
+    auto addString = [&]( const std::string& s )
+    {
+        auto it = stringOffsets.find( s );
+        if ( it!=stringOffsets.end() )
+        {
+            return it->second;
+        }
+
+        uint32_t offset = (uint32_t)strings.size();
+        uint32_t length = (uint32_t)s.size();
+        strings.resize( offset+sizeof(length)+length+1 );
+        memcpy( &strings[offset], &length, sizeof(length) );
+        memcpy( &strings[offset+sizeof(length)], s.data(), length );
+        strings[offset+sizeof(length)+length] = 0;
+
+        stringOffsets[s] = offset;
+        return offset;
+    };
+
+    std::vector<FileRecord> fileRecords;
+    std::vector<uint32_t> dependencies;
+    fileRecords.reserve( m_records.size() );
+    for ( const auto& r: m_records )
+    {
+        FileRecord fileRecord;
+        memset( &fileRecord, 0, sizeof(fileRecord) );
+        fileRecord.m_output = addString( r.first );
+        fileRecord.m_firstDependency = (uint32_t)dependencies.size();
+        fileRecord.m_dependencyCount = (uint32_t)r.second.m_dependencies.size();
+        fileRecord.m_commandHash = r.second.m_commandHash;
+        fileRecord.m_outputTime = r.second.m_outputTime;
+        fileRecord.m_outputSize = r.second.m_outputSize;
+        fileRecord.m_outputHash = r.second.m_outputHash;
+        for ( const auto& d: r.second.m_dependencies )
+        {
+            dependencies.push_back( addString( d ) );
+        }
+        fileRecords.push_back( fileRecord );
+    }
+
+    FileHeader header;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.m_magic, CRAFT_BUILD_DATABASE_HEADER, sizeof(CRAFT_BUILD_DATABASE_HEADER) );
+    header.m_version = CRAFT_BUILD_DATABASE_VERSION;
+    header.m_recordCount = (uint32_t)fileRecords.size();
+    header.m_dependencyCount = (uint32_t)dependencies.size();
+    header.m_stringsSize = (uint32_t)strings.size();
+
+    // Write to a temporary file first, so that an interrupted build never leaves a broken database.
+    std::string temporaryPath = path+".tmp";
+    FILE* file = fopen( temporaryPath.c_str(), "wb" );
+    if ( !file )
+    {
+        AXE_LOG( "build_db", axe::Level::Error, "Failed to write the build state [%s]", temporaryPath.c_str() );
+        return false;
+    }
+
+    bool result = fwrite( &header, sizeof(header), 1, file )==1;
+    if ( result && fileRecords.size() )
+    {
+        result = fwrite( &fileRecords[0], sizeof(FileRecord), fileRecords.size(), file )==fileRecords.size();
+    }
+    if ( result && dependencies.size() )
+    {
+        result = fwrite( &dependencies[0], sizeof(uint32_t), dependencies.size(), file )==dependencies.size();
+    }
+    if ( result && strings.size() )
+    {
+        result = fwrite( &strings[0], 1, strings.size(), file )==strings.size();
+    }
+    result = ( fclose( file )==0 ) && result;
+
+    if ( result )
+    {
+        result = rename( temporaryPath.c_str(), path.c_str() )==0;
+    }
+
+    if ( !result )
+    {
+        AXE_LOG( "build_db", axe::Level::Error, "Failed to write the build state [%s]", path.c_str() );
+        remove( temporaryPath.c_str() );
+        return false;
+    }
+
+    m_changed = false;
+    return true;
+}
+
+
+bool BuildDatabase::get( const std::string& output, Record& record ) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_records.find( output );
+    if ( it==m_records.end() )
+    {
+        return false;
+    }
+
+    record = it->second;
+    return true;
+}
+
+
+void BuildDatabase::set( const std::string& output, const Record& record )
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_records[output] = record;
+    m_changed = true;
+}
+
+
+void BuildDatabase::remove( const std::string& output )
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if ( m_records.erase( output ) )
+    {
+        m_changed = true;
+    }
+}
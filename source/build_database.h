@@ -0,0 +1,64 @@
+#pragma once
+
+#include "platform.h"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+
+
+//!
+//! \brief State of the outputs produced by craft, kept in the build folder between runs.
+//! For every output it stores the dependencies it was built from, a hash of the command that
+//! produced it and its modification time, size and content hash right after it was produced.
+//!
+//! The file is a header followed by fixed size records, an array of dependency string indices and
+//! a table of unique strings, all addressed by offset so that it can be used directly from memory:
+//!
+//!     Header      magic, version, record count, dependency count, string table size
+//!     Record[]    output string, first dependency, dependency count, command hash, time, size,
+//!                 content hash
+//!     uint32_t[]  string offset of each dependency
+//!     strings     uint32_t length followed by the characters and a terminating zero
+//!
+class BuildDatabase
+{
+public:
+
+    struct Record
+    {
+        //! Hash of the command used to build the output, or 0 if unknown.
+        uint64_t m_commandHash = 0;
+
+        //! State of the output when it was recorded.
+        int64_t m_outputTime = 0;
+        uint64_t m_outputSize = 0;
+
+        //! Hash of the contents of the output, or 0 if unknown.
+        uint64_t m_outputHash = 0;
+
+        //! Absolute paths of the files used to build the output.
+        std::vector<std::string> m_dependencies;
+    };
+
+    //! Replace the contents with the ones in the file.
+    //! \return false if the file doesn't exist or is not a valid database.
+    bool load( const std::string& path );
+
+    //! Write the database to a file if it has changed since it was loaded.
+    bool save( const std::string& path );
+
+    //! \return false if there is no record for the output.
+    bool get( const std::string& output, Record& record ) const;
+
+    void set( const std::string& output, const Record& record );
+
+    void remove( const std::string& output );
+
+private:
+
+    mutable std::mutex m_mutex;
+    std::unordered_map<std::string,Record> m_records;
+    bool m_changed = false;
+};
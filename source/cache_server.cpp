@@ -0,0 +1,340 @@
+//!
+//! Reference server for the remote cache of craft, to share the objects and linked outputs of the
+//! builds of a machine or a small team. Entries are files in a folder, read with GET and HEAD and
+//! written with PUT:
+//!
+//!     craft-cache-server [-p <port>] [-d <folder>] [-m <megabytes>]
+//!
+//! where -m is the largest entry accepted, 256 MB by default.
+//! and the builds use it with CRAFT_REMOTE_CACHE=http://127.0.0.1:<port>. It only listens on the
+//! loopback interface; a shared server should be put behind a proxy that authenticates the users.
+//!
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <thread>
+#include <atomic>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+
+namespace
+{
+    //! Folder of the entries
+    std::string s_folder = "craft-cache";
+
+    //! Largest request body accepted
+    std::size_t s_maxSize = std::size_t(256)*1024*1024;
+
+    //! Used to name the temporary files of concurrent uploads
+    std::atomic<uint64_t> s_uploadCount(0);
+
+
+    bool ReadFile( const std::string& path, std::string& content )
+    {
+        FILE* file = fopen( path.c_str(), "rb" );
+        if ( !file )
+        {
+            return false;
+        }
+
+        char buffer[64*1024];
+        std::size_t count;
+        while ( (count=fread( buffer, 1, sizeof(buffer), file ))>0 )
+        {
+            content.append( buffer, count );
+        }
+        bool result = !ferror( file );
+        fclose( file );
+        return result;
+    }
+
+    //! Write a file through a temporary one, so that readers never see it half written.
+    bool WriteFile( const std::string& path, const std::string& content )
+    {
+        std::string temporaryPath = path+".tmp"+std::to_string( ++s_uploadCount );
+        FILE* file = fopen( temporaryPath.c_str(), "wb" );
+        if ( !file )
+        {
+            return false;
+        }
+
+        bool result = fwrite( content.data(), 1, content.size(), file )==content.size();
+        result = ( fclose( file )==0 ) && result;
+        result = result && rename( temporaryPath.c_str(), path.c_str() )==0;
+        if ( !result )
+        {
+            remove( temporaryPath.c_str() );
+        }
+        return result;
+    }
+
+    //! Map a request path like /[<prefix>/]ac/<key> to a file in the folder. Only names made of
+    //! letters, digits, '-', '_' and '.' are accepted, and not as the first character, so that no
+    //! path can get out of the folder.
+    bool GetEntryPath( const std::string& path, std::string& result )
+    {
+        if ( path.empty() || path[0]!='/' )
+        {
+            return false;
+        }
+
+        std::string last, beforeLast;
+        result = s_folder;
+        std::size_t begin = 1;
+        while ( begin<=path.size() )
+        {
+            std::size_t end = path.find( '/', begin );
+            if ( end==std::string::npos ) end = path.size();
+
+            std::string name = path.substr( begin, end-begin );
+            if ( name.empty() || name[0]=='.' || name[0]=='-' )
+            {
+                return false;
+            }
+            for ( char c: name )
+            {
+                if ( !isalnum( (unsigned char)c ) && c!='-' && c!='_' && c!='.' )
+                {
+                    return false;
+                }
+            }
+
+            result += "/"+name;
+            beforeLast = last;
+            last = name;
+            begin = end+1;
+        }
+
+        return beforeLast=="ac" || beforeLast=="cas";
+    }
+
+    //! Create the folders of an entry path returned by GetEntryPath.
+    void CreateEntryFolders( const std::string& file )
+    {
+        std::size_t end = file.find( '/', s_folder.size()+1 );
+        while ( end!=std::string::npos )
+        {
+            mkdir( file.substr( 0, end ).c_str(), 0755 );
+            end = file.find( '/', end+1 );
+        }
+    }
+
+    //! Value of a header in a block of request headers, or an empty string.
+    std::string GetHeader( const std::string& headers, const char* name )
+    {
+        std::size_t nameSize = strlen(name);
+        std::size_t begin = headers.find( "\r\n" );
+        while ( begin!=std::string::npos && begin+2<headers.size() )
+        {
+            begin += 2;
+            std::size_t end = headers.find( "\r\n", begin );
+            if ( end==std::string::npos ) end = headers.size();
+
+            if ( end-begin>nameSize && headers[begin+nameSize]==':'
+                 && strncasecmp( headers.c_str()+begin, name, nameSize )==0 )
+            {
+                std::size_t value = headers.find_first_not_of( " \t", begin+nameSize+1 );
+                return value<end ? headers.substr( value, end-value ) : std::string();
+            }
+            begin = end;
+        }
+        return std::string();
+    }
+
+    bool WriteAll( int fd, const std::string& data )
+    {
+        std::size_t written = 0;
+        while ( written<data.size() )
+        {
+            ssize_t count = send( fd, data.data()+written, data.size()-written, MSG_NOSIGNAL );
+            if ( count<0 && errno==EINTR )
+            {
+                continue;
+            }
+            if ( count<=0 )
+            {
+                return false;
+            }
+            written += (std::size_t)count;
+        }
+        return true;
+    }
+
+    //! Read until buffer has at least size bytes.
+    bool ReadAtLeast( int fd, std::string& buffer, std::size_t size )
+    {
+        char data[64*1024];
+        while ( buffer.size()<size )
+        {
+            ssize_t count = recv( fd, data, sizeof(data), 0 );
+            if ( count<0 && errno==EINTR )
+            {
+                continue;
+            }
+            if ( count<=0 )
+            {
+                return false;
+            }
+            buffer.append( data, (std::size_t)count );
+        }
+        return true;
+    }
+
+    //! Answer the requests of a persistent connection until the client closes it.
+    void ServeConnection( int fd )
+    {
+        std::string buffer;
+        while ( true )
+        {
+            std::size_t headersEnd;
+            while ( (headersEnd=buffer.find( "\r\n\r\n" ))==std::string::npos )
+            {
+                if ( buffer.size()>64*1024 || !ReadAtLeast( fd, buffer, buffer.size()+1 ) )
+                {
+                    close( fd );
+                    return;
+                }
+            }
+
+            std::string headers = buffer.substr( 0, headersEnd );
+            unsigned long long size = strtoull( GetHeader( headers, "Content-Length" ).c_str(), nullptr, 10 );
+            if ( size>s_maxSize )
+            {
+                // The body is not read, so the connection can't be used any more.
+                WriteAll( fd, "HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n" );
+                close( fd );
+                return;
+            }
+            if ( GetHeader( headers, "Transfer-Encoding" ).size() || !ReadAtLeast( fd, buffer, headersEnd+4+size ) )
+            {
+                close( fd );
+                return;
+            }
+            std::string body = buffer.substr( headersEnd+4, size );
+            buffer.erase( 0, headersEnd+4+size );
+
+            // "<method> <path> HTTP/1.1"
+            std::size_t methodEnd = headers.find( ' ' );
+            std::size_t pathEnd = headers.find( ' ', methodEnd+1 );
+            std::string method = headers.substr( 0, methodEnd );
+            std::string path = methodEnd!=std::string::npos && pathEnd!=std::string::npos
+                    ? headers.substr( methodEnd+1, pathEnd-methodEnd-1 ) : std::string();
+            bool keepAlive = strncasecmp( GetHeader( headers, "Connection" ).c_str(), "close", 5 )!=0;
+
+            const char* status = "200 OK";
+            std::string content;
+            std::string file;
+            if ( !GetEntryPath( path, file ) )
+            {
+                status = "400 Bad Request";
+            }
+            else if ( method=="GET" || method=="HEAD" )
+            {
+                if ( !ReadFile( file, content ) )
+                {
+                    status = "404 Not Found";
+                }
+            }
+            else if ( method=="PUT" )
+            {
+                CreateEntryFolders( file );
+                status = WriteFile( file, body ) ? "201 Created" : "500 Internal Server Error";
+            }
+            else
+            {
+                status = "405 Method Not Allowed";
+            }
+
+            std::string response = std::string("HTTP/1.1 ")+status+"\r\n"
+                    "Content-Length: "+std::to_string(content.size())+"\r\n"
+                    +( keepAlive ? "" : "Connection: close\r\n" )+"\r\n";
+            if ( method!="HEAD" )
+            {
+                response += content;
+            }
+
+            if ( !WriteAll( fd, response ) || !keepAlive )
+            {
+                close( fd );
+                return;
+            }
+        }
+    }
+}
+
+
+int main( int argc, const char** argv )
+{
+    int port = 8750;
+    for ( int a=1; a<argc; ++a )
+    {
+        if ( argv[a]==std::string("-p") && a+1<argc )
+        {
+            port = atoi( argv[++a] );
+        }
+        else if ( argv[a]==std::string("-d") && a+1<argc )
+        {
+            s_folder = argv[++a];
+        }
+        else if ( argv[a]==std::string("-m") && a+1<argc )
+        {
+            s_maxSize = (std::size_t)strtoull( argv[++a], nullptr, 10 )*1024*1024;
+        }
+        else
+        {
+            fprintf( stderr, "Usage: craft-cache-server [-p <port>] [-d <folder>] [-m <megabytes>]\n" );
+            return 1;
+        }
+    }
+
+    while ( s_folder.size()>1 && s_folder.back()=='/' )
+    {
+        s_folder.pop_back();
+    }
+    mkdir( s_folder.c_str(), 0755 );
+
+    int server = socket( AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0 );
+    int reuse = 1;
+    setsockopt( server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse) );
+
+    sockaddr_in address;
+    memset( &address, 0, sizeof(address) );
+    address.sin_family = AF_INET;
+    address.sin_port = htons( (uint16_t)port );
+    address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    if ( server<0 || bind( server, (sockaddr*)&address, sizeof(address) )!=0 || listen( server, 64 )!=0 )
+    {
+        fprintf( stderr, "Failed to listen on port %d: %s\n", port, strerror(errno) );
+        return 1;
+    }
+
+    fprintf( stderr, "Serving [%s] on http://127.0.0.1:%d\n", s_folder.c_str(), port );
+
+    while ( true )
+    {
+        int fd = accept4( server, nullptr, nullptr, SOCK_CLOEXEC );
+        if ( fd<0 )
+        {
+            if ( errno==EINTR || errno==ECONNABORTED )
+            {
+                continue;
+            }
+            fprintf( stderr, "Failed to accept a connection: %s\n", strerror(errno) );
+            return 1;
+        }
+
+        int noDelay = 1;
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay) );
+        std::thread( ServeConnection, fd ).detach();
+    }
+}
@@ -1,5 +1,6 @@
 
 #include "compiler.h"
+#include "object_cache.h"
 
 #include "craft_private.h"
 #include "target.h"
@@ -9,7 +10,9 @@
 #include <string>
 #include <sstream>
 #include <vector>
-#include <regex>
+
+
+thread_local int Compiler::s_current_configuration = 0;
 
 
 Compiler::Compiler()
@@ -19,12 +22,12 @@ Compiler::Compiler()
 
 void Compiler::set_configuration( const std::string& name )
 {
-    m_current_configuration = -1;
+    s_current_configuration = -1;
     for (std::size_t i=0; i<m_configurations.size(); ++i)
     {
         if (m_configurations[i].m_name==name)
         {
-            m_current_configuration = (int)i;
+            s_current_configuration = (int)i;
         }
     }
 }
@@ -40,6 +43,66 @@ void Compiler::add_configuration( const std::string& name, const std::vector<std
 }
 
 
+uint64_t Compiler::hash_command( const std::string& command, const std::vector<std::string>& arguments )
+{
+    // FNV-1a, including the size of every string so that the boundaries between them matter.
+    uint64_t result = 14695981039346656037ULL;
+    auto add = [&result]( const void* data, std::size_t size )
+    {
+        const unsigned char* bytes = (const unsigned char*)data;
+        for (std::size_t i=0; i<size; ++i)
+        {
+            result = ( result ^ bytes[i] ) * 1099511628211ULL;
+        }
+    };
+
+    uint64_t size = command.size();
+    add( &size, sizeof(size) );
+    add( command.data(), command.size() );
+
+    for ( const auto& a: arguments )
+    {
+        size = a.size();
+        add( &size, sizeof(size) );
+        add( a.data(), a.size() );
+    }
+
+    // 0 means unknown command
+    return result ? result : 1;
+}
+
+
+bool Compiler::write_dependencies( const std::string& path, const std::string& target, const NodeList& deps )
+{
+    auto escape = []( const std::string& name )
+    {
+        std::string result;
+        for ( char c: name )
+        {
+            if (c==' ' || c=='#') result += '\\';
+            if (c=='$') result += '$';
+            result += c;
+        }
+        return result;
+    };
+
+    std::string rules = escape(target)+":";
+    for ( const auto& d: deps )
+    {
+        rules += " \\\n "+escape(d->m_absolutePath);
+    }
+    rules += "\n";
+
+    FILE* file = fopen( path.c_str(), "wb" );
+    if (!file)
+    {
+        return false;
+    }
+    bool result = fwrite( rules.data(), 1, rules.size(), file )==rules.size();
+    return ( fclose( file )==0 ) && result;
+}
+
+
 int Compiler::get_link_program_dependencies( NodeList& deps,
                                               const NodeList& objects,
                                               const std::vector<std::shared_ptr<BuiltTarget>>& uses)
@@ -118,6 +181,123 @@ int Compiler::get_link_dynamic_library_dependencies( NodeList& deps,
 }
 
 
+int Compiler::parse_dependencies( NodeList& deps, const char* rules, std::size_t size )
+{
+    // Make rules: every line has some targets followed by ':' and their prerequisites. Lines may be
+    // continued with a backslash, spaces in names are escaped with a backslash and '$' is doubled.
+    std::string currentPath = FileGetCurrentPath()+FileSeparator();
+
+    std::string name;
+    bool readingTargets = true;
+
+    auto addName = [&]()
+    {
+        if (name.size() && !readingTargets)
+        {
+            std::shared_ptr<Node> node = std::make_shared<Node>();
+            if (FileIsAbsolute(name))
+            {
+                node->m_absolutePath = name;
+            }
+            else
+            {
+                node->m_absolutePath.reserve( currentPath.size()+name.size() );
+                node->m_absolutePath = currentPath;
+                node->m_absolutePath += name;
+            }
+            deps.push_back( node );
+        }
+        name.clear();
+    };
+
+    const char* c = rules;
+    const char* end = rules+size;
+    while (c<end)
+    {
+        // Copy the longest run of plain characters at once
+        const char* plain = c;
+        while ( c<end
+                && *c!='\\' && *c!='$' && *c!=':'
+                && *c!=' ' && *c!='\t' && *c!='\r' && *c!='\n' )
+        {
+            ++c;
+        }
+        name.append( plain, c );
+
+        if (c==end)
+        {
+            break;
+        }
+
+        switch (*c)
+        {
+        case '\\':
+            if ( c+1<end && c[1]=='\n' )
+            {
+                // Line continuation
+                addName();
+                c += 2;
+            }
+            else if ( c+2<end && c[1]=='\r' && c[2]=='\n' )
+            {
+                addName();
+                c += 3;
+            }
+            else if ( c+1<end && (c[1]==' ' || c[1]=='#') )
+            {
+                // Escaped character
+                name += c[1];
+                c += 2;
+            }
+            else
+            {
+                // Windows path separator
+                name += *c;
+                ++c;
+            }
+            break;
+
+        case '$':
+            name += *c;
+            c += ( c+1<end && c[1]=='$' ) ? 2 : 1;
+            break;
+
+        case ':':
+            // End of the targets, unless it is part of a path like C:/
+            if ( readingTargets
+                 && ( c+1==end || c[1]==' ' || c[1]=='\t' || c[1]=='\r' || c[1]=='\n' ) )
+            {
+                name.clear();
+                readingTargets = false;
+            }
+            else
+            {
+                name += *c;
+            }
+            ++c;
+            break;
+
+        case '\n':
+            // End of the rule
+            addName();
+            readingTargets = true;
+            ++c;
+            break;
+
+        default:
+            // Whitespace
+            addName();
+            ++c;
+            break;
+        }
+    }
+
+    addName();
+
+    return 0;
+}
+
+
 //-------------------------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------------------------
@@ -150,7 +330,6 @@ CompilerGCC::CompilerGCC()
     add_configuration("debug",{"-O0","-g"},{});
     add_configuration("profile",{"-O3","-g"},{});
     add_configuration("release",{"-O3"},{});
-    m_current_configuration=0;
 }
 
 
@@ -197,12 +376,29 @@ void CompilerGCC::build_compile_argument_list( std::vector<std::string>& args, c
     args.push_back("c++");
 
     // Configuration flags
-    if (m_current_configuration>=0 && m_current_configuration<(int)m_configurations.size())
+    if (s_current_configuration>=0 && s_current_configuration<(int)m_configurations.size())
     {
-        const auto& f = m_configurations[m_current_configuration].m_compileFlags;
+        const auto& f = m_configurations[s_current_configuration].m_compileFlags;
         args.insert( args.end(), f.begin(), f.end() );
     }
 
+    // Paths in the workspace are written relative to it in the debug information and in macros
+    // like __FILE__, and random names, like the ones of some anonymous symbols, come from the
+    // target instead.
+    if (m_deterministicRoot.size())
+    {
+        args.push_back("-ffile-prefix-map="+m_deterministicRoot+"=.");
+        args.push_back("-fdebug-prefix-map="+m_deterministicRoot+"=.");
+
+        std::string seed = target;
+        if ( seed.compare( 0, m_deterministicRoot.size()+1, m_deterministicRoot+FileSeparator() )==0 )
+        {
+            seed = seed.substr( m_deterministicRoot.size()+1 );
+        }
+        args.push_back("-frandom-seed="+seed);
+        args.push_back("-Wdate-time");
+    }
+
     args.push_back(source);
     args.push_back("-I");
     args.push_back(".");
@@ -215,12 +411,26 @@ void CompilerGCC::build_compile_argument_list( std::vector<std::string>& args, c
 }
 
 
+std::string CompilerGCC::get_dependency_file( const std::string& target ) const
+{
+    return FileReplaceExtension( target, "d" );
+}
+
+
 int CompilerGCC::get_compile_dependencies( NodeList& deps, const std::string& source, const std::string& target, const std::vector<std::string>& includePaths )
 {
     AXE_SCOPED_SECTION(get_deps);
 
     int result = 0;
 
+    // Use the dependencies recorded in the last compilation of the target if we have them.
+    std::string recordedRules;
+    if ( FileRead( get_dependency_file(target), recordedRules ) )
+    {
+        return parse_dependencies( deps, recordedRules.data(), recordedRules.size() );
+    }
+
+    // Otherwise, scan them running the preprocessor.
     std::vector<std::string> args;
     build_compile_argument_list(args,source,target,includePaths);
 
@@ -240,49 +450,7 @@ int CompilerGCC::get_compile_dependencies( NodeList& deps, const std::string& so
             AXE_LOG_LINES( "stderr", axe::Level::Verbose, err );
         }
 
-        // Process execution output to get the dependencies
-        std::regex rule_regex("\\s\\n");
-        std::sregex_token_iterator rule_begin(out.begin(), out.end(), rule_regex, -1);
-        std::sregex_token_iterator rule_end;
-        //AXE_LOG( "regex", axe::L_Verbose, "%d rules", std::distance(rule_begin,rule_end) );
-
-        while( rule_begin!=rule_end )
-        {
-            std::string rule = rule_begin->str();
-
-            std::regex dep_regex(R"([\s\n\\]+|([.\w]+:))");
-            std::sregex_token_iterator dep_begin(rule.begin(), rule.end(), dep_regex, -1);
-            std::sregex_token_iterator dep_end;
-
-            while( dep_begin!=dep_end )
-            {
-                std::string dep = dep_begin->str();
-                if (dep.size())
-                {
-                    //AXE_LOG( "dep", axe::L_Verbose, dep );
-
-                    std::string dep_absolute_path;
-                    if (FileIsAbsolute(dep))
-                    {
-                        dep_absolute_path = dep;
-                    }
-                    else
-                    {
-                        dep_absolute_path = FileGetCurrentPath();
-                        dep_absolute_path += FileSeparator()+dep;
-                    }
-
-                    std::shared_ptr<Node> targetNode = std::make_shared<Node>();
-                    targetNode->m_absolutePath = dep_absolute_path;
-
-                    deps.push_back(targetNode);
-                }
-                ++dep_begin;
-            }
-
-            ++rule_begin;
-        }
-
+        parse_dependencies( deps, out.data(), out.size() );
     }
     catch(...)
     {
@@ -303,9 +471,33 @@ int CompilerGCC::compile( const std::string& source, const std::string& target,
     std::vector<std::string> args;
     build_compile_argument_list(args,source,target,includePaths);
 
+    // Reuse the object of an identical compilation, from this or any other build.
+    ObjectCache* cache = GetObjectCache();
+    std::string cacheKey;
+    if (cache)
+    {
+        cacheKey = cache->get_key( m_exec, args, source );
+
+        NodeList dependencies;
+        if ( cacheKey.size() && cache->fetch( cacheKey, target, dependencies ) )
+        {
+            write_dependencies( get_dependency_file(target), target, dependencies );
+            return 0;
+        }
+    }
+
+    ObjectCache::release_output( target );
+
     args.push_back("-o");
     args.push_back(target);
 
+    // Record the dependencies while compiling, so that we don't need to scan them in the next build.
+    // Objects stored in the cache must also depend on the system headers, which can change without
+    // the compiler changing.
+    args.push_back( cacheKey.size() ? "-MD" : "-MMD" );
+    args.push_back("-MF");
+    args.push_back(get_dependency_file(target));
+
     try
     {
         std::string out, err;
@@ -314,6 +506,19 @@ int CompilerGCC::compile( const std::string& source, const std::string& target,
              [&err](const char* text){ err += text; },
              0, nullptr );
 
+        AXE_COUNTER_ADD( "craft_compiler_output_bytes", out.size()+err.size() );
+
+        if ( result==0 && cacheKey.size() )
+        {
+            std::string rules;
+            NodeList dependencies;
+            if ( FileRead( get_dependency_file(target), rules ) )
+            {
+                parse_dependencies( dependencies, rules.data(), rules.size() );
+                cache->store( cacheKey, target, dependencies );
+            }
+        }
+
         if (out.size())
         {
             AXE_SCOPED_SECTION(stdout);
@@ -336,14 +541,77 @@ int CompilerGCC::compile( const std::string& source, const std::string& target,
 }
 
 
-int CompilerGCC::link_program( const std::string& target,
-                             const NodeList& objects,
-                             const std::vector<std::shared_ptr<BuiltTarget>>& uses )
+void CompilerGCC::prefetch_compile( const std::string& source, const std::string& target, const std::vector<std::string>& includePaths )
 {
-    AXE_SCOPED_SECTION(link_program);
+    ObjectCache* cache = GetObjectCache();
+    if ( cache && cache->get_remote() )
+    {
+        std::vector<std::string> args;
+        build_compile_argument_list(args,source,target,includePaths);
+        cache->prefetch( cache->get_key( m_exec, args, source ) );
+    }
+}
+
 
+int CompilerGCC::run_link( const std::string& tool, const std::vector<std::string>& args,
+                           const std::string& target, const NodeList& inputs, bool executable )
+{
     int result = 0;
 
+    // Reuse the output of an identical link, from this or any other build.
+    ObjectCache* cache = GetObjectCache();
+    std::string cacheKey;
+    if (cache)
+    {
+        cacheKey = cache->get_action_key( tool, args, inputs );
+        if ( cacheKey.size() && cache->fetch_output( cacheKey, target, executable, inputs ) )
+        {
+            return 0;
+        }
+    }
+
+    ObjectCache::release_output( target );
+
+    try
+    {
+        std::string out, err;
+        result = Run( "", tool, args,
+             [&out](const char* text){ out += text; },
+             [&err](const char* text){ err += text; },
+             0, nullptr );
+
+        if ( result==0 && cacheKey.size() )
+        {
+            cache->store_output( cacheKey, target );
+        }
+
+        if (out.size())
+        {
+            AXE_SCOPED_SECTION(stdout);
+            AXE_LOG_LINES( "stdout", axe::Level::Verbose, out );
+        }
+
+        if (err.size())
+        {
+            AXE_SCOPED_SECTION(stderr);
+            AXE_LOG_LINES( "stderr", axe::Level::Verbose, err );
+        }
+    }
+    catch(...)
+    {
+        AXE_LOG( "run", axe::Level::Error, "Execution failed!" );
+        result = -1;
+    }
+
+    return result;
+}
+
+
+void CompilerGCC::build_link_program_argument_list( std::vector<std::string>& args,
+                                                 const std::string& target,
+                                                 const NodeList& objects,
+                                                 const std::vector<std::shared_ptr<BuiltTarget>>& uses )
+{
     // Gather library options
 //    std::vector<std::string> libraryOptions;
 //    for( size_t u=0; u<uses.size(); ++u )
@@ -356,12 +624,18 @@ int CompilerGCC::link_program( const std::string& target,
 //        }
 //    }
 
-    std::vector<std::string> args;
     args.push_back("-B");
     args.push_back("/usr/bin");
     args.push_back("-o");
     args.push_back(target);
 
+    // Configuration flags
+    if (s_current_configuration>=0 && s_current_configuration<(int)m_configurations.size())
+    {
+        const auto& f = m_configurations[s_current_configuration].m_linkFlags;
+        args.insert( args.end(), f.begin(), f.end() );
+    }
+
     for (size_t i=0; i<objects.size(); ++i)
     {
          args.push_back(objects[i]->m_absolutePath);
@@ -405,100 +679,79 @@ int CompilerGCC::link_program( const std::string& target,
             AXE_LOG( "Compiler", axe::Level::Error, "Program uses an unknown target type [%s].", target->m_name.c_str() );
         }
     }
+}
 
-    try
-    {
-        std::string out, err;
-        result = Run( "", m_exec, args,
-             [&out](const char* text){ out += text; },
-             [&err](const char* text){ err += text; },
-             0, nullptr );
 
-        if (out.size())
-        {
-            AXE_SCOPED_SECTION(stdout);
-            AXE_LOG_LINES( "stdout", axe::Level::Verbose, out );
-        }
+int CompilerGCC::link_program( const std::string& target,
+                             const NodeList& objects,
+                             const std::vector<std::shared_ptr<BuiltTarget>>& uses )
+{
+    AXE_SCOPED_SECTION(link_program);
 
-        if (err.size())
-        {
-            AXE_SCOPED_SECTION(stderr);
-            AXE_LOG_LINES( "stderr", axe::Level::Verbose, err );
-        }
-    }
-    catch(...)
-    {
-        AXE_LOG( "run", axe::Level::Error, "Execution failed!" );
-        result = -1;
-    }
+    std::vector<std::string> args;
+    build_link_program_argument_list(args,target,objects,uses);
 
-    return result;
+    NodeList inputs;
+    get_link_program_dependencies( inputs, objects, uses );
+
+    return run_link( m_exec, args, target, inputs, true );
 }
 
 
-int CompilerGCC::link_static_library( const std::string& target, const NodeList& objects )
+void CompilerGCC::build_link_static_library_argument_list( std::vector<std::string>& args, const std::string& target, const NodeList& objects )
 {
-    AXE_SCOPED_SECTION(link_static_lib);
-
-    int result = 0;
-
-    std::vector<std::string> args;
     args.push_back("-r");
     args.push_back("-c");
     args.push_back("-s");
+
+    // No times, owners or modes in the members
+    if (m_deterministicRoot.size())
+    {
+        args.push_back("-D");
+    }
+
     args.push_back(target);
 
     for (size_t i=0; i<objects.size(); ++i)
     {
          args.push_back(objects[i]->m_absolutePath);
     }
+}
 
-    try
-    {
-        std::string out, err;
-        result = Run( "", m_arexec, args,
-             [&out](const char* text){ out += text; },
-             [&err](const char* text){ err += text; },
-             0, nullptr );
 
-        if (out.size())
-        {
-            AXE_SCOPED_SECTION(stdout);
-            AXE_LOG_LINES( "stdout", axe::Level::Verbose, out );
-        }
+int CompilerGCC::link_static_library( const std::string& target, const NodeList& objects )
+{
+    AXE_SCOPED_SECTION(link_static_lib);
 
-        if (err.size())
-        {
-            AXE_SCOPED_SECTION(stderr);
-            AXE_LOG_LINES( "stderr", axe::Level::Verbose, err );
-        }
-    }
-    catch(...)
-    {
-        AXE_LOG( "run", axe::Level::Error, "Execution failed!" );
-        result = -1;
-    }
+    std::vector<std::string> args;
+    build_link_static_library_argument_list(args,target,objects);
 
-    return result;
+    // ar keeps the members of an existing archive, like the objects of removed sources, so it is
+    // always created again.
+    remove( target.c_str() );
+
+    return run_link( m_arexec, args, target, objects, false );
 }
 
 
-int CompilerGCC::link_dynamic_library( const std::string& target,
-                                     const NodeList& objects,
-                                     const std::vector<std::shared_ptr<BuiltTarget>>& uses )
+void CompilerGCC::build_link_dynamic_library_argument_list( std::vector<std::string>& args,
+                                                         const std::string& target,
+                                                         const NodeList& objects,
+                                                         const std::vector<std::shared_ptr<BuiltTarget>>& uses )
 {
-    AXE_SCOPED_SECTION(link_shared_lib);
-
-    int result = 0;
-
-    // Gather parameters
-    std::vector<std::string> args;
     args.push_back("-B");
     args.push_back("/usr/bin");
     args.push_back("-shared");
     args.push_back("-o");
     args.push_back(target);
 
+    // Configuration flags
+    if (s_current_configuration>=0 && s_current_configuration<(int)m_configurations.size())
+    {
+        const auto& f = m_configurations[s_current_configuration].m_linkFlags;
+        args.insert( args.end(), f.begin(), f.end() );
+    }
+
     for (size_t i=0; i<objects.size(); ++i)
     {
          args.push_back(objects[i]->m_absolutePath);
@@ -533,34 +786,59 @@ int CompilerGCC::link_dynamic_library( const std::string& target,
             AXE_LOG( "Compiler", axe::Level::Error, "Dynamic library uses an unknown target type [%s].", target->m_name.c_str() );
         }
     }
+}
 
-    try
-    {
-        std::string out, err;
-        result = Run( "", m_exec, args,
-             [&out](const char* text){ out += text; },
-             [&err](const char* text){ err += text; },
-             0, nullptr );
 
-        if (out.size())
-        {
-            AXE_SCOPED_SECTION(stdout);
-            AXE_LOG_LINES( "stdout", axe::Level::Verbose, out );
-        }
+int CompilerGCC::link_dynamic_library( const std::string& target,
+                                     const NodeList& objects,
+                                     const std::vector<std::shared_ptr<BuiltTarget>>& uses )
+{
+    AXE_SCOPED_SECTION(link_shared_lib);
 
-        if (err.size())
-        {
-            AXE_SCOPED_SECTION(stderr);
-            AXE_LOG_LINES( "stderr", axe::Level::Verbose, err );
-        }
-    }
-    catch(...)
-    {
-        AXE_LOG( "run", axe::Level::Error, "Execution failed!" );
-        result = -1;
-    }
+    // Gather parameters
+    std::vector<std::string> args;
+    build_link_dynamic_library_argument_list(args,target,objects,uses);
 
-    return result;
+    NodeList inputs;
+    get_link_dynamic_library_dependencies( inputs, target, objects, uses );
+
+    return run_link( m_exec, args, target, inputs, true );
+}
+
+
+uint64_t CompilerGCC::get_compile_hash( const std::string& source, const std::string& target, const std::vector<std::string>& includePaths )
+{
+    std::vector<std::string> args;
+    build_compile_argument_list(args,source,target,includePaths);
+    return hash_command( m_exec, args );
+}
+
+
+uint64_t CompilerGCC::get_link_program_hash( const std::string& target,
+                                        const NodeList& objects,
+                                        const std::vector<std::shared_ptr<BuiltTarget>>& uses )
+{
+    std::vector<std::string> args;
+    build_link_program_argument_list(args,target,objects,uses);
+    return hash_command( m_exec, args );
+}
+
+
+uint64_t CompilerGCC::get_link_static_library_hash( const std::string& target, const NodeList& objects )
+{
+    std::vector<std::string> args;
+    build_link_static_library_argument_list(args,target,objects);
+    return hash_command( m_arexec, args );
+}
+
+
+uint64_t CompilerGCC::get_link_dynamic_library_hash( const std::string& target,
+                                                const NodeList& objects,
+                                                const std::vector<std::shared_ptr<BuiltTarget>>& uses )
+{
+    std::vector<std::string> args;
+    build_link_dynamic_library_argument_list(args,target,objects,uses);
+    return hash_command( m_exec, args );
 }
 
 
@@ -582,7 +860,6 @@ CompilerMSVC::CompilerMSVC()
     add_configuration("debug",{"/Od","/Zi"},{});
     add_configuration("profile",{"/Ox","/Zi"},{});
     add_configuration("release",{"/Ox"},{});
-    m_current_configuration=0;
 }
 
 
@@ -606,9 +883,9 @@ void CompilerMSVC::build_compile_argument_list( std::vector<std::string>& args,
     args.push_back("/c");
 
     // Configuration flags
-    if (m_current_configuration>=0 && m_current_configuration<(int)m_configurations.size())
+    if (s_current_configuration>=0 && s_current_configuration<(int)m_configurations.size())
     {
-        const auto& f = m_configurations[m_current_configuration].m_compileFlags;
+        const auto& f = m_configurations[s_current_configuration].m_compileFlags;
         args.insert( args.end(), f.begin(), f.end() );
     }
 
@@ -659,49 +936,7 @@ int CompilerMSVC::get_compile_dependencies( NodeList& deps, const std::string& s
         }
 
         // Process execution output to get the dependencies
-        std::regex rule_regex("\\s\\n");
-        std::sregex_token_iterator rule_begin(out.begin(), out.end(), rule_regex, -1);
-        std::sregex_token_iterator rule_end;
-        //AXE_LOG( "regex", axe::L_Verbose, "%d rules", std::distance(rule_begin,rule_end) );
-
-        while( rule_begin!=rule_end )
-        {
-            //AXE_LOG( "rule", axe::L_Verbose, rule_begin->str() );
-
-            std::string rule = rule_begin->str();
-
-            std::regex dep_regex(R"([\s\n\\]+|([.\w]+:))");
-            std::sregex_token_iterator dep_begin(rule.begin(), rule.end(), dep_regex, -1);
-            std::sregex_token_iterator dep_end;
-
-            while( dep_begin!=dep_end )
-            {
-                std::string dep = dep_begin->str();
-                if (dep.size())
-                {
-                    //AXE_LOG( "dep", axe::L_Verbose, dep );
-
-                    std::string dep_absolute_path;
-                    if (FileIsAbsolute(dep))
-                    {
-                        dep_absolute_path = dep;
-                    }
-                    else
-                    {
-                        dep_absolute_path = FileGetCurrentPath();
-                        dep_absolute_path += FileSeparator()+dep;
-                    }
-
-                    std::shared_ptr<Node> targetNode = std::make_shared<Node>();
-                    targetNode->m_absolutePath = dep_absolute_path;
-
-                    deps.push_back(targetNode);
-                }
-                ++dep_begin;
-            }
-
-            ++rule_begin;
-        }
+        parse_dependencies( deps, out.data(), out.size() );
 
     }
     catch(...)
@@ -734,6 +969,8 @@ int CompilerMSVC::compile( const std::string& source, const std::string& target,
              [&err](const char* text){ err += text; },
              0, nullptr );
 
+        AXE_COUNTER_ADD( "craft_compiler_output_bytes", out.size()+err.size() );
+
         if (out.size())
         {
             AXE_SCOPED_SECTION(stdout);
@@ -756,14 +993,11 @@ int CompilerMSVC::compile( const std::string& source, const std::string& target,
 }
 
 
-int CompilerMSVC::link_program( const std::string& target,
-                             const NodeList& objects,
-                             const std::vector<std::shared_ptr<BuiltTarget>>& uses )
+void CompilerMSVC::build_link_program_argument_list( std::vector<std::string>& args,
+                                                 const std::string& target,
+                                                 const NodeList& objects,
+                                                 const std::vector<std::shared_ptr<BuiltTarget>>& uses )
 {
-    AXE_SCOPED_SECTION(link_program);
-
-    int result = 0;
-
     // Gather library options
 //    std::vector<std::string> libraryOptions;
 //    for( size_t u=0; u<uses.size(); ++u )
@@ -776,12 +1010,18 @@ int CompilerMSVC::link_program( const std::string& target,
 //        }
 //    }
 
-    std::vector<std::string> args;
     args.push_back("-B");
     args.push_back("/usr/bin");
     args.push_back("-o");
     args.push_back(target);
 
+    // Configuration flags
+    if (s_current_configuration>=0 && s_current_configuration<(int)m_configurations.size())
+    {
+        const auto& f = m_configurations[s_current_configuration].m_linkFlags;
+        args.insert( args.end(), f.begin(), f.end() );
+    }
+
     for (size_t i=0; i<objects.size(); ++i)
     {
          args.push_back(objects[i]->m_absolutePath);
@@ -825,6 +1065,19 @@ int CompilerMSVC::link_program( const std::string& target,
             AXE_LOG( "Compiler", axe::Level::Error, "Program uses an unknown target type [%s].", target->m_name.c_str() );
         }
     }
+}
+
+
+int CompilerMSVC::link_program( const std::string& target,
+                             const NodeList& objects,
+                             const std::vector<std::shared_ptr<BuiltTarget>>& uses )
+{
+    AXE_SCOPED_SECTION(link_program);
+
+    int result = 0;
+
+    std::vector<std::string> args;
+    build_link_program_argument_list(args,target,objects,uses);
 
     try
     {
@@ -856,13 +1109,8 @@ int CompilerMSVC::link_program( const std::string& target,
 }
 
 
-int CompilerMSVC::link_static_library( const std::string& target, const NodeList& objects )
+void CompilerMSVC::build_link_static_library_argument_list( std::vector<std::string>& args, const std::string& target, const NodeList& objects )
 {
-    AXE_SCOPED_SECTION(link_static_lib);
-
-    int result = 0;
-
-    std::vector<std::string> args;
     args.push_back("-r");
     args.push_back("-c");
     args.push_back("-s");
@@ -872,6 +1120,17 @@ int CompilerMSVC::link_static_library( const std::string& target, const NodeList
     {
          args.push_back(objects[i]->m_absolutePath);
     }
+}
+
+
+int CompilerMSVC::link_static_library( const std::string& target, const NodeList& objects )
+{
+    AXE_SCOPED_SECTION(link_static_lib);
+
+    int result = 0;
+
+    std::vector<std::string> args;
+    build_link_static_library_argument_list(args,target,objects);
 
     try
     {
@@ -903,22 +1162,24 @@ int CompilerMSVC::link_static_library( const std::string& target, const NodeList
 }
 
 
-int CompilerMSVC::link_dynamic_library( const std::string& target,
-                                     const NodeList& objects,
-                                     const std::vector<std::shared_ptr<BuiltTarget>>& uses )
+void CompilerMSVC::build_link_dynamic_library_argument_list( std::vector<std::string>& args,
+                                                         const std::string& target,
+                                                         const NodeList& objects,
+                                                         const std::vector<std::shared_ptr<BuiltTarget>>& uses )
 {
-    AXE_SCOPED_SECTION(link_shared_lib);
-
-    int result = 0;
-
-    // Gather parameters
-    std::vector<std::string> args;
     args.push_back("-B");
     args.push_back("/usr/bin");
     args.push_back("-shared");
     args.push_back("-o");
     args.push_back(target);
 
+    // Configuration flags
+    if (s_current_configuration>=0 && s_current_configuration<(int)m_configurations.size())
+    {
+        const auto& f = m_configurations[s_current_configuration].m_linkFlags;
+        args.insert( args.end(), f.begin(), f.end() );
+    }
+
     for (size_t i=0; i<objects.size(); ++i)
     {
          args.push_back(objects[i]->m_absolutePath);
@@ -953,6 +1214,20 @@ int CompilerMSVC::link_dynamic_library( const std::string& target,
             AXE_LOG( "Compiler", axe::Level::Error, "Dynamic library uses an unknown target type [%s].", target->m_name.c_str() );
         }
     }
+}
+
+
+int CompilerMSVC::link_dynamic_library( const std::string& target,
+                                     const NodeList& objects,
+                                     const std::vector<std::shared_ptr<BuiltTarget>>& uses )
+{
+    AXE_SCOPED_SECTION(link_shared_lib);
+
+    int result = 0;
+
+    // Gather parameters
+    std::vector<std::string> args;
+    build_link_dynamic_library_argument_list(args,target,objects,uses);
 
     try
     {
@@ -984,6 +1259,42 @@ int CompilerMSVC::link_dynamic_library( const std::string& target,
 }
 
 
+uint64_t CompilerMSVC::get_compile_hash( const std::string& source, const std::string& target, const std::vector<std::string>& includePaths )
+{
+    std::vector<std::string> args;
+    build_compile_argument_list(args,source,target,includePaths);
+    return hash_command( m_exec, args );
+}
+
+
+uint64_t CompilerMSVC::get_link_program_hash( const std::string& target,
+                                        const NodeList& objects,
+                                        const std::vector<std::shared_ptr<BuiltTarget>>& uses )
+{
+    std::vector<std::string> args;
+    build_link_program_argument_list(args,target,objects,uses);
+    return hash_command( m_exec, args );
+}
+
+
+uint64_t CompilerMSVC::get_link_static_library_hash( const std::string& target, const NodeList& objects )
+{
+    std::vector<std::string> args;
+    build_link_static_library_argument_list(args,target,objects);
+    return hash_command( m_arexec, args );
+}
+
+
+uint64_t CompilerMSVC::get_link_dynamic_library_hash( const std::string& target,
+                                                const NodeList& objects,
+                                                const std::vector<std::shared_ptr<BuiltTarget>>& uses )
+{
+    std::vector<std::string> args;
+    build_link_dynamic_library_argument_list(args,target,objects,uses);
+    return hash_command( m_exec, args );
+}
+
+
 const char* CompilerMSVC::get_default_object_extension()
 {
     return "obj";
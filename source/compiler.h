@@ -18,6 +18,10 @@ public:
     void set_configuration( const std::string& name );
     void add_configuration( const std::string& name, const std::vector<std::string>& compileFlags, const std::vector<std::string>& linkFlags );
 
+    //! Make the outputs depend only on the contents of the inputs: paths inside the workspace root
+    //! are written as relative ones, and no times are recorded. An empty root disables it.
+    void set_deterministic_root( const std::string& root ) { m_deterministicRoot = root; }
+
     int get_link_dynamic_library_dependencies( NodeList& deps,
                                    const std::string& target,
                                    const NodeList& objects,
@@ -34,6 +38,10 @@ public:
 
     virtual int get_compile_dependencies( NodeList& deps, const std::string& source, const std::string& target, const std::vector<std::string>& includePaths ) = 0;
     virtual int compile( const std::string& source, const std::string& target, const std::vector<std::string>& includePaths ) = 0;
+
+    //! Start looking up a compilation in the remote object cache, while the build is being planned.
+    virtual void prefetch_compile( const std::string& source, const std::string& target, const std::vector<std::string>& includePaths ) {}
+
     virtual int link_program( const std::string& target,
                        const NodeList& objects,
                        const std::vector<std::shared_ptr<BuiltTarget>>& uses )=0;
@@ -41,11 +49,26 @@ public:
     virtual int link_dynamic_library( const std::string& target,
                                const NodeList& objects,
                                const std::vector<std::shared_ptr<BuiltTarget>>& uses) = 0;
+
+    //! Fingerprints of the commands used to compile and link targets. They change whenever the
+    //! tool or any of its arguments change, like the configuration flags or the include paths.
+    //! They are never 0, which is used for unknown commands.
+    virtual uint64_t get_compile_hash( const std::string& source, const std::string& target, const std::vector<std::string>& includePaths ) = 0;
+    virtual uint64_t get_link_program_hash( const std::string& target,
+                       const NodeList& objects,
+                       const std::vector<std::shared_ptr<BuiltTarget>>& uses ) = 0;
+    virtual uint64_t get_link_static_library_hash( const std::string& target, const NodeList& objects ) = 0;
+    virtual uint64_t get_link_dynamic_library_hash( const std::string& target,
+                               const NodeList& objects,
+                               const std::vector<std::shared_ptr<BuiltTarget>>& uses) = 0;
+
     virtual const char* get_default_object_extension() = 0;
 
 protected:
 
-    int m_current_configuration;
+    //! Index of the configuration selected with set_configuration. It is kept per thread so that
+    //! tasks of different configurations can use the same compiler concurrently.
+    static thread_local int s_current_configuration;
 
     struct Configuration
     {
@@ -56,6 +79,19 @@ protected:
 
     std::vector<Configuration> m_configurations;
 
+    //! Workspace root in deterministic mode, or empty
+    std::string m_deterministicRoot;
+
+    //! Add to deps the prerequisites of the make rules generated by the compiler. Relative paths
+    //! are resolved from the current path.
+    int parse_dependencies( NodeList& deps, const char* rules, std::size_t size );
+
+    //! Write a make rule with the dependencies of a target, like the compiler does.
+    static bool write_dependencies( const std::string& path, const std::string& target, const NodeList& deps );
+
+    //! Hash a command and its arguments for the get_*_hash methods.
+    static uint64_t hash_command( const std::string& command, const std::vector<std::string>& arguments );
+
 };
 
 
@@ -70,6 +106,7 @@ public:
     //! Compiler interface
     int get_compile_dependencies( NodeList& deps, const std::string& source, const std::string& target, const std::vector<std::string>& includePaths ) override;
     int compile( const std::string& source, const std::string& target, const std::vector<std::string>& includePaths ) override;
+    void prefetch_compile( const std::string& source, const std::string& target, const std::vector<std::string>& includePaths ) override;
     int link_program( const std::string& target,
                        const NodeList& objects,
                        const std::vector<std::shared_ptr<BuiltTarget>>& uses ) override;
@@ -77,6 +114,14 @@ public:
     int link_dynamic_library( const std::string& target,
                                const NodeList& objects,
                                const std::vector<std::shared_ptr<BuiltTarget>>& uses) override;
+    uint64_t get_compile_hash( const std::string& source, const std::string& target, const std::vector<std::string>& includePaths ) override;
+    uint64_t get_link_program_hash( const std::string& target,
+                       const NodeList& objects,
+                       const std::vector<std::shared_ptr<BuiltTarget>>& uses ) override;
+    uint64_t get_link_static_library_hash( const std::string& target, const NodeList& objects ) override;
+    uint64_t get_link_dynamic_library_hash( const std::string& target,
+                               const NodeList& objects,
+                               const std::vector<std::shared_ptr<BuiltTarget>>& uses) override;
     const char* get_default_object_extension() override;
 
 private:
@@ -84,7 +129,25 @@ private:
     std::string m_exec;
     std::string m_arexec;
 
+    //! Run a link tool, or reuse its output from the object cache.
+    //! \param inputs files whose contents the output depends on
+    //! \param executable whether the output is a program or a dynamic library
+    int run_link( const std::string& tool, const std::vector<std::string>& args,
+                  const std::string& target, const NodeList& inputs, bool executable );
+
     void build_compile_argument_list( std::vector<std::string>& args, const std::string& source, const std::string& target, const std::vector<std::string>& includePaths );
+    void build_link_program_argument_list( std::vector<std::string>& args,
+                       const std::string& target,
+                       const NodeList& objects,
+                       const std::vector<std::shared_ptr<BuiltTarget>>& uses );
+    void build_link_static_library_argument_list( std::vector<std::string>& args, const std::string& target, const NodeList& objects );
+    void build_link_dynamic_library_argument_list( std::vector<std::string>& args,
+                               const std::string& target,
+                               const NodeList& objects,
+                               const std::vector<std::shared_ptr<BuiltTarget>>& uses );
+
+    //! Path of the file where the dependencies of a target are recorded when compiling it.
+    std::string get_dependency_file( const std::string& target ) const;
 
 };
 
@@ -107,6 +170,14 @@ public:
     int link_dynamic_library( const std::string& target,
                                const NodeList& objects,
                                const std::vector<std::shared_ptr<BuiltTarget>>& uses) override;
+    uint64_t get_compile_hash( const std::string& source, const std::string& target, const std::vector<std::string>& includePaths ) override;
+    uint64_t get_link_program_hash( const std::string& target,
+                       const NodeList& objects,
+                       const std::vector<std::shared_ptr<BuiltTarget>>& uses ) override;
+    uint64_t get_link_static_library_hash( const std::string& target, const NodeList& objects ) override;
+    uint64_t get_link_dynamic_library_hash( const std::string& target,
+                               const NodeList& objects,
+                               const std::vector<std::shared_ptr<BuiltTarget>>& uses) override;
     const char* get_default_object_extension() override;
 
 private:
@@ -115,6 +186,15 @@ private:
     std::string m_arexec;
 
     void build_compile_argument_list( std::vector<std::string>& args, const std::string& source, const std::string& target, const std::vector<std::string>& includePaths );
+    void build_link_program_argument_list( std::vector<std::string>& args,
+                       const std::string& target,
+                       const NodeList& objects,
+                       const std::vector<std::shared_ptr<BuiltTarget>>& uses );
+    void build_link_static_library_argument_list( std::vector<std::string>& args, const std::string& target, const NodeList& objects );
+    void build_link_dynamic_library_argument_list( std::vector<std::string>& args,
+                               const std::string& target,
+                               const NodeList& objects,
+                               const std::vector<std::shared_ptr<BuiltTarget>>& uses );
 
 };
 
@@ -4,10 +4,20 @@
 #include "axe.h"
 #include "platform.h"
 #include "target.h"
+#include "build_database.h"
+#include "object_cache.h"
 
 #include <string>
 #include <sstream>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <fstream>
+#include <cstdlib>
 
 
 ContextPlan::ContextPlan( const Context& craftContext )
@@ -25,12 +35,33 @@ ContextPlan::ContextPlan( const Context& craftContext )
     m_toolchains = craftContext.m_toolchains;
     m_toolchain = craftContext.m_toolchain;
     m_configurations = craftContext.m_configurations;
+
+    m_statCache = std::make_shared<FileStatCache>();
+    m_previousStatCache = FileSetStatCache( m_statCache.get() );
+
+    m_objectCache = ObjectCache::create_from_environment();
+    m_previousObjectCache = SetObjectCache( m_objectCache.get() );
+
+    // Outputs that are the same in any checkout of the workspace, so that they can be shared
+    const char* deterministic = getenv("CRAFT_DETERMINISTIC");
+    if ( deterministic && atoi( deterministic ) )
+    {
+        for ( const auto& t: m_toolchains )
+        {
+            t->get_compiler()->set_deterministic_root( m_buildRoot );
+        }
+        if (m_objectCache)
+        {
+            m_objectCache->set_workspace( m_buildRoot );
+        }
+    }
 }
 
 
 ContextPlan::~ContextPlan()
 {
-
+    SetObjectCache( m_previousObjectCache );
+    FileSetStatCache( m_previousStatCache );
 }
 
 
@@ -140,24 +171,425 @@ void ContextPlan::set_current_configuration( const std::string& name )
 }
 
 
+void ContextPlan::set_jobs( int jobs )
+{
+    m_jobs = jobs;
+}
+
+
+int ContextPlan::get_jobs() const
+{
+    int jobs = m_jobs;
+    if (jobs<=0)
+    {
+        jobs = (int)std::thread::hardware_concurrency();
+    }
+
+    return std::max(jobs,1);
+}
+
+
 int ContextPlan::run()
 {
     AXE_SCOPED_SECTION(tasks);
 
-    AXE_LOG( "task", axe::Level::Info, "%3d tasks", m_tasks.size() );
+    // The same task may have been added several times (for instance through the outputs of used
+    // targets), so gather the unique list keeping the planning order.
+    std::vector<std::shared_ptr<Task>> tasks;
+    std::map<const Task*,std::size_t> taskIndices;
+    for ( const auto& t: m_tasks )
+    {
+        if ( taskIndices.insert( std::make_pair(t.get(),tasks.size()) ).second )
+        {
+            tasks.push_back( t );
+        }
+    }
+
+    // Build the dependency graph from the task requirements. Requirements that are not part of the
+    // plan are already up to date.
+    std::vector<int> pendingRequirements( tasks.size(), 0 );
+    std::vector<std::vector<std::size_t>> dependents( tasks.size() );
+    for ( std::size_t i=0; i<tasks.size(); ++i )
+    {
+        for ( const auto& r: tasks[i]->m_requirements )
+        {
+            auto it = taskIndices.find( r.get() );
+            if ( it!=taskIndices.end() && it->second!=i )
+            {
+                dependents[it->second].push_back( i );
+                ++pendingRequirements[i];
+            }
+        }
+    }
+
+    // Task producing every output, to find out if the pending inputs of a task have changed.
+    std::map<std::string,std::size_t> producers;
+    for ( std::size_t i=0; i<tasks.size(); ++i )
+    {
+        for ( const auto& n: tasks[i]->m_outputs )
+        {
+            producers[n->m_absolutePath] = i;
+        }
+    }
+
+    // Estimate the duration of every task from previous runs, and the longest path from each task
+    // to the end of the plan. Tasks on the longest paths are started first.
+    LoadTaskHistory();
+
+    std::vector<int64_t> estimatedDurations( tasks.size(), 0 );
+    {
+        int64_t knownTotal = 0;
+        std::size_t knownCount = 0;
+        std::map<std::string,std::pair<int64_t,std::size_t>> knownByType;
+        for ( std::size_t i=0; i<tasks.size(); ++i )
+        {
+            int64_t duration = GetTaskRecordedDuration( *tasks[i] );
+            if (duration>0)
+            {
+                estimatedDurations[i] = duration;
+                knownTotal += duration;
+                ++knownCount;
+                knownByType[tasks[i]->m_type].first += duration;
+                ++knownByType[tasks[i]->m_type].second;
+            }
+        }
+
+        // Unknown tasks are estimated with the average of the known tasks of the same type.
+        for ( std::size_t i=0; i<tasks.size(); ++i )
+        {
+            if (estimatedDurations[i]==0)
+            {
+                auto it = knownByType.find( tasks[i]->m_type );
+                if ( it!=knownByType.end() )
+                {
+                    estimatedDurations[i] = it->second.first/(int64_t)it->second.second;
+                }
+                else if (knownCount)
+                {
+                    estimatedDurations[i] = knownTotal/(int64_t)knownCount;
+                }
+                else
+                {
+                    estimatedDurations[i] = 1;
+                }
+            }
+        }
+    }
+
+    std::vector<int64_t> priorities( estimatedDurations );
+    {
+        // Topological order of the tasks
+        std::vector<std::size_t> order;
+        std::vector<int> pending( pendingRequirements );
+        for ( std::size_t i=0; i<tasks.size(); ++i )
+        {
+            if ( pending[i]==0 )
+            {
+                order.push_back( i );
+            }
+        }
+        for ( std::size_t o=0; o<order.size(); ++o )
+        {
+            for ( std::size_t d: dependents[order[o]] )
+            {
+                if ( --pending[d]==0 )
+                {
+                    order.push_back( d );
+                }
+            }
+        }
+
+        for ( auto it=order.rbegin(); it!=order.rend(); ++it )
+        {
+            int64_t longestDependent = 0;
+            for ( std::size_t d: dependents[*it] )
+            {
+                longestDependent = std::max( longestDependent, priorities[d] );
+            }
+            priorities[*it] = estimatedDurations[*it] + longestDependent;
+        }
+    }
+
+    // Ready tasks are kept in a heap with the longest remaining path on top. Ties keep the planning
+    // order.
+    auto isLessUrgent = [&priorities]( std::size_t a, std::size_t b )
+    {
+        return priorities[a]<priorities[b] || ( priorities[a]==priorities[b] && a>b );
+    };
+
+    std::vector<std::size_t> readyTasks;
+    for ( std::size_t i=0; i<tasks.size(); ++i )
+    {
+        if ( pendingRequirements[i]==0 )
+        {
+            readyTasks.push_back( i );
+        }
+    }
+    std::make_heap( readyTasks.begin(), readyTasks.end(), isLessUrgent );
+
+    int jobs = std::min( get_jobs(), std::max( (int)tasks.size(), 1 ) );
+
+    AXE_LOG( "task", axe::Level::Info, "%3d tasks, %d jobs", tasks.size(), jobs );
 
+    std::mutex mutex;
+    std::condition_variable stateChanged;
+    std::size_t startedCount = 0;
+    std::size_t finishedCount = 0;
+    std::size_t runningCount = 0;
+    std::size_t cutOffCount = 0;
     int result = 0;
 
-    // Things should happen here.
-    for ( std::size_t i=0; i<m_tasks.size(); ++i )
+    // Tasks that have finished leaving the contents of all their outputs as they were.
+    std::vector<char> unchanged( tasks.size(), 0 );
+
+    auto worker = [&]()
     {
-        AXE_LOG( "task", axe::Level::Info, "[%3d of %3d] %s", i+1, m_tasks.size(), m_tasks[i]->m_type.c_str() );
-        int taskResult = m_tasks[i]->m_runMethod();
-        if (taskResult!=0)
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
         {
-            AXE_LOG( "task", axe::Level::Error, "failed! [%d]", taskResult );
-            result = -1;
-            break;
+            stateChanged.wait( lock, [&]()
+            {
+                return result!=0 || !readyTasks.empty() || runningCount==0;
+            } );
+
+            // Stop on the first failure, or when there is nothing else that can be run.
+            if ( result!=0 || readyTasks.empty() )
+            {
+                break;
+            }
+
+            std::pop_heap( readyTasks.begin(), readyTasks.end(), isLessUrgent );
+            std::size_t index = readyTasks.back();
+            readyTasks.pop_back();
+            ++runningCount;
+            ++startedCount;
+
+            // If the task is only outdated because of inputs built by other tasks, and all of them
+            // have been built with the same contents, it doesn't need to run.
+            const auto& task = tasks[index];
+            bool cutOff = !task->m_pendingInputs.empty();
+            for ( const auto& n: task->m_pendingInputs )
+            {
+                auto it = producers.find( n->m_absolutePath );
+                if ( it==producers.end() || !unchanged[it->second] )
+                {
+                    cutOff = false;
+                    break;
+                }
+            }
+
+            lock.unlock();
+
+            int taskResult = 0;
+            int64_t duration = 0;
+            bool outputsUnchanged = !task->m_outputs.empty();
+            if (cutOff)
+            {
+                AXE_LOG( "task", axe::Level::Info, "[%3d of %3d] %s skipped, unchanged inputs", startedCount, tasks.size(), task->m_type.c_str() );
+                AXE_COUNTER_ADD( "craft_tasks_cut_off", 1 );
+
+                // Make the outputs newer than the inputs, so that the next build doesn't try again.
+                for ( const auto& n: task->m_outputs )
+                {
+                    refresh_output( n->m_absolutePath );
+                }
+            }
+            else
+            {
+                AXE_LOG( "task", axe::Level::Info, "[%3d of %3d] %s", startedCount, tasks.size(), task->m_type.c_str() );
+
+                std::vector<uint64_t> previousHashes;
+                for ( const auto& n: task->m_outputs )
+                {
+                    previousHashes.push_back( GetRecordedOutputHash( n->m_absolutePath ) );
+                }
+
+                auto startTime = std::chrono::steady_clock::now();
+                taskResult = task->m_runMethod();
+                auto endTime = std::chrono::steady_clock::now();
+                duration = std::chrono::duration_cast<std::chrono::microseconds>(endTime-startTime).count();
+
+                AXE_COUNTER_ADD( "craft_tasks_run", 1 );
+                AXE_HISTOGRAM_RECORD( "craft_task_duration_microseconds", duration );
+
+                // The task has written its outputs, even if it failed.
+                for ( const auto& n: task->m_outputs )
+                {
+                    m_statCache->invalidate( n->m_absolutePath );
+                }
+
+                if (taskResult==0)
+                {
+                    for ( std::size_t o=0; o<task->m_outputs.size() && outputsUnchanged; ++o )
+                    {
+                        outputsUnchanged = previousHashes[o]!=0
+                                && previousHashes[o]==GetRecordedOutputHash( task->m_outputs[o]->m_absolutePath );
+                    }
+                }
+            }
+
+            lock.lock();
+
+            --runningCount;
+            ++finishedCount;
+
+            if (taskResult!=0)
+            {
+                AXE_LOG( "task", axe::Level::Error, "failed! [%d]", taskResult );
+                if (result==0)
+                {
+                    result = taskResult;
+                }
+            }
+            else
+            {
+                unchanged[index] = outputsUnchanged;
+                if (cutOff)
+                {
+                    ++cutOffCount;
+                }
+                else
+                {
+                    RecordTaskDuration( *task, duration );
+                }
+
+                for ( std::size_t d: dependents[index] )
+                {
+                    if ( --pendingRequirements[d]==0 )
+                    {
+                        readyTasks.push_back( d );
+                        std::push_heap( readyTasks.begin(), readyTasks.end(), isLessUrgent );
+                    }
+                }
+            }
+
+            stateChanged.notify_all();
+        }
+    };
+
+    // The calling thread is one of the workers.
+    std::vector<std::thread> threads;
+    for ( int j=1; j<jobs; ++j )
+    {
+        threads.emplace_back( [&worker,j]()
+        {
+            AXE_SET_THREAD_NAME( ("worker-"+std::to_string(j)).c_str() );
+            worker();
+        } );
+    }
+    worker();
+
+    for ( auto& t: threads )
+    {
+        t.join();
+    }
+
+    if ( result==0 && finishedCount<tasks.size() )
+    {
+        AXE_LOG( "task", axe::Level::Error, "%d tasks could not run because of circular requirements.", tasks.size()-finishedCount );
+        result = -1;
+    }
+
+    if (cutOffCount)
+    {
+        AXE_LOG( "task", axe::Level::Info, "%d tasks skipped because their inputs were built with the same contents.", cutOffCount );
+    }
+
+    SaveTaskHistory();
+
+    if (m_buildDatabase)
+    {
+        FileCreateDirectories( m_currentPath );
+        m_buildDatabase->save( get_build_database_path() );
+    }
+
+    AXE_INT_VALUE( "stat_cache", axe::Level::Info, "hits", m_statCache->get_hits() );
+    AXE_INT_VALUE( "stat_cache", axe::Level::Info, "misses", m_statCache->get_misses() );
+
+    if (m_objectCache)
+    {
+        AXE_INT_VALUE( "object_cache", axe::Level::Info, "hits", m_objectCache->get_hits() );
+        AXE_INT_VALUE( "object_cache", axe::Level::Info, "misses", m_objectCache->get_misses() );
+        AXE_INT_VALUE( "object_cache", axe::Level::Info, "bytes not copied", m_objectCache->get_saved_size() );
+
+        if ( RemoteCache* remote = m_objectCache->get_remote() )
+        {
+            // Wait for the uploads, so that the next builds can use them
+            remote->flush();
+            AXE_INT_VALUE( "remote_cache", axe::Level::Info, "hits", remote->get_hits() );
+            AXE_INT_VALUE( "remote_cache", axe::Level::Info, "misses", remote->get_misses() );
+            AXE_INT_VALUE( "remote_cache", axe::Level::Info, "read", remote->get_read_size() );
+            AXE_INT_VALUE( "remote_cache", axe::Level::Info, "written", remote->get_written_size() );
+        }
+
+        m_objectCache->save_statistics();
+    }
+
+    return result;
+}
+
+
+std::string ContextPlan::get_task_history_path() const
+{
+    return m_currentPath+FileSeparator()+".craft_task_history";
+}
+
+
+void ContextPlan::LoadTaskHistory()
+{
+    if (m_taskHistoryLoaded)
+    {
+        return;
+    }
+    m_taskHistoryLoaded = true;
+
+    // Each line has the duration in microseconds and the output path of the task.
+    std::ifstream file( get_task_history_path() );
+    std::string line;
+    while ( std::getline( file, line ) )
+    {
+        std::string::size_type separator = line.find( ' ' );
+        if ( separator!=std::string::npos )
+        {
+            int64_t duration = std::strtoll( line.c_str(), nullptr, 10 );
+            if (duration>0)
+            {
+                m_taskDurations[line.substr(separator+1)] = duration;
+            }
+        }
+    }
+}
+
+
+void ContextPlan::SaveTaskHistory()
+{
+    if ( !m_taskHistoryChanged )
+    {
+        return;
+    }
+
+    FileCreateDirectories( m_currentPath );
+
+    std::ofstream file( get_task_history_path(), std::ios::trunc );
+    for ( const auto& d: m_taskDurations )
+    {
+        file << d.second << " " << d.first << "\n";
+    }
+
+    m_taskHistoryChanged = false;
+}
+
+
+int64_t ContextPlan::GetTaskRecordedDuration( const Task& task ) const
+{
+    int64_t result = 0;
+
+    for ( const auto& n: task.m_outputs )
+    {
+        auto it = m_taskDurations.find( n->m_absolutePath );
+        if ( it!=m_taskDurations.end() )
+        {
+            result = std::max( result, it->second );
         }
     }
 
@@ -165,12 +597,144 @@ int ContextPlan::run()
 }
 
 
+void ContextPlan::RecordTaskDuration( const Task& task, int64_t microseconds )
+{
+    // Tasks without outputs can't be identified across runs.
+    for ( const auto& n: task.m_outputs )
+    {
+        m_taskDurations[n->m_absolutePath] = std::max( microseconds, (int64_t)1 );
+        m_taskHistoryChanged = true;
+    }
+}
+
+
+std::string ContextPlan::get_build_database_path() const
+{
+    return m_currentPath+FileSeparator()+".craft_build_state";
+}
+
+
+BuildDatabase& ContextPlan::GetBuildDatabase()
+{
+    std::call_once( m_buildDatabaseLoaded, [this]()
+    {
+        m_buildDatabase = std::make_shared<BuildDatabase>();
+        m_buildDatabase->load( get_build_database_path() );
+    } );
+
+    return *m_buildDatabase;
+}
+
+
+bool ContextPlan::get_recorded_dependencies( const std::string& output, NodeList& dependencies, uint64_t& commandHash )
+{
+    BuildDatabase::Record record;
+    if ( !GetBuildDatabase().get( output, record ) )
+    {
+        return false;
+    }
+
+    // The record is only valid for the exact file that was produced.
+    FileInfo info = FileGetInfo( output );
+    if ( !info.m_exists
+         || (int64_t)info.m_time.m_time!=record.m_outputTime
+         || info.m_size!=record.m_outputSize )
+    {
+        return false;
+    }
+
+    dependencies.reserve( dependencies.size()+record.m_dependencies.size() );
+    for ( auto& d: record.m_dependencies )
+    {
+        std::shared_ptr<Node> node = std::make_shared<Node>();
+        node->m_absolutePath = std::move(d);
+        dependencies.push_back( node );
+    }
+    commandHash = record.m_commandHash;
+
+    return true;
+}
+
+
+void ContextPlan::record_output( const std::string& output, const NodeList& dependencies, uint64_t commandHash )
+{
+    m_statCache->invalidate( output );
+    FileInfo info = FileGetInfo( output );
+    if ( !info.m_exists )
+    {
+        GetBuildDatabase().remove( output );
+        return;
+    }
+
+    BuildDatabase::Record record;
+    record.m_commandHash = commandHash;
+    record.m_outputTime = (int64_t)info.m_time.m_time;
+    record.m_outputSize = info.m_size;
+    record.m_outputHash = FileGetContentHash( output );
+    record.m_dependencies.reserve( dependencies.size() );
+    for ( const auto& d: dependencies )
+    {
+        record.m_dependencies.push_back( d->m_absolutePath );
+    }
+
+    GetBuildDatabase().set( output, record );
+}
+
+
+uint64_t ContextPlan::GetRecordedOutputHash( const std::string& output )
+{
+    BuildDatabase::Record record;
+    if ( !GetBuildDatabase().get( output, record ) )
+    {
+        return 0;
+    }
+
+    FileInfo info = FileGetInfo( output );
+    if ( !info.m_exists || (int64_t)info.m_time.m_time!=record.m_outputTime || info.m_size!=record.m_outputSize )
+    {
+        return 0;
+    }
+
+    return record.m_outputHash;
+}
+
+
+void ContextPlan::refresh_output( const std::string& output )
+{
+    // Outputs restored from the object cache may be hard linked to it. If they can't be copied
+    // they are left as they are, and the next build will check them again.
+    if ( !ObjectCache::unshare_output( output ) )
+    {
+        AXE_LOG( "task", axe::Level::Warning, "Failed to copy [%s] out of the object cache.", output.c_str() );
+        return;
+    }
+
+    FileTouch( output );
+    m_statCache->invalidate( output );
+
+    BuildDatabase::Record record;
+    FileInfo info = FileGetInfo( output );
+    if ( info.m_exists && GetBuildDatabase().get( output, record ) )
+    {
+        record.m_outputTime = (int64_t)info.m_time.m_time;
+        record.m_outputSize = info.m_size;
+        GetBuildDatabase().set( output, record );
+    }
+}
+
+
 const std::string& ContextPlan::get_current_path() const
 {
     return m_currentPath;
 }
 
 
+const std::string& ContextPlan::get_build_root() const
+{
+    return m_buildRoot;
+}
+
+
 std::shared_ptr<Target_Base> ContextPlan::get_target( const std::string& name )
 {
     std::shared_ptr<Target_Base> result;
@@ -209,7 +773,10 @@ std::shared_ptr<BuiltTarget> ContextPlan::get_built_target( const std::string& n
             result = target->build( *this );
             result->m_sourceTarget = target;
             m_currentBuiltTargets->m_targets[target] = result;
-            m_tasks.insert(m_tasks.end(),result->m_outputTasks.begin(),result->m_outputTasks.end());
+            for ( const auto& t: result->m_outputTasks )
+            {
+                add_task( t );
+            }
         }
         else
         {
@@ -225,7 +792,10 @@ std::shared_ptr<BuiltTarget> ContextPlan::get_built_target( const std::string& n
             result = target->build( *this );
             result->m_sourceTarget = target;
             m_insensitiveBuiltTargets[target] = result;
-            m_tasks.insert(m_tasks.end(),result->m_outputTasks.begin(),result->m_outputTasks.end());
+            for ( const auto& t: result->m_outputTasks )
+            {
+                add_task( t );
+            }
         }
         else
         {
@@ -244,43 +814,68 @@ const TargetList& ContextPlan::get_targets()
 }
 
 
-bool ContextPlan::IsNodePending( const Node& node )
+void ContextPlan::add_task( const std::shared_ptr<Task>& task )
 {
-    for( const auto& t: m_tasks )
+    m_tasks.push_back( task );
+    UpdatePendingOutputs();
+}
+
+
+void ContextPlan::UpdatePendingOutputs()
+{
+    // Tasks may also have been appended directly to m_tasks, so index everything not seen yet.
+    for ( ; m_indexedTaskCount<m_tasks.size(); ++m_indexedTaskCount )
     {
-       for ( const auto& n: t->m_outputs )
-       {
-           if ( node.m_absolutePath==n->m_absolutePath )
-           {
-               return true;
-           }
-       }
+        const auto& t = m_tasks[m_indexedTaskCount];
+        for ( const auto& n: t->m_outputs )
+        {
+            m_pendingOutputs.insert( std::make_pair( n->m_absolutePath, t ) );
+        }
     }
+}
 
-    return false;
+
+bool ContextPlan::IsNodePending( const Node& node )
+{
+    UpdatePendingOutputs();
+
+    return m_pendingOutputs.find( node.m_absolutePath )!=m_pendingOutputs.end();
 }
 
 
-bool ContextPlan::IsTargetOutdated( FileTime target_time, const NodeList& dependencies, std::shared_ptr<Node>* failed )
+bool ContextPlan::IsTargetOutdated( FileTime target_time, const NodeList& dependencies, std::shared_ptr<Node>* failed, NodeList* pending )
 {
+    if (pending)
+    {
+        pending->clear();
+    }
+
     if ( target_time.IsNull() )
     {
         return true;
     }
 
+    NodeList pendingDependencies;
     for (const auto& n: dependencies)
     {
-        if (IsNodePending(*n))
+        FileTime dep_time = FileGetModificationTime( n->m_absolutePath );
+        bool newer = dep_time.IsNull() || dep_time>target_time;
+
+        if ( IsNodePending(*n) && !newer )
         {
-            if (failed)
+            // It may still be built with the same contents. Keep looking for other reasons only
+            // if the caller wants to know.
+            if (failed && pendingDependencies.empty())
             {
                 (*failed) = n;
             }
-            return true;
+            if (!pending)
+            {
+                return true;
+            }
+            pendingDependencies.push_back( n );
         }
-
-        FileTime dep_time = FileGetModificationTime( n->m_absolutePath );
-        if (dep_time.IsNull() || dep_time>target_time)
+        else if (newer)
         {
             if (failed)
             {
@@ -290,6 +885,10 @@ bool ContextPlan::IsTargetOutdated( FileTime target_time, const NodeList& depend
         }
     }
 
-    return false;
+    if (pending)
+    {
+        (*pending) = pendingDependencies;
+    }
+    return !pendingDependencies.empty();
 }
 
@@ -18,7 +18,7 @@ AXE_IMPLEMENT()
 // with dlopen.
 extern "C"
 {
-    CRAFTCOREI_API void craft_entry( const char* workspacePath, const char** configurations, const char** targets, axe::Kernel* log_kernel );
+    CRAFTCOREI_API int craft_entry( const char* workspacePath, const char** configurations, const char** targets, int jobs, axe::Kernel* log_kernel );
 }
 
 
@@ -54,7 +54,7 @@ void plan_targets(std::shared_ptr<Context> context, std::shared_ptr<ContextPlan>
 }
 
 
-void craft_entry( const char* workspacePath, const char** configurations, const char** targets, axe::Kernel* log_kernel )
+int craft_entry( const char* workspacePath, const char** configurations, const char** targets, int jobs, axe::Kernel* log_kernel )
 {
     // Create a context for the build process
     std::shared_ptr<Context> context = std::make_shared<Context>();
@@ -64,6 +64,7 @@ void craft_entry( const char* workspacePath, const char** configurations, const
     craft( *context );
 
     std::shared_ptr<ContextPlan> contextPlan = std::make_shared<ContextPlan>(*context);
+    contextPlan->set_jobs( jobs );
 
     // If configurations have been defined in the command line, find them
     if (configurations && configurations[0])
@@ -75,7 +76,7 @@ void craft_entry( const char* workspacePath, const char** configurations, const
             {
                 // Error
                 AXE_LOG("craft",axe::Level::Error,"Configuration not found.");
-                return;
+                return 1;
             }
             else
             {
@@ -96,7 +97,7 @@ void craft_entry( const char* workspacePath, const char** configurations, const
         }
     }
 
-    contextPlan->run();
+    return contextPlan->run();
 }
 
 
@@ -8,6 +8,8 @@
 #include <vector>
 #include <memory>
 #include <map>
+#include <unordered_map>
+#include <mutex>
 
 
 //! Dynamic link library import and export
@@ -27,6 +29,8 @@
 #endif
 
 class Toolchain;
+class BuildDatabase;
+class ObjectCache;
 class Context;
 class Node;
 typedef std::vector< std::shared_ptr<Node> > NodeList;
@@ -70,6 +74,10 @@ public:
     NodeList m_outputs;
     std::function<int()> m_runMethod;
     std::vector<std::shared_ptr<Task>> m_requirements;
+
+    //! If the task is only outdated because some of its inputs are going to be built again, these
+    //! are the inputs. It doesn't need to run if they are built with the same contents.
+    NodeList m_pendingInputs;
 };
 
 
@@ -197,6 +205,9 @@ public:
     //! built objects are stored.
     CRAFTCOREI_API virtual const std::string& get_current_path() const;
 
+    //! Returns the absolute path of the workspace, where the build folder is.
+    CRAFTCOREI_API virtual const std::string& get_build_root() const;
+
     CRAFTCOREI_API virtual std::shared_ptr<class Target_Base> get_target( const std::string& name );
     CRAFTCOREI_API virtual std::shared_ptr<class BuiltTarget> get_built_target( const std::string& name );
 
@@ -208,12 +219,39 @@ public:
     // \todo hide when defining targets in a craftfile
     CRAFTCOREI_API virtual void set_current_configuration( const std::string& name );
     CRAFTCOREI_API virtual const std::string& get_current_configuration() const;
+
+    //! Set the maximum number of tasks that run concurrently. 0 or less means one task per
+    //! hardware thread.
+    CRAFTCOREI_API virtual void set_jobs( int jobs );
+    CRAFTCOREI_API virtual int get_jobs() const;
+
+    //! Run all the planned tasks, respecting their requirements. Independent tasks run
+    //! concurrently. Returns 0 on success or the status of the first failed task.
     CRAFTCOREI_API virtual int run();
 
 
-    CRAFTCOREI_API virtual bool IsTargetOutdated( FileTime target_time, const NodeList& dependencies, std::shared_ptr<Node>* failed=nullptr );
+    //! Check if any of the dependencies is newer than the target or will be built by a task.
+    //! \param pending if the target is outdated only because of dependencies that are built by
+    //! tasks and are not newer than the target yet, it receives these dependencies.
+    CRAFTCOREI_API virtual bool IsTargetOutdated( FileTime target_time, const NodeList& dependencies, std::shared_ptr<Node>* failed=nullptr, NodeList* pending=nullptr );
+
+    //! Add a task to the plan, so that its outputs are considered pending while planning.
+    CRAFTCOREI_API virtual void add_task( const std::shared_ptr<Task>& task );
+
+    //! Get the dependencies and the command hash recorded the last time the output was built. The
+    //! hash is 0 if the command was unknown.
+    //! \return false if there is no record or the output has changed since it was recorded.
+    CRAFTCOREI_API virtual bool get_recorded_dependencies( const std::string& output, NodeList& dependencies, uint64_t& commandHash );
 
-    //! Vector of tasks being filled up while planning
+    //! Record the dependencies and the current state of an output that has just been built.
+    //! It is safe to call it from concurrent tasks.
+    CRAFTCOREI_API virtual void record_output( const std::string& output, const NodeList& dependencies, uint64_t commandHash );
+
+    //! Mark an output that didn't need to be built again as up to date with its dependencies,
+    //! keeping its recorded dependencies and command.
+    CRAFTCOREI_API virtual void refresh_output( const std::string& output );
+
+    //! Vector of tasks being filled up while planning. Use add_task to append to it.
     std::vector<std::shared_ptr<Task>> m_tasks;
 
 protected:
@@ -270,6 +308,34 @@ protected:
     //! Configuration that we are currently parsing targets for.
     std::string m_current_configuration;
 
+    //! Index from the absolute path of every output of the planned tasks to the task producing it.
+    std::unordered_map<std::string,std::shared_ptr<Task>> m_pendingOutputs;
+
+    //! Number of tasks in m_tasks already added to m_pendingOutputs.
+    std::size_t m_indexedTaskCount = 0;
+
+    //! File system state cache used while this plan exists, and the one that was active before.
+    std::shared_ptr<FileStatCache> m_statCache;
+    FileStatCache* m_previousStatCache = nullptr;
+
+    //! Object cache used by the compilers while this plan exists, if it is enabled, and the one that
+    //! was active before.
+    std::shared_ptr<ObjectCache> m_objectCache;
+    ObjectCache* m_previousObjectCache = nullptr;
+
+    //! Maximum number of concurrent tasks when running the plan. 0 means the hardware concurrency.
+    int m_jobs = 0;
+
+    //! Duration in microseconds of the last successful run of the tasks producing each output path.
+    //! It is stored in the build folder and used to run the tasks in the critical path first.
+    std::map<std::string,int64_t> m_taskDurations;
+    bool m_taskHistoryLoaded = false;
+    bool m_taskHistoryChanged = false;
+
+    //! Dependencies and state of the built outputs, stored in the build folder between runs.
+    std::shared_ptr<BuildDatabase> m_buildDatabase;
+    std::once_flag m_buildDatabaseLoaded;
+
 private:
 
     //! Rebuild the build folder based on host and target platforms
@@ -281,9 +347,31 @@ private:
     //!
     //! \brief IsNodePending
     //! \param node
-    //! \return
+    //! \return true if the node is the output of a task in the plan.
     //!
     bool IsNodePending( const Node& node );
 
+    //! Add to m_pendingOutputs the tasks appended to m_tasks since the last update.
+    void UpdatePendingOutputs();
+
+    //! Path of the file in the build folder with the recorded task durations
+    std::string get_task_history_path() const;
+    void LoadTaskHistory();
+    void SaveTaskHistory();
+
+    //! Return the recorded duration of a task in microseconds, or 0 if it is unknown.
+    int64_t GetTaskRecordedDuration( const Task& task ) const;
+    void RecordTaskDuration( const Task& task, int64_t microseconds );
+
+    //! Path of the file in the build folder with the state of the built outputs
+    std::string get_build_database_path() const;
+
+    //! Return the build database, loading it the first time.
+    BuildDatabase& GetBuildDatabase();
+
+    //! Return the recorded content hash of an output, or 0 if it is unknown or the output has
+    //! changed since it was recorded.
+    uint64_t GetRecordedOutputHash( const std::string& output );
+
 
 };
@@ -2,11 +2,22 @@
 #include <iostream>
 
 #include "axe.h"
+#include "axe_tools.h"
 #include "craft_core.h"
 #include "target.h"
 #include "platform.h"
+#include "object_cache.h"
 
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#ifndef _WIN32
+    #include <unistd.h>
+    #include <dirent.h>
+    #include <sys/stat.h>
+#endif
 
 using namespace std;
 
@@ -14,13 +25,309 @@ using namespace std;
 AXE_IMPLEMENT();
 
 
+#ifndef _WIN32
+namespace
+{
+    //! Names in a folder, sorted, without "." and "..".
+    std::vector<std::string> ListFolder( const std::string& folder )
+    {
+        std::vector<std::string> names;
+        if ( DIR* dir = opendir( folder.c_str() ) )
+        {
+            while ( dirent* entry = readdir( dir ) )
+            {
+                if ( strcmp( entry->d_name, "." ) && strcmp( entry->d_name, ".." ) )
+                {
+                    names.push_back( entry->d_name );
+                }
+            }
+            closedir( dir );
+        }
+        std::sort( names.begin(), names.end() );
+        return names;
+    }
+
+    //! Copy a folder, keeping symbolic links and modes, but not the subfolders named in skipped.
+    bool CopyFolder( const std::string& from, const std::string& to, const std::vector<std::string>& skipped )
+    {
+        mkdir( to.c_str(), 0755 );
+
+        bool result = true;
+        for ( const auto& name: ListFolder( from ) )
+        {
+            std::string source = from+"/"+name;
+            std::string target = to+"/"+name;
+            struct stat sourceStat;
+            if ( lstat( source.c_str(), &sourceStat )!=0 )
+            {
+                result = false;
+            }
+            else if ( S_ISDIR( sourceStat.st_mode ) )
+            {
+                if ( std::find( skipped.begin(), skipped.end(), name )==skipped.end() )
+                {
+                    result = CopyFolder( source, target, std::vector<std::string>() ) && result;
+                }
+            }
+            else if ( S_ISLNK( sourceStat.st_mode ) )
+            {
+                char link[4096];
+                ssize_t size = readlink( source.c_str(), link, sizeof(link)-1 );
+                result = size>=0 && symlink( std::string( link, (std::size_t)size ).c_str(), target.c_str() )==0 && result;
+            }
+            else if ( S_ISREG( sourceStat.st_mode ) )
+            {
+                std::string content;
+                FILE* file = FileRead( source, content ) ? fopen( target.c_str(), "wb" ) : nullptr;
+                result = file && fwrite( content.data(), 1, content.size(), file )==content.size() && result;
+                result = file && fclose( file )==0 && result;
+                chmod( target.c_str(), sourceStat.st_mode & 07777 );
+            }
+        }
+        return result;
+    }
+
+    void RemoveFolder( const std::string& folder )
+    {
+        for ( const auto& name: ListFolder( folder ) )
+        {
+            std::string path = folder+"/"+name;
+            struct stat pathStat;
+            if ( lstat( path.c_str(), &pathStat )==0 && S_ISDIR( pathStat.st_mode ) )
+            {
+                RemoveFolder( path );
+            }
+            else
+            {
+                unlink( path.c_str() );
+            }
+        }
+        rmdir( folder.c_str() );
+    }
+
+    //! Compare the files in two folders, adding the relative paths of the ones that are different
+    //! or only in one of them to differences. Hidden files, like the build database, and the
+    //! dependency files of the compilers are not outputs, and are ignored.
+    //! \return the number of files compared.
+    int CompareFolders( const std::string& a, const std::string& b, const std::string& relative,
+                        std::vector<std::string>& differences )
+    {
+        int compared = 0;
+        std::vector<std::string> aNames = ListFolder( a+relative );
+        std::vector<std::string> bNames = ListFolder( b+relative );
+
+        auto ignored = []( const std::string& name )
+        {
+            return name[0]=='.' || ( name.size()>2 && name.compare( name.size()-2, 2, ".d" )==0 );
+        };
+
+        for ( const auto& name: aNames )
+        {
+            std::string path = relative+"/"+name;
+            struct stat aStat;
+            if ( ignored( name ) || lstat( (a+path).c_str(), &aStat )!=0 )
+            {
+                continue;
+            }
+
+            if ( !std::binary_search( bNames.begin(), bNames.end(), name ) )
+            {
+                differences.push_back( path+" (only in the first build)" );
+            }
+            else if ( S_ISDIR( aStat.st_mode ) )
+            {
+                compared += CompareFolders( a, b, path, differences );
+            }
+            else
+            {
+                std::string aContent, bContent;
+                FileRead( a+path, aContent );
+                FileRead( b+path, bContent );
+                if ( aContent!=bContent )
+                {
+                    differences.push_back( path );
+                }
+                ++compared;
+            }
+        }
+
+        for ( const auto& name: bNames )
+        {
+            if ( !ignored( name ) && !std::binary_search( aNames.begin(), aNames.end(), name ) )
+            {
+                differences.push_back( relative+"/"+name+" (only in the second build)" );
+            }
+        }
+
+        return compared;
+    }
+
+    //! Build two copies of the workspace in different folders in deterministic mode, without
+    //! object cache, and compare their outputs.
+    //! \return 0 if they are identical.
+    int VerifyDeterministicBuild( const std::string& workspace, int argc, const char** argv )
+    {
+        char program[4096];
+        ssize_t programSize = readlink( "/proc/self/exe", program, sizeof(program)-1 );
+        std::string craft = programSize>0 ? std::string( program, (std::size_t)programSize ) : std::string( argv[0] );
+        if ( !FileIsAbsolute( craft ) )
+        {
+            craft = FileGetCurrentPath()+"/"+craft;
+        }
+
+        const char* temporary = getenv("TMPDIR");
+        std::string folderTemplate = std::string( temporary ? temporary : "/tmp" )+"/craft-verify-XXXXXX";
+        std::vector<char> folderName( folderTemplate.begin(), folderTemplate.end() );
+        folderName.push_back( 0 );
+        if ( !mkdtemp( folderName.data() ) )
+        {
+            AXE_LOG( "craft", axe::Level::Error, "Failed to create a temporary folder [%s].", folderTemplate.c_str() );
+            return 1;
+        }
+        std::string folder = folderName.data();
+
+        setenv( "CRAFT_DETERMINISTIC", "1", 1 );
+        setenv( "CRAFT_CACHE_SIZE", "0", 1 );
+
+        // The folders have different lengths, to also catch paths in sections with sizes
+        std::vector<std::string> copies = { folder+"/first", folder+"/second-checkout" };
+        std::vector<std::string> arguments( argv+2, argv+argc );
+        for ( const auto& copy: copies )
+        {
+            if ( !CopyFolder( workspace, copy, { "build", ".git" } ) )
+            {
+                AXE_LOG( "craft", axe::Level::Error, "Failed to copy the workspace to [%s].", copy.c_str() );
+                return 1;
+            }
+
+            printf( "Building in [%s]...\n", copy.c_str() );
+            fflush( stdout );
+            std::string output;
+            int status = Run( copy, craft, arguments,
+                              [&output](const char* text){ output += text; },
+                              [&output](const char* text){ output += text; },
+                              0, nullptr );
+            if ( status!=0 )
+            {
+                fputs( output.c_str(), stdout );
+                AXE_LOG( "craft", axe::Level::Error, "The build in [%s] failed.", copy.c_str() );
+                return 1;
+            }
+        }
+
+        std::vector<std::string> differences;
+        int compared = CompareFolders( copies[0]+"/build", copies[1]+"/build", "", differences );
+        if ( differences.size() )
+        {
+            printf( "%d of %d outputs are different:\n", (int)differences.size(), compared );
+            for ( const auto& d: differences )
+            {
+                printf( "    %s\n", d.c_str() );
+            }
+            printf( "Both builds are kept in [%s].\n", folder.c_str() );
+            return 1;
+        }
+
+        printf( "All %d outputs are identical.\n", compared );
+        RemoveFolder( folder );
+        return 0;
+    }
+}
+#endif
+
+
 int main( int argc, const char** argv )
 {
     AXE_INITIALISE("craft",0,0);
+    AXE_SET_THREAD_NAME("main");
 
     // Share the logger with the craft-core dynamic library
     craft_core_log_init(axe::s_kernel);
 
+    // Convert a log to a timeline that can be opened in chrome://tracing or Perfetto:
+    //     craft trace <log> [<output json>]
+    if ( argc>2 && argv[1]==std::string("trace") )
+    {
+        std::string tracePath = argc>3 ? argv[3] : std::string(argv[2])+".json";
+        int result = 0;
+        if ( !axe::ExportChromeTrace( argv[2], tracePath.c_str() ) )
+        {
+            AXE_LOG( "craft", axe::Level::Error, "Failed to convert the log [%s] to a trace.", argv[2] );
+            result = 1;
+        }
+
+        AXE_FINALISE();
+        return result;
+    }
+
+    // Time spent in every section of a log, or its change between two logs:
+    //     craft profile <log> [<newer log>]
+    if ( argc>2 && argv[1]==std::string("profile") )
+    {
+        int result = 0;
+        axe::SpanProfile profile;
+        axe::SpanProfile newerProfile;
+        if ( !profile.Load( argv[2] ) )
+        {
+            AXE_LOG( "craft", axe::Level::Error, "Failed to read the log [%s].", argv[2] );
+            result = 1;
+        }
+        else if ( argc>3 && !newerProfile.Load( argv[3] ) )
+        {
+            AXE_LOG( "craft", axe::Level::Error, "Failed to read the log [%s].", argv[3] );
+            result = 1;
+        }
+        else if ( argc>3 )
+        {
+            axe::SpanProfile::PrintDiff( profile, newerProfile, stdout );
+        }
+        else
+        {
+            profile.Print( stdout );
+        }
+
+        AXE_FINALISE();
+        return result;
+    }
+
+    // Build the workspace twice in deterministic mode, from two folders, and compare the outputs:
+    //     craft verify [<build arguments>]
+    if ( argc>1 && argv[1]==std::string("verify") )
+    {
+#ifdef _WIN32
+        AXE_LOG( "craft", axe::Level::Error, "Verifying builds is not supported in this platform." );
+        int result = 1;
+#else
+        int result = VerifyDeterministicBuild( FileGetCurrentPath(), argc, argv );
+#endif
+        AXE_FINALISE();
+        return result;
+    }
+
+    // Statistics of the object cache shared by all the builds
+    if ( argc>1 && argv[1]==std::string("cache") )
+    {
+        std::shared_ptr<ObjectCache> cache = ObjectCache::create_from_environment();
+        if (!cache)
+        {
+            printf( "The object cache is disabled.\n" );
+        }
+        else
+        {
+            ObjectCache::Statistics statistics = cache->load_statistics();
+            uint64_t lookups = statistics.m_hits+statistics.m_misses;
+            printf( "path      %s\n", cache->get_path().c_str() );
+            printf( "size      %.1f of %.1f MB\n", statistics.m_size/1048576.0, cache->get_max_size()/1048576.0 );
+            printf( "hits      %llu\n", (unsigned long long)statistics.m_hits );
+            printf( "misses    %llu\n", (unsigned long long)statistics.m_misses );
+            printf( "hit rate  %.1f%%\n", lookups ? statistics.m_hits*100.0/lookups : 0.0 );
+            printf( "not copied %.1f MB\n", statistics.m_savedSize/1048576.0 );
+        }
+
+        AXE_FINALISE();
+        return 0;
+    }
+
     // Build the craft framework if necessary
 //    std::string env = "./env";
 
@@ -38,6 +345,7 @@ int main( int argc, const char** argv )
     std::string workspace = FileGetCurrentPath();
     std::vector<const char*> configurations;
     std::vector<const char*> targets;
+    int jobs = 0;
     {
         int arg = 1;
         while (arg<argc)
@@ -68,6 +376,31 @@ int main( int argc, const char** argv )
                     }
                 }
             }
+            // Maximum number of concurrent tasks
+            else if (argv[arg]==std::string("-j") )
+            {
+                if (arg+1<argc)
+                {
+                    // Do we really have a number of jobs, or do we have another option?
+                    if (argv[arg+1][0]!='-')
+                    {
+                        jobs = atoi( argv[arg+1] );
+                        ++arg;
+                    }
+                }
+            }
+            // Log levels, like "info,deps=verbose,bin:file=all"
+            else if (argv[arg]==std::string("-l") )
+            {
+                if (arg+1<argc)
+                {
+                    if ( !AXE_SET_LEVELS( argv[arg+1] ) )
+                    {
+                        AXE_LOG( "craft", axe::Level::Warning, "Invalid log levels [%s].", argv[arg+1] );
+                    }
+                    ++arg;
+                }
+            }
             // Target
             else
             {
@@ -84,6 +417,7 @@ int main( int argc, const char** argv )
 
     // Locate the craft file
     std::string root = "./";
+    int result = 1;
 
     if ( !FileExists( root+"craftfile" ) )
     {
@@ -108,6 +442,7 @@ int main( int argc, const char** argv )
 
         std::shared_ptr<ContextPlan> ctxPlan = std::make_shared<ContextPlan>( *ctx );
         ctxPlan->set_current_configuration( "debug" );
+        ctxPlan->set_jobs( jobs );
         auto builtTarget = ctxPlan->get_built_target(target.m_name);
         if (builtTarget->has_errors())
         {
@@ -126,7 +461,7 @@ int main( int argc, const char** argv )
                 // Load and run the dynamic library entry method
                 AXE_SCOPED_SECTION_DETAILED(RunningCraftfile,"Running craftfile");
                 std::string craftLibrary = builtTarget->m_outputNode->m_absolutePath;
-                LoadAndRun( craftLibrary.c_str(), "craft_entry", workspace.c_str(), &configurations[0], &targets[0] );
+                result = LoadAndRun( craftLibrary.c_str(), "craft_entry", workspace.c_str(), &configurations[0], &targets[0], jobs );
             }
         }
     }
@@ -134,6 +469,6 @@ int main( int argc, const char** argv )
     AXE_FINALISE();
 
     // Done
-    return 0;
+    return result;
 }
 
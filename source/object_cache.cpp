@@ -0,0 +1,1134 @@
+#include "object_cache.h"
+
+#include "axe.h"
+#include "craft_core.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+    #include <direct.h>
+    #include <process.h>
+    #include <sys/utime.h>
+#else
+    #include <dirent.h>
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <utime.h>
+    #include <sys/file.h>
+#endif
+
+#ifdef __linux__
+    #include <sys/ioctl.h>
+    #include <linux/fs.h>
+#endif
+
+
+#define CRAFT_OBJECT_CACHE_MANIFEST_HEADER  "craft-manifest 2"
+#define CRAFT_OBJECT_CACHE_ACTION_HEADER    "craft-action 1"
+
+//! Maximum number of dependency sets remembered for the same manifest key
+#define CRAFT_OBJECT_CACHE_MANIFEST_ENTRIES 8
+
+
+namespace
+{
+    inline uint64_t RotateLeft( uint64_t x, int r )
+    {
+        return (x<<r) | (x>>(64-r));
+    }
+
+    inline uint64_t Mix( uint64_t k )
+    {
+        k ^= k>>33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k>>33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k>>33;
+        return k;
+    }
+
+    //! MurmurHash3 x64 128, as 32 hexadecimal characters.
+    std::string HashData( const void* data, std::size_t size )
+    {
+        const uint8_t* bytes = (const uint8_t*)data;
+        const uint64_t c1 = 0x87c37b91114253d5ULL;
+        const uint64_t c2 = 0x4cf5ad432745937fULL;
+        uint64_t h1 = 0;
+        uint64_t h2 = 0;
+
+        std::size_t blocks = size/16;
+        for (std::size_t b=0; b<blocks; ++b)
+        {
+            uint64_t k1, k2;
+            memcpy( &k1, bytes+b*16, 8 );
+            memcpy( &k2, bytes+b*16+8, 8 );
+
+            k1 *= c1; k1 = RotateLeft(k1,31); k1 *= c2; h1 ^= k1;
+            h1 = RotateLeft(h1,27); h1 += h2; h1 = h1*5+0x52dce729;
+            k2 *= c2; k2 = RotateLeft(k2,33); k2 *= c1; h2 ^= k2;
+            h2 = RotateLeft(h2,31); h2 += h1; h2 = h2*5+0x38495ab5;
+        }
+
+        const uint8_t* tail = bytes+blocks*16;
+        uint64_t k1 = 0;
+        uint64_t k2 = 0;
+        for (std::size_t t=size&15; t>8; --t)
+        {
+            k2 ^= uint64_t(tail[t-1]) << ((t-9)*8);
+        }
+        for (std::size_t t=std::min<std::size_t>(size&15,8); t>0; --t)
+        {
+            k1 ^= uint64_t(tail[t-1]) << ((t-1)*8);
+        }
+        k2 *= c2; k2 = RotateLeft(k2,33); k2 *= c1; h2 ^= k2;
+        k1 *= c1; k1 = RotateLeft(k1,31); k1 *= c2; h1 ^= k1;
+
+        h1 ^= size; h2 ^= size;
+        h1 += h2; h2 += h1;
+        h1 = Mix(h1); h2 = Mix(h2);
+        h1 += h2; h2 += h1;
+
+        char text[33];
+        snprintf( text, sizeof(text), "%016llx%016llx", (unsigned long long)h1, (unsigned long long)h2 );
+        return text;
+    }
+
+    //! Append a string preceded by its size, so that the boundaries between strings matter.
+    void AppendField( std::string& data, const std::string& field )
+    {
+        uint64_t size = field.size();
+        data.append( (const char*)&size, sizeof(size) );
+        data += field;
+    }
+
+    //! Path to write a file before renaming it, unique for every thread of every process.
+    std::string GetTemporaryPath( const std::string& path )
+    {
+#ifdef _WIN32
+        int pid = _getpid();
+#else
+        int pid = (int)getpid();
+#endif
+        std::size_t thread = std::hash<std::thread::id>()( std::this_thread::get_id() );
+        return path+".tmp"+std::to_string(pid)+"-"+std::to_string(thread);
+    }
+
+    //! Write a file through a temporary one, so that readers never see it half written.
+    bool WriteFileAtomically( const std::string& path, const std::string& content, bool executable=false )
+    {
+        std::string temporaryPath = GetTemporaryPath( path );
+        FILE* file = fopen( temporaryPath.c_str(), "wb" );
+        if ( !file )
+        {
+            return false;
+        }
+
+        bool result = fwrite( content.data(), 1, content.size(), file )==content.size();
+        result = ( fclose( file )==0 ) && result;
+#ifndef _WIN32
+        if ( result && executable )
+        {
+            result = chmod( temporaryPath.c_str(), 0755 )==0;
+        }
+#endif
+        if ( result )
+        {
+            result = rename( temporaryPath.c_str(), path.c_str() )==0;
+        }
+        if ( !result )
+        {
+            remove( temporaryPath.c_str() );
+        }
+        return result;
+    }
+
+    enum class CloneMethod
+    {
+        Failed,
+
+        //! The target shares the blocks of the source until either is written
+        Reflink,
+
+        //! The target is the same file as the source
+        HardLink,
+
+        //! The data was copied
+        Copy
+    };
+
+    //! Copy a file through a temporary one, sharing the data of the source when possible: a reflink
+    //! if the file system supports them, then a hard link if allowed, and then a copy inside the
+    //! kernel. Hard linked files are made read only, so that they are replaced instead of written.
+    CloneMethod CloneFile( const std::string& source, const std::string& target, bool executable, bool allowLink )
+    {
+#ifdef _WIN32
+        std::string content;
+        (void)allowLink;
+        return FileRead( source, content ) && WriteFileAtomically( target, content, executable )
+                ? CloneMethod::Copy : CloneMethod::Failed;
+#else
+        int in = open( source.c_str(), O_RDONLY|O_CLOEXEC );
+        if ( in<0 )
+        {
+            return CloneMethod::Failed;
+        }
+
+        std::string temporaryPath = GetTemporaryPath( target );
+        int out = open( temporaryPath.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, executable ? 0755 : 0644 );
+        if ( out<0 )
+        {
+            close( in );
+            return CloneMethod::Failed;
+        }
+
+        CloneMethod method = CloneMethod::Failed;
+#ifdef FICLONE
+        if ( ioctl( out, FICLONE, in )==0 )
+        {
+            method = CloneMethod::Reflink;
+        }
+#endif
+
+        if ( method==CloneMethod::Failed && allowLink )
+        {
+            close( out );
+            out = -1;
+            remove( temporaryPath.c_str() );
+            if ( link( source.c_str(), temporaryPath.c_str() )==0 )
+            {
+                chmod( temporaryPath.c_str(), executable ? 0555 : 0444 );
+                method = CloneMethod::HardLink;
+            }
+            else
+            {
+                out = open( temporaryPath.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, executable ? 0755 : 0644 );
+            }
+        }
+
+        if ( method==CloneMethod::Failed && out>=0 )
+        {
+            bool copied = true;
+            bool inKernel = true;
+            while ( true )
+            {
+                ssize_t count = -1;
+#ifdef __linux__
+                if ( inKernel )
+                {
+                    count = copy_file_range( in, nullptr, out, nullptr, 1<<30, 0 );
+                    if ( count<0 && ( errno==ENOSYS || errno==EXDEV || errno==EINVAL || errno==EOPNOTSUPP ) )
+                    {
+                        // Not supported between these files: copy the rest through a buffer
+                        inKernel = false;
+                        continue;
+                    }
+                }
+                else
+#endif
+                {
+                    char buffer[64*1024];
+                    count = read( in, buffer, sizeof(buffer) );
+                    if ( count>0 && write( out, buffer, (std::size_t)count )!=count )
+                    {
+                        count = -1;
+                    }
+                }
+
+                if ( count<=0 )
+                {
+                    copied = count==0;
+                    break;
+                }
+            }
+            method = copied ? CloneMethod::Copy : CloneMethod::Failed;
+        }
+
+        close( in );
+        if ( out>=0 && close( out )!=0 )
+        {
+            method = CloneMethod::Failed;
+        }
+
+        if ( method!=CloneMethod::Failed && rename( temporaryPath.c_str(), target.c_str() )!=0 )
+        {
+            method = CloneMethod::Failed;
+        }
+        if ( method==CloneMethod::Failed )
+        {
+            remove( temporaryPath.c_str() );
+        }
+        return method;
+#endif
+    }
+
+    //! Create a folder, which may be created at the same time by other processes.
+    void MakeDirectory( const std::string& path )
+    {
+#ifdef _WIN32
+        _mkdir( path.c_str() );
+#else
+        mkdir( path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH );
+#endif
+    }
+
+    //! State of a file in the cache folder. It doesn't use the stat cache of the plan, since cache
+    //! files are written and removed behind its back by this and other processes.
+    FileInfo GetCacheFileInfo( const std::string& path )
+    {
+        FileInfo result;
+        struct stat fileStat;
+        if ( stat( path.c_str(), &fileStat )==0 )
+        {
+            result.m_exists = true;
+            result.m_time.m_time = fileStat.st_mtime;
+            result.m_size = (uint64_t)fileStat.st_size;
+        }
+        return result;
+    }
+
+    //! Time of the newest of some files, or 0 if none exists.
+    time_t GetNewestTime( const NodeList& nodes )
+    {
+        time_t result = 0;
+        for ( const auto& n: nodes )
+        {
+            FileInfo info = GetCacheFileInfo( n->m_absolutePath );
+            if ( info.m_exists && info.m_time.m_time>result )
+            {
+                result = info.m_time.m_time;
+            }
+        }
+        return result;
+    }
+
+    //! Mark a file as recently used.
+    void TouchFile( const std::string& path )
+    {
+        utime( path.c_str(), nullptr );
+    }
+
+    //! Suffix of the files whose time is the last use of the entry they are next to. Entries that
+    //! are hard linked into build folders share their time with the outputs of all those builds,
+    //! so it is never changed.
+    const char* UsedSuffix = ".used";
+
+    //! Mark an entry that may be hard linked as recently used.
+    void TouchEntryUse( const std::string& entry )
+    {
+        std::string used = entry+UsedSuffix;
+        if ( FILE* file = fopen( used.c_str(), "ab" ) )
+        {
+            fclose( file );
+            TouchFile( used );
+        }
+    }
+
+    struct CacheFile
+    {
+        std::string m_path;
+        time_t m_time;
+        uint64_t m_size;
+    };
+
+    //! Add the regular files in a folder to files.
+    void ListFiles( const std::string& folder, std::vector<CacheFile>& files )
+    {
+#ifdef _WIN32
+        WIN32_FIND_DATAA data;
+        HANDLE find = FindFirstFileA( (folder+"/*").c_str(), &data );
+        if (find==INVALID_HANDLE_VALUE)
+        {
+            return;
+        }
+        do
+        {
+            if ( !(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) )
+            {
+                CacheFile file;
+                file.m_path = folder+"/"+data.cFileName;
+                ULARGE_INTEGER time;
+                time.LowPart = data.ftLastWriteTime.dwLowDateTime;
+                time.HighPart = data.ftLastWriteTime.dwHighDateTime;
+                file.m_time = (time_t)(time.QuadPart/10000000ULL);
+                file.m_size = (uint64_t(data.nFileSizeHigh)<<32) | data.nFileSizeLow;
+                files.push_back( file );
+            }
+        }
+        while ( FindNextFileA( find, &data ) );
+        FindClose( find );
+#else
+        DIR* dir = opendir( folder.c_str() );
+        if (!dir)
+        {
+            return;
+        }
+        while ( dirent* entry = readdir( dir ) )
+        {
+            CacheFile file;
+            file.m_path = folder+"/"+entry->d_name;
+            struct stat fileStat;
+            if ( stat( file.m_path.c_str(), &fileStat )==0 && S_ISREG(fileStat.st_mode) )
+            {
+                file.m_time = fileStat.st_mtime;
+                file.m_size = (uint64_t)fileStat.st_size;
+                files.push_back( file );
+            }
+        }
+        closedir( dir );
+#endif
+    }
+}
+
+
+ObjectCache::ObjectCache( const std::string& path, uint64_t maxSize )
+    : m_path( path )
+    , m_maxSize( maxSize )
+{
+    FileCreateDirectories( m_path );
+}
+
+
+std::shared_ptr<ObjectCache> ObjectCache::create_from_environment()
+{
+    uint64_t maxSize = 5120;
+    if ( const char* size = getenv("CRAFT_CACHE_SIZE") )
+    {
+        maxSize = strtoull( size, nullptr, 10 );
+    }
+    if ( maxSize==0 )
+    {
+        return nullptr;
+    }
+
+    std::string path;
+    if ( const char* folder = getenv("CRAFT_CACHE_DIR") )
+    {
+        path = folder;
+    }
+    else if ( const char* cacheHome = getenv("XDG_CACHE_HOME") )
+    {
+        path = std::string(cacheHome)+"/craft";
+    }
+    else if ( const char* home = getenv("HOME") )
+    {
+        path = std::string(home)+"/.cache/craft";
+    }
+    else if ( const char* appData = getenv("LOCALAPPDATA") )
+    {
+        path = std::string(appData)+"/craft";
+    }
+
+    if ( path.empty() )
+    {
+        return nullptr;
+    }
+
+    std::shared_ptr<ObjectCache> cache = std::make_shared<ObjectCache>( path, maxSize*1024*1024 );
+    cache->set_remote( RemoteCache::create_from_environment() );
+    return cache;
+}
+
+
+std::string ObjectCache::get_file_hash( const std::string& path )
+{
+    FileInfo info = FileGetInfo( path );
+    if ( !info.m_exists )
+    {
+        return std::string();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_fileHashesMutex);
+        auto it = m_fileHashes.find( path );
+        if ( it!=m_fileHashes.end()
+             && it->second.m_info.m_size==info.m_size
+             && it->second.m_info.m_time.m_time==info.m_time.m_time )
+        {
+            return it->second.m_hash;
+        }
+    }
+
+    // Don't hold the lock while reading
+    std::string content;
+    if ( !FileRead( path, content ) )
+    {
+        return std::string();
+    }
+
+    FileHash fileHash;
+    fileHash.m_info = info;
+    fileHash.m_hash = HashData( content.data(), content.size() );
+
+    std::lock_guard<std::mutex> lock(m_fileHashesMutex);
+    m_fileHashes[path] = fileHash;
+    return fileHash.m_hash;
+}
+
+
+void ObjectCache::forget_file_hash( const std::string& path )
+{
+    std::lock_guard<std::mutex> lock(m_fileHashesMutex);
+    m_fileHashes.erase( path );
+}
+
+
+bool ObjectCache::materialise( const std::string& entry, const std::string& target, bool executable,
+                               const NodeList& inputs )
+{
+    TouchEntryUse( entry );
+
+    // A hard linked target has the time of the entry, and it would look outdated to the next
+    // builds if it was older than the inputs. Reflinks and copies are new files.
+    FileInfo info = GetCacheFileInfo( entry );
+    bool allowLink = info.m_time.m_time>=GetNewestTime( inputs );
+
+    uint64_t size = info.m_size;
+    CloneMethod method = CloneFile( entry, target, executable, allowLink );
+    if ( method==CloneMethod::Failed )
+    {
+        return false;
+    }
+
+    if ( method!=CloneMethod::Copy )
+    {
+        AXE_COUNTER_ADD( "craft_object_cache_bytes_not_copied", size );
+        m_savedSize += size;
+    }
+    forget_file_hash( target );
+    return true;
+}
+
+
+void ObjectCache::release_output( const std::string& target )
+{
+#ifndef _WIN32
+    struct stat targetStat;
+    if ( lstat( target.c_str(), &targetStat )==0 && targetStat.st_nlink>1 )
+    {
+        remove( target.c_str() );
+    }
+#endif
+}
+
+
+bool ObjectCache::unshare_output( const std::string& target )
+{
+#ifndef _WIN32
+    struct stat targetStat;
+    if ( lstat( target.c_str(), &targetStat )==0 && S_ISREG(targetStat.st_mode) && targetStat.st_nlink>1 )
+    {
+        bool executable = ( targetStat.st_mode & S_IXUSR )!=0;
+        return CloneFile( target, target, executable, false )!=CloneMethod::Failed;
+    }
+#endif
+    return true;
+}
+
+
+std::string ObjectCache::get_relative_text( const std::string& text ) const
+{
+    if ( m_workspace.empty() )
+    {
+        return text;
+    }
+
+    // Replace the workspace wherever it is a whole path, as in "-I/workspace/source" or
+    // "-ffile-prefix-map=/workspace=."
+    std::string result;
+    std::size_t begin = 0;
+    std::size_t found;
+    while ( (found=text.find( m_workspace, begin ))!=std::string::npos )
+    {
+        std::size_t end = found+m_workspace.size();
+        bool whole = end==text.size() || text[end]=='/' || text[end]=='\\' || text[end]=='=';
+        result += text.substr( begin, found-begin );
+        result += whole ? "." : m_workspace;
+        begin = end;
+    }
+    result += text.substr( begin );
+    return result;
+}
+
+
+std::string ObjectCache::get_absolute_path( const std::string& path ) const
+{
+    if ( m_workspace.size() && path.compare( 0, 2, "./" )==0 )
+    {
+        return m_workspace+path.substr( 1 );
+    }
+    return path;
+}
+
+
+bool ObjectCache::is_current( const Entry& entry )
+{
+    for ( const auto& d: entry.m_dependencies )
+    {
+        if ( get_file_hash( get_absolute_path( d.first ) )!=d.second )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+std::string ObjectCache::get_key( const std::string& compiler, const std::vector<std::string>& arguments,
+                                  const std::string& source )
+{
+    std::string sourceHash = get_file_hash( source );
+    if ( sourceHash.empty() )
+    {
+        return std::string();
+    }
+
+    // The compiler is identified by its size and time, like a new version would change them. The
+    // current path is part of the debug information.
+    FileInfo compilerInfo = FileGetInfo( compiler );
+
+    std::string data;
+    AppendField( data, CRAFT_OBJECT_CACHE_MANIFEST_HEADER );
+    AppendField( data, compiler );
+    AppendField( data, std::to_string(compilerInfo.m_size)+" "+std::to_string((int64_t)compilerInfo.m_time.m_time) );
+    AppendField( data, get_relative_text( FileGetCurrentPath() ) );
+    for ( const auto& a: arguments )
+    {
+        AppendField( data, get_relative_text( a ) );
+    }
+    AppendField( data, sourceHash );
+
+    return HashData( data.data(), data.size() );
+}
+
+
+std::string ObjectCache::get_entry_path( const std::string& key, const char* extension ) const
+{
+    // Spread the entries in 256 folders
+    return m_path+"/"+key.substr(0,2)+"/"+key+extension;
+}
+
+
+bool ObjectCache::parse_manifest( const std::string& content, std::vector<Entry>& entries )
+{
+    // A header line, and then every entry is "entry <object key>" followed by a "<hash> <path>" line
+    // for every dependency.
+    std::size_t begin = 0;
+    bool first = true;
+    while ( begin<content.size() )
+    {
+        std::size_t end = content.find( '\n', begin );
+        if ( end==std::string::npos )
+        {
+            break;
+        }
+        std::string line = content.substr( begin, end-begin );
+        begin = end+1;
+
+        if ( first )
+        {
+            if ( line!=CRAFT_OBJECT_CACHE_MANIFEST_HEADER )
+            {
+                return false;
+            }
+            first = false;
+        }
+        else if ( line.compare( 0, 6, "entry " )==0 )
+        {
+            entries.push_back( Entry() );
+            entries.back().m_objectKey = line.substr( 6 );
+        }
+        else if ( entries.size() && line.size()>33 && line[32]==' ' )
+        {
+            entries.back().m_dependencies.push_back( std::make_pair( line.substr(33), line.substr(0,32) ) );
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return !first;
+}
+
+
+std::string ObjectCache::format_manifest( const std::vector<Entry>& entries )
+{
+    std::string content = CRAFT_OBJECT_CACHE_MANIFEST_HEADER "\n";
+    for ( const auto& e: entries )
+    {
+        content += "entry "+e.m_objectKey+"\n";
+        for ( const auto& d: e.m_dependencies )
+        {
+            content += d.second+" "+d.first+"\n";
+        }
+    }
+    return content;
+}
+
+
+bool ObjectCache::load_manifest( const std::string& key, std::vector<Entry>& entries ) const
+{
+    std::string content;
+    return FileRead( get_entry_path( key, ".manifest" ), content ) && parse_manifest( content, entries );
+}
+
+
+uint64_t ObjectCache::save_manifest( const std::string& key, const std::vector<Entry>& entries )
+{
+    std::string content = format_manifest( entries );
+    return WriteFileAtomically( get_entry_path( key, ".manifest" ), content ) ? content.size() : 0;
+}
+
+
+bool ObjectCache::fetch( const std::string& key, const std::string& target, NodeList& dependencies )
+{
+    AXE_SCOPED_SECTION(cache_fetch);
+
+    std::vector<Entry> entries;
+    if ( load_manifest( key, entries ) )
+    {
+        for ( const auto& e: entries )
+        {
+            if ( !is_current( e ) )
+            {
+                continue;
+            }
+
+            NodeList entryDependencies;
+            for ( const auto& d: e.m_dependencies )
+            {
+                std::shared_ptr<Node> node = std::make_shared<Node>();
+                node->m_absolutePath = get_absolute_path( d.first );
+                entryDependencies.push_back( node );
+            }
+
+            std::string object = get_entry_path( e.m_objectKey, ".o" );
+            if ( materialise( object, target, false, entryDependencies ) )
+            {
+                TouchFile( get_entry_path( key, ".manifest" ) );
+                dependencies.insert( dependencies.end(), entryDependencies.begin(), entryDependencies.end() );
+
+                AXE_LOG( "cache", axe::Level::Verbose, "Object cache hit: [%s]", target.c_str() );
+                AXE_COUNTER_ADD( "craft_object_cache_hits", 1 );
+                ++m_hits;
+                return true;
+            }
+        }
+    }
+
+    if ( m_remote && fetch_remote( key, target, dependencies ) )
+    {
+        AXE_LOG( "cache", axe::Level::Verbose, "Remote object cache hit: [%s]", target.c_str() );
+        AXE_COUNTER_ADD( "craft_object_cache_hits", 1 );
+        ++m_hits;
+        return true;
+    }
+
+    AXE_COUNTER_ADD( "craft_object_cache_misses", 1 );
+    ++m_misses;
+    return false;
+}
+
+
+void ObjectCache::store( const std::string& key, const std::string& target, const NodeList& dependencies )
+{
+    AXE_SCOPED_SECTION(cache_store);
+
+    Entry entry;
+    std::string data = key;
+    for ( const auto& d: dependencies )
+    {
+        std::string hash = get_file_hash( d->m_absolutePath );
+        if ( hash.empty() )
+        {
+            // The object can't be reused if we can't tell when its dependencies change.
+            return;
+        }
+        entry.m_dependencies.push_back( std::make_pair( get_relative_text( d->m_absolutePath ), hash ) );
+        data += hash;
+    }
+    entry.m_objectKey = HashData( data.data(), data.size() );
+
+    MakeDirectory( m_path+"/"+key.substr(0,2) );
+    MakeDirectory( m_path+"/"+entry.m_objectKey.substr(0,2) );
+
+    std::string object = get_entry_path( entry.m_objectKey, ".o" );
+    if ( !GetCacheFileInfo( object ).m_exists )
+    {
+        if ( CloneFile( target, object, false, false )==CloneMethod::Failed )
+        {
+            AXE_LOG( "cache", axe::Level::Warning, "Failed to store [%s] in the object cache.", target.c_str() );
+            return;
+        }
+        m_storedSize += GetCacheFileInfo( object ).m_size;
+    }
+
+    // The newest entry goes first, since it is the most likely to be used again.
+    std::vector<Entry> entries;
+    bool newManifest = !load_manifest( key, entries );
+    entries.erase( std::remove_if( entries.begin(), entries.end(), [&entry]( const Entry& e )
+    {
+        return e.m_objectKey==entry.m_objectKey;
+    } ), entries.end() );
+    entries.insert( entries.begin(), entry );
+    if ( entries.size()>CRAFT_OBJECT_CACHE_MANIFEST_ENTRIES )
+    {
+        entries.resize( CRAFT_OBJECT_CACHE_MANIFEST_ENTRIES );
+    }
+    uint64_t manifestSize = save_manifest( key, entries );
+    if ( newManifest )
+    {
+        m_storedSize += manifestSize;
+    }
+
+    // The object goes first, so that nobody finds the manifest without it.
+    std::string content;
+    if ( m_remote && FileRead( object, content ) )
+    {
+        m_remote->put( "cas/"+entry.m_objectKey, content );
+        m_remote->put( "ac/"+key, format_manifest( entries ) );
+    }
+}
+
+
+bool ObjectCache::fetch_remote( const std::string& key, const std::string& target, NodeList& dependencies )
+{
+    AXE_SCOPED_SECTION(cache_fetch_remote);
+
+    std::string content;
+    std::vector<Entry> entries;
+    if ( !m_remote->get( "ac/"+key, content ) || !parse_manifest( content, entries ) )
+    {
+        return false;
+    }
+
+    for ( const auto& e: entries )
+    {
+        if ( !is_current( e ) || !m_remote->get( "cas/"+e.m_objectKey, content ) )
+        {
+            continue;
+        }
+
+        // Keep it in the local folder for the next builds
+        MakeDirectory( m_path+"/"+key.substr(0,2) );
+        MakeDirectory( m_path+"/"+e.m_objectKey.substr(0,2) );
+        std::string object = get_entry_path( e.m_objectKey, ".o" );
+        bool existed = GetCacheFileInfo( object ).m_exists;
+        bool kept = WriteFileAtomically( object, content );
+        if ( kept && !existed )
+        {
+            m_storedSize += content.size();
+        }
+
+        std::vector<Entry> localEntries;
+        bool newManifest = !load_manifest( key, localEntries );
+        localEntries.erase( std::remove_if( localEntries.begin(), localEntries.end(), [&e]( const Entry& l )
+        {
+            return l.m_objectKey==e.m_objectKey;
+        } ), localEntries.end() );
+        localEntries.insert( localEntries.begin(), e );
+        if ( localEntries.size()>CRAFT_OBJECT_CACHE_MANIFEST_ENTRIES )
+        {
+            localEntries.resize( CRAFT_OBJECT_CACHE_MANIFEST_ENTRIES );
+        }
+        uint64_t manifestSize = save_manifest( key, localEntries );
+        if ( newManifest )
+        {
+            m_storedSize += manifestSize;
+        }
+
+        NodeList entryDependencies;
+        for ( const auto& d: e.m_dependencies )
+        {
+            std::shared_ptr<Node> node = std::make_shared<Node>();
+            node->m_absolutePath = get_absolute_path( d.first );
+            entryDependencies.push_back( node );
+        }
+
+        if ( kept ? !materialise( object, target, false, entryDependencies ) : !WriteFileAtomically( target, content ) )
+        {
+            return false;
+        }
+        forget_file_hash( target );
+
+        dependencies.insert( dependencies.end(), entryDependencies.begin(), entryDependencies.end() );
+        return true;
+    }
+
+    return false;
+}
+
+
+void ObjectCache::prefetch( const std::string& key )
+{
+    if ( m_remote && key.size() && !GetCacheFileInfo( get_entry_path( key, ".manifest" ) ).m_exists )
+    {
+        m_remote->prefetch( "ac/"+key );
+    }
+}
+
+
+std::string ObjectCache::get_action_key( const std::string& tool, const std::vector<std::string>& arguments,
+                                         const NodeList& inputs )
+{
+    FileInfo toolInfo = FileGetInfo( tool );
+
+    std::string data;
+    AppendField( data, CRAFT_OBJECT_CACHE_ACTION_HEADER );
+    AppendField( data, tool );
+    AppendField( data, std::to_string(toolInfo.m_size)+" "+std::to_string((int64_t)toolInfo.m_time.m_time) );
+    AppendField( data, get_relative_text( FileGetCurrentPath() ) );
+    for ( const auto& a: arguments )
+    {
+        AppendField( data, get_relative_text( a ) );
+    }
+    for ( const auto& i: inputs )
+    {
+        std::string hash = get_file_hash( i->m_absolutePath );
+        if ( hash.empty() )
+        {
+            return std::string();
+        }
+        AppendField( data, get_relative_text( i->m_absolutePath ) );
+        AppendField( data, hash );
+    }
+
+    return HashData( data.data(), data.size() );
+}
+
+
+bool ObjectCache::fetch_output( const std::string& key, const std::string& target, bool executable,
+                                const NodeList& inputs )
+{
+    AXE_SCOPED_SECTION(cache_fetch_output);
+
+    std::string output = get_entry_path( key, ".out" );
+    bool found = GetCacheFileInfo( output ).m_exists && materialise( output, target, executable, inputs );
+    if ( !found && m_remote )
+    {
+        std::string content;
+        if ( m_remote->get( "ac/"+key, content ) )
+        {
+            MakeDirectory( m_path+"/"+key.substr(0,2) );
+            if ( WriteFileAtomically( output, content ) )
+            {
+                m_storedSize += content.size();
+                found = materialise( output, target, executable, inputs );
+            }
+            else
+            {
+                found = WriteFileAtomically( target, content, executable );
+            }
+        }
+    }
+
+    if ( found )
+    {
+        forget_file_hash( target );
+        AXE_LOG( "cache", axe::Level::Verbose, "Action cache hit: [%s]", target.c_str() );
+        AXE_COUNTER_ADD( "craft_object_cache_hits", 1 );
+        ++m_hits;
+    }
+    else
+    {
+        AXE_COUNTER_ADD( "craft_object_cache_misses", 1 );
+        ++m_misses;
+    }
+    return found;
+}
+
+
+void ObjectCache::store_output( const std::string& key, const std::string& target )
+{
+    AXE_SCOPED_SECTION(cache_store_output);
+
+    std::string content;
+    if ( !FileRead( target, content ) )
+    {
+        AXE_LOG( "cache", axe::Level::Warning, "Failed to store [%s] in the object cache.", target.c_str() );
+        return;
+    }
+
+    MakeDirectory( m_path+"/"+key.substr(0,2) );
+    std::string output = get_entry_path( key, ".out" );
+    if ( !GetCacheFileInfo( output ).m_exists && WriteFileAtomically( output, content ) )
+    {
+        m_storedSize += content.size();
+    }
+
+    if ( m_remote )
+    {
+        m_remote->put( "ac/"+key, content );
+    }
+}
+
+
+ObjectCache::Statistics ObjectCache::load_statistics() const
+{
+    Statistics result;
+
+    std::string content;
+    if ( FileRead( m_path+"/stats", content ) )
+    {
+        // The saved size was added later
+        unsigned long long hits = 0, misses = 0, size = 0, saved = 0;
+        if ( sscanf( content.c_str(), "hits %llu\nmisses %llu\nsize %llu\nsaved %llu", &hits, &misses, &size, &saved )>=3 )
+        {
+            result.m_hits = hits;
+            result.m_misses = misses;
+            result.m_size = size;
+            result.m_savedSize = saved;
+        }
+    }
+
+    return result;
+}
+
+
+void ObjectCache::save_statistics()
+{
+    uint64_t hits = m_hits.exchange( 0 );
+    uint64_t misses = m_misses.exchange( 0 );
+    uint64_t storedSize = m_storedSize.exchange( 0 );
+    uint64_t savedSize = m_savedSize.exchange( 0 );
+    if ( !hits && !misses && !storedSize )
+    {
+        return;
+    }
+
+#ifndef _WIN32
+    // Other builds may be updating the statistics at the same time
+    int lockFd = open( (m_path+"/stats.lock").c_str(), O_RDWR|O_CREAT|O_CLOEXEC, 0644 );
+    if (lockFd>=0)
+    {
+        flock( lockFd, LOCK_EX );
+    }
+#endif
+
+    Statistics statistics = load_statistics();
+    statistics.m_hits += hits;
+    statistics.m_misses += misses;
+    statistics.m_size += storedSize;
+    statistics.m_savedSize += savedSize;
+
+    if ( statistics.m_size>m_maxSize )
+    {
+        statistics.m_size = trim();
+    }
+
+    char text[160];
+    snprintf( text, sizeof(text), "hits %llu\nmisses %llu\nsize %llu\nsaved %llu\n",
+              (unsigned long long)statistics.m_hits, (unsigned long long)statistics.m_misses,
+              (unsigned long long)statistics.m_size, (unsigned long long)statistics.m_savedSize );
+    WriteFileAtomically( m_path+"/stats", text );
+
+#ifndef _WIN32
+    if (lockFd>=0)
+    {
+        close( lockFd );
+    }
+#endif
+}
+
+
+uint64_t ObjectCache::trim()
+{
+    AXE_SCOPED_SECTION(cache_trim);
+
+    std::vector<CacheFile> files;
+    for ( int f=0; f<256; ++f )
+    {
+        char folder[3];
+        snprintf( folder, sizeof(folder), "%02x", f );
+        ListFiles( m_path+"/"+folder, files );
+    }
+
+    // The use of an entry is the time of its use file, if it is newer. Use files are removed with
+    // their entries, or when their entry is gone.
+    std::map<std::string,time_t> useTimes;
+    std::size_t suffixLength = strlen( UsedSuffix );
+    files.erase( std::remove_if( files.begin(), files.end(), [&]( const CacheFile& f )
+    {
+        if ( f.m_path.size()>suffixLength
+             && f.m_path.compare( f.m_path.size()-suffixLength, suffixLength, UsedSuffix )==0 )
+        {
+            useTimes[f.m_path.substr( 0, f.m_path.size()-suffixLength )] = f.m_time;
+            return true;
+        }
+        return false;
+    } ), files.end() );
+
+    uint64_t size = 0;
+    for ( auto& f: files )
+    {
+        size += f.m_size;
+
+        auto use = useTimes.find( f.m_path );
+        if ( use!=useTimes.end() )
+        {
+            f.m_time = std::max( f.m_time, use->second );
+            useTimes.erase( use );
+        }
+    }
+
+    for ( const auto& u: useTimes )
+    {
+        remove( ( u.first+UsedSuffix ).c_str() );
+    }
+
+    // Leave some room, so that the next builds don't have to trim again
+    uint64_t targetSize = m_maxSize/10*9;
+    if ( size>targetSize )
+    {
+        std::sort( files.begin(), files.end(), []( const CacheFile& a, const CacheFile& b )
+        {
+            return a.m_time<b.m_time;
+        } );
+
+        std::size_t removedCount = 0;
+        for ( const auto& f: files )
+        {
+            if ( size<=targetSize )
+            {
+                break;
+            }
+            if ( remove( f.m_path.c_str() )==0 )
+            {
+                remove( ( f.m_path+UsedSuffix ).c_str() );
+                size -= f.m_size;
+                ++removedCount;
+            }
+        }
+
+        AXE_LOG( "cache", axe::Level::Info, "Removed %d old files from the object cache.", removedCount );
+    }
+
+    return size;
+}
+
+
+// Cache used by the compilers, if any.
+static std::atomic<ObjectCache*> s_objectCache( nullptr );
+
+
+ObjectCache* SetObjectCache( ObjectCache* cache )
+{
+    return s_objectCache.exchange( cache );
+}
+
+
+ObjectCache* GetObjectCache()
+{
+    return s_objectCache;
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include "platform.h"
+#include "remote_cache.h"
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+
+//!
+//! \brief Content addressed store of compiled objects, shared by all the builds of the user.
+//! Compilations are looked up in two steps, so that the dependencies don't need to be known before
+//! compiling:
+//!
+//!     manifest key    hash of the compiler, the current path, the arguments and the source
+//!     manifest        the dependencies found in previous compilations with that key, with the
+//!                     hashes of their contents and the key of the object built from them
+//!     object key      hash of the manifest key and the contents of all the dependencies
+//!
+//! The dependencies are all the files the compiler reports to have read, system headers included.
+//! Changes that make the compiler read different files without changing the arguments, like
+//! environment variables such as CPATH or files of the toolchain other than the compiler driver,
+//! are not noticed.
+//!
+//! Hits are restored with reflinks when the file system supports them, or else with hard links to
+//! the read only entries, so large outputs are not copied.
+//!
+//! Other actions, like linking, are cached by the hash of the tool, its arguments and the contents
+//! of all its inputs, which are known in advance.
+//!
+//! If a RemoteCache is set, it is looked up after missing in the local folder, and the new entries
+//! are written to both.
+//!
+//! The least recently used entries are removed when the cache grows beyond its size limit. The
+//! use of the entries that can be hard linked is recorded in the time of a ".used" file next to
+//! them, not in their own, which the links share. The hits and misses of every build are
+//! added to a statistics file in the cache folder.
+//!
+class CRAFTCOREI_API ObjectCache
+{
+public:
+
+    //! \param path folder of the cache, created if it doesn't exist
+    //! \param maxSize size limit in bytes
+    ObjectCache( const std::string& path, uint64_t maxSize );
+
+    //! Create the cache configured in the environment: CRAFT_CACHE_DIR is the folder, by default
+    //! ~/.cache/craft, and CRAFT_CACHE_SIZE the size limit in megabytes, by default 5120. The
+    //! remote cache is the one of RemoteCache::create_from_environment.
+    //! \return null if the size is 0, which disables the cache.
+    static std::shared_ptr<ObjectCache> create_from_environment();
+
+    //! Key of a compilation, or an empty string if the source can't be read.
+    std::string get_key( const std::string& compiler, const std::vector<std::string>& arguments,
+                         const std::string& source );
+
+    //! Copy the object of a previous compilation with the same key and dependencies to target.
+    //! \param dependencies receives the dependencies of the object.
+    //! \return false if there is no such object.
+    bool fetch( const std::string& key, const std::string& target, NodeList& dependencies );
+
+    //! Add the result of a compilation.
+    void store( const std::string& key, const std::string& target, const NodeList& dependencies );
+
+    //! Start looking up a compilation in the remote cache, if it is not in the local folder, so that
+    //! it is ready when fetch is called.
+    void prefetch( const std::string& key );
+
+    //! Key of an action with a single output, or an empty string if any input can't be read.
+    std::string get_action_key( const std::string& tool, const std::vector<std::string>& arguments,
+                                const NodeList& inputs );
+
+    //! Copy the output of a previous action with the same key to target.
+    //! \param executable mark the target as executable.
+    //! \param inputs the inputs of the action, which the target must not be older than.
+    //! \return false if there is no such output.
+    bool fetch_output( const std::string& key, const std::string& target, bool executable,
+                       const NodeList& inputs );
+
+    //! Add the output of an action.
+    void store_output( const std::string& key, const std::string& target );
+
+    //! Remove a target hard linked to a cache entry before a tool writes it, since some tools
+    //! write their outputs in place.
+    static void release_output( const std::string& target );
+
+    //! Replace a target hard linked to a cache entry by a copy, so that its time can be changed
+    //! without changing the entry and the other targets linked to it.
+    //! \return false if the copy failed.
+    static bool unshare_output( const std::string& target );
+
+    //! Add the statistics of this build to the ones in the cache folder, and remove the least
+    //! recently used entries if the cache is too big.
+    void save_statistics();
+
+    struct Statistics
+    {
+        uint64_t m_hits = 0;
+        uint64_t m_misses = 0;
+
+        //! Size of the objects and manifests
+        uint64_t m_size = 0;
+
+        //! Size of the hits restored with reflinks or hard links instead of copies
+        uint64_t m_savedSize = 0;
+    };
+
+    //! Statistics of all the builds using the cache folder.
+    Statistics load_statistics() const;
+
+    //! Write the paths inside the workspace as relative ones in the keys and manifests, so that
+    //! checkouts in different folders share entries. Used in deterministic mode.
+    void set_workspace( const std::string& path ) { m_workspace = path; }
+
+    //! Set the remote cache used after the local one. It can be null.
+    void set_remote( const std::shared_ptr<RemoteCache>& remote ) { m_remote = remote; }
+    RemoteCache* get_remote() const { return m_remote.get(); }
+
+    const std::string& get_path() const { return m_path; }
+    uint64_t get_max_size() const { return m_maxSize; }
+    uint64_t get_hits() const { return m_hits; }
+    uint64_t get_misses() const { return m_misses; }
+    uint64_t get_saved_size() const { return m_savedSize; }
+
+private:
+
+    struct Entry
+    {
+        std::string m_objectKey;
+
+        //! Absolute path and content hash of every dependency
+        std::vector<std::pair<std::string,std::string>> m_dependencies;
+    };
+
+    //! Hash of the contents of a file, or an empty string if it can't be read. Files are only read
+    //! once while their size and time don't change.
+    std::string get_file_hash( const std::string& path );
+
+    //! Forget the hash of a file written by the cache.
+    void forget_file_hash( const std::string& path );
+
+    //! Make target a copy of a cache entry, sharing its data if possible. It is only hard linked
+    //! if the entry is not older than any of the inputs.
+    bool materialise( const std::string& entry, const std::string& target, bool executable,
+                      const NodeList& inputs );
+
+    //! Text with the workspace replaced by "." wherever it is a whole path, if there is one.
+    std::string get_relative_text( const std::string& text ) const;
+
+    //! Absolute path of a dependency in a manifest.
+    std::string get_absolute_path( const std::string& path ) const;
+
+    //! \return true if the contents of all the dependencies of an entry are still the same.
+    bool is_current( const Entry& entry );
+
+    std::string get_entry_path( const std::string& key, const char* extension ) const;
+
+    static bool parse_manifest( const std::string& content, std::vector<Entry>& entries );
+    static std::string format_manifest( const std::vector<Entry>& entries );
+
+    bool load_manifest( const std::string& key, std::vector<Entry>& entries ) const;
+
+    //! \return the size of the manifest, or 0 if it couldn't be written.
+    uint64_t save_manifest( const std::string& key, const std::vector<Entry>& entries );
+
+    //! Look up a compilation in the remote cache, and add it to the local folder if found.
+    bool fetch_remote( const std::string& key, const std::string& target, NodeList& dependencies );
+
+    //! Remove the least recently used files until the cache is below the size limit.
+    //! \return the size of the cache after removing them.
+    uint64_t trim();
+
+    std::string m_path;
+    uint64_t m_maxSize;
+
+    std::shared_ptr<RemoteCache> m_remote;
+
+    //! Workspace in deterministic mode, or empty
+    std::string m_workspace;
+
+    struct FileHash
+    {
+        FileInfo m_info;
+        std::string m_hash;
+    };
+    std::mutex m_fileHashesMutex;
+    std::unordered_map<std::string,FileHash> m_fileHashes;
+
+    //! Statistics of this build
+    std::atomic<uint64_t> m_hits{0};
+    std::atomic<uint64_t> m_misses{0};
+    std::atomic<uint64_t> m_storedSize{0};
+    std::atomic<uint64_t> m_savedSize{0};
+};
+
+
+//! Set the object cache used by the compilers. It can be null to disable caching.
+//! \return the previously active cache.
+extern CRAFTCOREI_API ObjectCache* SetObjectCache( ObjectCache* cache );
+
+//! Object cache used by the compilers, if any.
+extern CRAFTCOREI_API ObjectCache* GetObjectCache();
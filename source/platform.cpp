@@ -2,19 +2,26 @@
 #include "craft_private.h"
 
 #include "axe.h"
+#include "process_supervisor.h"
 
 #include <string>
 #include <vector>
 
 #include <sys/stat.h>
 #include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <future>
 
 #ifdef _WIN32
 #include <direct.h>
+#include <sys/utime.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
 #include <dlfcn.h>
 #include <sys/wait.h>
+#include <utime.h>
 #endif
 
 
@@ -200,10 +207,95 @@ bool PlatformOSX64::is_this() const
 }
 
 
+// Cache used by the file functions, if any.
+static std::atomic<FileStatCache*> s_statCache( nullptr );
+
+
+static FileInfo FileStat( const std::string& path )
+{
+    FileInfo result;
+
+    AXE_COUNTER_ADD( "craft_stat_calls", 1 );
+
+    struct stat file_stat;
+    if (stat (path.c_str(), &file_stat) == 0)
+    {
+        result.m_exists = true;
+        //result.m_time.m_time = file_stat.st_mtimespec; OSX?
+        result.m_time.m_time = file_stat.st_mtime;
+        result.m_size = (uint64_t)file_stat.st_size;
+    }
+
+    return result;
+}
+
+
+FileInfo FileStatCache::get( const std::string& path )
+{
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find( path );
+        if ( it!=m_entries.end() )
+        {
+            ++m_hits;
+            return it->second;
+        }
+        generation = m_generation;
+    }
+
+    // Don't hold the lock during the system call
+    FileInfo result = FileStat( path );
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_misses;
+
+    // If something was invalidated meanwhile, the result may be older than the invalidation.
+    if ( generation==m_generation )
+    {
+        m_entries[path] = result;
+    }
+    return result;
+}
+
+
+void FileStatCache::invalidate( const std::string& path )
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.erase( path );
+    ++m_generation;
+}
+
+
+uint64_t FileStatCache::get_hits() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_hits;
+}
+
+
+uint64_t FileStatCache::get_misses() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_misses;
+}
+
+
+FileStatCache* FileSetStatCache( FileStatCache* cache )
+{
+    return s_statCache.exchange( cache );
+}
+
+
 bool FileExists( const std::string& path )
 {
-    struct stat buffer;
-    return (stat (path.c_str(), &buffer) == 0);
+    FileStatCache* cache = s_statCache;
+    if (cache)
+    {
+        return cache->get( path ).m_exists;
+    }
+
+    return FileStat( path ).m_exists;
 }
 
 
@@ -274,6 +366,12 @@ void CreateDirectory( const char* directory )
     int status = mkdir(directory, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
 #endif
     assert( status==0 );
+
+    FileStatCache* cache = s_statCache;
+    if (cache)
+    {
+        cache->invalidate( directory );
+    }
 }
 
 bool FileCreateDirectories( const std::string& path )
@@ -310,22 +408,133 @@ bool FileCreateDirectories( const std::string& path )
 }
 
 
-FileTime FileGetModificationTime( const std::string& path )
+bool FileRead( const std::string& path, std::string& content )
 {
-    FileTime result;
+    FILE* file = fopen( path.c_str(), "rb" );
+    if (!file)
+    {
+        return false;
+    }
 
-    struct stat file_stat;
-    if (stat (path.c_str(), &file_stat) == 0)
+    content.clear();
+
+    char buffer[64*1024];
+    size_t count;
+    while ( (count=fread( buffer, 1, sizeof(buffer), file ))>0 )
     {
-        //result.m_time = file_stat.st_mtimespec; OSX?
-        result.m_time = file_stat.st_mtime;
+        content.append( buffer, count );
     }
 
+    bool result = !ferror(file);
+    fclose(file);
+
     return result;
 }
 
 
-//! Warning: don't use this in concurrent scenarios!
+uint64_t FileGetContentHash( const std::string& path )
+{
+    std::string content;
+    if ( !FileRead( path, content ) )
+    {
+        return 0;
+    }
+
+    // MurmurHash64A
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = 0x8445d61a4e774912ULL ^ ( content.size()*m );
+
+    std::size_t blocks = content.size()/8;
+    for ( std::size_t b=0; b<blocks; ++b )
+    {
+        uint64_t k;
+        memcpy( &k, content.data()+b*8, 8 );
+        k *= m;
+        k ^= k>>r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    const unsigned char* tail = (const unsigned char*)content.data()+blocks*8;
+    switch ( content.size()&7 )
+    {
+    case 7: h ^= uint64_t(tail[6])<<48; // fall through
+    case 6: h ^= uint64_t(tail[5])<<40; // fall through
+    case 5: h ^= uint64_t(tail[4])<<32; // fall through
+    case 4: h ^= uint64_t(tail[3])<<24; // fall through
+    case 3: h ^= uint64_t(tail[2])<<16; // fall through
+    case 2: h ^= uint64_t(tail[1])<<8;  // fall through
+    case 1: h ^= uint64_t(tail[0]);
+            h *= m;
+    }
+
+    h ^= h>>r;
+    h *= m;
+    h ^= h>>r;
+
+    // 0 means unknown
+    return h ? h : 1;
+}
+
+
+bool FileTouch( const std::string& path )
+{
+#ifdef _WIN32
+    return _utime( path.c_str(), nullptr )==0;
+#else
+    return utime( path.c_str(), nullptr )==0;
+#endif
+}
+
+
+FileTime FileGetModificationTime( const std::string& path )
+{
+    FileStatCache* cache = s_statCache;
+    if (cache)
+    {
+        return cache->get( path ).m_time;
+    }
+
+    return FileStat( path ).m_time;
+}
+
+
+FileInfo FileGetInfo( const std::string& path )
+{
+    FileStatCache* cache = s_statCache;
+    if (cache)
+    {
+        return cache->get( path );
+    }
+
+    return FileStat( path );
+}
+
+
+#if !defined(_WIN32) && !defined(__linux__)
+//! Create a pipe that is not inherited by the executed programs. pipe2 is not available
+//! everywhere, so a program started by another thread in between may still get a copy.
+static bool OpenPipe( int fds[2] )
+{
+    if ( pipe(fds)!=0 )
+    {
+        return false;
+    }
+
+    if ( fcntl( fds[0], F_SETFD, FD_CLOEXEC )!=0 || fcntl( fds[1], F_SETFD, FD_CLOEXEC )!=0 )
+    {
+        close( fds[0] );
+        close( fds[1] );
+        return false;
+    }
+
+    return true;
+}
+#endif
+
+
 int Run( const std::string& workingPath,
          const std::string& command,
          const std::vector<std::string>& arguments,
@@ -582,6 +791,31 @@ int Run( const std::string& workingPath,
 
     result = exitCode;
 
+#elif defined(__linux__)
+
+    // The supervisor thread watches the process, this thread only waits for the result.
+    std::promise<int> status;
+    std::future<int> finished = status.get_future();
+    bool started = ProcessSupervisor::get().start( workingPath, command, arguments, out, err, maxMilliseconds,
+                                                   [&status,killedFlag]( int exitStatus, bool killed )
+    {
+        if ( killed && killedFlag )
+        {
+            *killedFlag = 1;
+        }
+        status.set_value( exitStatus );
+    } );
+
+    if (!started)
+    {
+        // Failed to execute
+        result = -1;
+    }
+    else
+    {
+        result = finished.get();
+    }
+
 #else
 
 #define CHILD_OUT_PIPE      0
@@ -589,14 +823,39 @@ int Run( const std::string& workingPath,
 
     int pipes[2][2];
 
-    // pipes for parent to write and read
-    pipe(pipes[CHILD_OUT_PIPE]);
-    pipe(pipes[CHILD_ERR_PIPE]);
+    // pipes for parent to write and read. They are not inherited by the programs executed by other
+    // threads, otherwise we wouldn't see the end of the output until those finish as well.
+    if ( !OpenPipe( pipes[CHILD_OUT_PIPE] ) )
+    {
+        AXE_LOG( "run", axe::Level::Error, "Failed to create a pipe for [%s]: %s", command.c_str(), strerror(errno) );
+        return -1;
+    }
+    if ( !OpenPipe( pipes[CHILD_ERR_PIPE] ) )
+    {
+        AXE_LOG( "run", axe::Level::Error, "Failed to create a pipe for [%s]: %s", command.c_str(), strerror(errno) );
+        close( pipes[CHILD_OUT_PIPE][0] );
+        close( pipes[CHILD_OUT_PIPE][1] );
+        return -1;
+    }
+
+    // Build a raw list of char* for the command and arguments before forking: other threads may be
+    // holding the allocator lock, so the child can't allocate memory.
+    // const_casting is apparently safe here.
+    std::vector<char*> argv( arguments.size()+2, nullptr );
+    argv[0] = const_cast<char*>(command.c_str());
+    for (size_t a=0;a<arguments.size();++a)
+    {
+        argv[a+1] = const_cast<char*>(arguments[a].c_str());
+    }
 
     pid_t childPid = fork();
     if (childPid<0)
     {
         // Failed to execute
+        close(pipes[CHILD_OUT_PIPE][0]);
+        close(pipes[CHILD_ERR_PIPE][0]);
+        close(pipes[CHILD_OUT_PIPE][1]);
+        close(pipes[CHILD_ERR_PIPE][1]);
         result = -1;
     }
     else if (childPid==0)
@@ -618,26 +877,15 @@ int Run( const std::string& workingPath,
             if (chdir( workingPath.c_str()) !=0 )
             {
                 // Failed to enter the working path
-                exit(-1);
+                _exit(-1);
             }
         }
 
-        // Build a raw list of char* for the command and arguments
-        // const_casting is apparently safe here.
-        char** argv = new char* [arguments.size()+2];
-        argv[0] = const_cast<char*>(command.c_str());
-        argv[arguments.size()+1] = nullptr;
-        for (size_t a=0;a<arguments.size();++a)
-        {
-            argv[a+1] = const_cast<char*>(arguments[a].c_str());
-        }
-
         // Call
-        execv(argv[0], argv);
+        execv(argv[0], &argv[0]);
 
         // If we are here, we failed to exec.
-        delete[] argv;
-        exit(-1);
+        _exit(-1);
     }
     else
     {
@@ -796,13 +1044,15 @@ int Run( const std::string& workingPath,
 
 
 
-void LoadAndRun( const char* lib, const char* methodName,
-                 const char* workspace, const char** configurations, const char** targets )
+int LoadAndRun( const char* lib, const char* methodName,
+                const char* workspace, const char** configurations, const char** targets, int jobs )
 {
-    typedef void (*CraftMethod)( const char* workspace, const char** configurations, const char** targets, axe::Kernel* log_kernel );
+    typedef int (*CraftMethod)( const char* workspace, const char** configurations, const char** targets, int jobs, axe::Kernel* log_kernel );
 
 #ifdef _WIN32
 
+    int result = 1;
+
     // Get a handle to the DLL module.
     HINSTANCE hinstLib = LoadLibrary(TEXT(lib));
     assert(hinstLib);
@@ -816,19 +1066,26 @@ void LoadAndRun( const char* lib, const char* methodName,
         // If the function address is valid, call the function.
         if (craftMethod)
         {
-            craftMethod(workspace, configurations, targets, axe::s_kernel);
+            result = craftMethod(workspace, configurations, targets, jobs, axe::s_kernel);
         }
 
         // Free the DLL module.
-        BOOL result = FreeLibrary(hinstLib);
-        assert(result);
+        BOOL freed = FreeLibrary(hinstLib);
+        assert(freed);
     }
 
+    return result;
+
 #else
 
     // Load the dynamic library
     void *libHandle = dlopen( lib, RTLD_LAZY | RTLD_LOCAL );
     assert( libHandle );
+    if (!libHandle)
+    {
+        AXE_LOG( "craft", axe::Level::Error, "Failed to load [%s]: %s", lib, dlerror() );
+        return 1;
+    }
 
     dlerror();
     void *method = dlsym( libHandle, methodName );
@@ -839,12 +1096,18 @@ void LoadAndRun( const char* lib, const char* methodName,
     }
 
     assert( method );
+    if (!method)
+    {
+        return 1;
+    }
 
     // Run it
     CraftMethod craftMethod = (CraftMethod)method;
-    craftMethod(workspace, configurations, targets, axe::s_kernel);
+    int result = craftMethod(workspace, configurations, targets, jobs, axe::s_kernel);
 
     // todo: free library?
 
+    return result;
+
 #endif
 }
@@ -6,6 +6,8 @@
 #include <vector>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 
 //! Dynamic link library import and export
 //! define CRAFTCOREI_BUILD when building the dynamic library
@@ -186,6 +188,17 @@ extern CRAFTCOREI_API bool FileIsAbsolute( const std::string& path );
 //! \return true if any folder was actually created
 extern CRAFTCOREI_API bool FileCreateDirectories( const std::string& path );
 
+//! Read the whole file into content.
+//! \return false if the file couldn't be read
+extern CRAFTCOREI_API bool FileRead( const std::string& path, std::string& content );
+
+//! Hash of the contents of a file, to tell whether it changed when it was written again.
+//! \return 0 if the file couldn't be read
+extern CRAFTCOREI_API uint64_t FileGetContentHash( const std::string& path );
+
+//! Set the modification time of a file to the current time.
+extern CRAFTCOREI_API bool FileTouch( const std::string& path );
+
 //!
 //! \brief The FileTime struct
 //!
@@ -261,6 +274,56 @@ struct FileTime
 FileTime CRAFTCOREI_API FileGetModificationTime( const std::string& path );
 
 
+//! State of a path in the file system
+struct FileInfo
+{
+    bool m_exists = false;
+    FileTime m_time;
+    uint64_t m_size = 0;
+};
+
+//! Return the existence, modification time and size of a path.
+extern CRAFTCOREI_API FileInfo FileGetInfo( const std::string& path );
+
+
+//!
+//! \brief Cache of the file system state of paths.
+//! While a cache is active, FileExists, FileGetModificationTime, FileGetInfo and
+//! FileCreateDirectories query it
+//! instead of calling stat every time. Paths that are written must be invalidated.
+//!
+class CRAFTCOREI_API FileStatCache
+{
+public:
+
+    //! Get the state of the path, from the cache if possible.
+    FileInfo get( const std::string& path );
+
+    //! Forget the state of a path, so that it is queried again next time.
+    void invalidate( const std::string& path );
+
+    uint64_t get_hits() const;
+    uint64_t get_misses() const;
+
+private:
+
+    mutable std::mutex m_mutex;
+    std::unordered_map<std::string,FileInfo> m_entries;
+
+    //! Incremented by every invalidation, so that a state queried while a path was being written
+    //! isn't stored.
+    uint64_t m_generation = 0;
+
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+};
+
+
+//! Set the cache used by the file functions. It can be null to disable caching.
+//! \return the previously active cache.
+extern CRAFTCOREI_API FileStatCache* FileSetStatCache( FileStatCache* cache );
+
+
 //!
 //! \brief Run
 //! \param workingPath
@@ -281,8 +344,11 @@ extern CRAFTCOREI_API int Run( const std::string& workingPath,
 
 
 //!
+//! \brief Load the craftfile dynamic library and call its entry method.
+//! \param jobs Maximum number of concurrent tasks, or 0 to use the hardware concurrency.
+//! \return the result of the entry method, which is 0 if the build succeeded.
 //!
-//!
-extern CRAFTCOREI_API void LoadAndRun( const char* lib, const char* methodName,
-                                       const char* workspace, const char** configurations, const char** targets );
+extern CRAFTCOREI_API int LoadAndRun( const char* lib, const char* methodName,
+                                       const char* workspace, const char** configurations, const char** targets,
+                                       int jobs );
 
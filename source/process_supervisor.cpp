@@ -0,0 +1,540 @@
+#include "process_supervisor.h"
+
+#include "axe.h"
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <csignal>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+
+// posix_spawn_file_actions_addchdir_np is available since glibc 2.29. __GLIBC_PREREQ can only be
+// expanded where it is defined.
+#if defined(__GLIBC__)
+#if __GLIBC_PREREQ(2,29)
+#define CRAFT_HAVE_SPAWN_CHDIR
+#endif
+#endif
+
+
+namespace
+{
+    //! Get a descriptor that becomes readable when the process exits, or -1 if the kernel doesn't
+    //! support it.
+    int OpenProcessDescriptor( pid_t pid )
+    {
+#ifdef SYS_pidfd_open
+        return (int)syscall( SYS_pidfd_open, pid, 0 );
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+    }
+
+    //! Start a process with its output redirected to the given descriptors.
+    //! posix_spawn doesn't copy the page tables of the parent like fork does, which is expensive
+    //! for a big craft process launching many short compilations.
+    //! \return the process id, or -1 if it couldn't be started.
+    pid_t SpawnProcess( const std::string& workingPath, char** argv, int outFd, int errFd )
+    {
+        bool canSpawn = true;
+#ifndef CRAFT_HAVE_SPAWN_CHDIR
+        // Changing the working folder while spawning is not supported
+        canSpawn = workingPath.empty();
+#endif
+
+        if (canSpawn)
+        {
+            posix_spawn_file_actions_t actions;
+            posix_spawn_file_actions_init( &actions );
+            posix_spawn_file_actions_adddup2( &actions, outFd, STDOUT_FILENO );
+            posix_spawn_file_actions_adddup2( &actions, errFd, STDERR_FILENO );
+#ifdef CRAFT_HAVE_SPAWN_CHDIR
+            if (workingPath.size())
+            {
+                posix_spawn_file_actions_addchdir_np( &actions, workingPath.c_str() );
+            }
+#endif
+
+            pid_t pid = -1;
+            int error = posix_spawn( &pid, argv[0], &actions, nullptr, argv, environ );
+            posix_spawn_file_actions_destroy( &actions );
+
+            if (error)
+            {
+                AXE_LOG( "run", axe::Level::Error, "Failed to start [%s]: %s", argv[0], strerror(error) );
+                return -1;
+            }
+            return pid;
+        }
+
+        pid_t pid = fork();
+        if (pid==0)
+        {
+            // We are the child
+            dup2(outFd, STDOUT_FILENO);
+            dup2(errFd, STDERR_FILENO);
+
+            if (chdir( workingPath.c_str()) !=0 )
+            {
+                // Failed to enter the working path
+                _exit(-1);
+            }
+
+            execv(argv[0], argv);
+
+            // If we are here, we failed to exec.
+            _exit(-1);
+        }
+
+        return pid;
+    }
+
+    //! Arm a timer, or disarm it if milliseconds is 0. It repeats if interval is positive.
+    void SetTimer( int fd, int milliseconds, int interval=0 )
+    {
+        itimerspec spec;
+        memset( &spec, 0, sizeof(spec) );
+        spec.it_value.tv_sec = milliseconds/1000;
+        spec.it_value.tv_nsec = (milliseconds%1000)*1000000L;
+        spec.it_interval.tv_sec = interval/1000;
+        spec.it_interval.tv_nsec = (interval%1000)*1000000L;
+        timerfd_settime( fd, 0, &spec, nullptr );
+    }
+
+    //! Period of the reaping of children without a process descriptor
+    const int ReapTickMilliseconds = 10;
+}
+
+
+ProcessSupervisor& ProcessSupervisor::get()
+{
+    // Never destroyed: processes may still be running while the program exits.
+    static ProcessSupervisor* s_supervisor = new ProcessSupervisor();
+    return *s_supervisor;
+}
+
+
+ProcessSupervisor::ProcessSupervisor()
+{
+    m_epoll = epoll_create1( EPOLL_CLOEXEC );
+    if (m_epoll<0)
+    {
+        AXE_LOG( "run", axe::Level::Fatal, "Failed to create the process supervisor: %s", strerror(errno) );
+        return;
+    }
+
+    m_reapTick.m_fd = timerfd_create( CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK );
+    m_reapTick.m_type = Watch::Type::ReapTick;
+    if (m_reapTick.m_fd>=0)
+    {
+        epoll_event event;
+        memset( &event, 0, sizeof(event) );
+        event.events = EPOLLIN;
+        event.data.ptr = &m_reapTick;
+        epoll_ctl( m_epoll, EPOLL_CTL_ADD, m_reapTick.m_fd, &event );
+    }
+
+    m_thread = std::thread( [this](){ loop(); } );
+    m_thread.detach();
+}
+
+
+bool ProcessSupervisor::start( const std::string& workingPath,
+                               const std::string& command,
+                               const std::vector<std::string>& arguments,
+                               OutputCallback out,
+                               OutputCallback err,
+                               int maxMilliseconds,
+                               ExitCallback exit )
+{
+    if (m_epoll<0)
+    {
+        return false;
+    }
+
+    // The parent ends of the pipes are not inherited by the programs executed by other threads,
+    // otherwise we wouldn't see the end of the output until those finish as well.
+    int outPipe[2];
+    int errPipe[2];
+    if ( pipe2( outPipe, O_CLOEXEC )!=0 )
+    {
+        return false;
+    }
+    if ( pipe2( errPipe, O_CLOEXEC )!=0 )
+    {
+        close( outPipe[0] );
+        close( outPipe[1] );
+        return false;
+    }
+
+    // Build a raw list of char* for the command and arguments before starting the child: other
+    // threads may be holding the allocator lock, so the child can't allocate memory.
+    // const_casting is apparently safe here.
+    std::vector<char*> argv( arguments.size()+2, nullptr );
+    argv[0] = const_cast<char*>(command.c_str());
+    for (size_t a=0;a<arguments.size();++a)
+    {
+        argv[a+1] = const_cast<char*>(arguments[a].c_str());
+    }
+
+    auto spawnStart = std::chrono::steady_clock::now();
+    pid_t childPid = SpawnProcess( workingPath, &argv[0], outPipe[1], errPipe[1] );
+    AXE_HISTOGRAM_RECORD( "craft_process_spawn_latency_microseconds",
+                          std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-spawnStart).count() );
+
+    // close fds not required by parent
+    close( outPipe[1] );
+    close( errPipe[1] );
+
+    if (childPid<0)
+    {
+        close( outPipe[0] );
+        close( errPipe[0] );
+        return false;
+    }
+
+    AXE_COUNTER_ADD( "craft_process_spawns", 1 );
+    AXE_GAUGE_ADD( "craft_processes_running", 1 );
+
+    auto child = std::make_shared<Child>();
+    child->m_pid = childPid;
+    child->m_outCallback = out;
+    child->m_errCallback = err;
+    child->m_exitCallback = exit;
+
+    child->m_out.m_fd = outPipe[0];
+    child->m_out.m_type = Watch::Type::Out;
+    child->m_err.m_fd = errPipe[0];
+    child->m_err.m_type = Watch::Type::Err;
+    child->m_process.m_fd = OpenProcessDescriptor( childPid );
+    child->m_process.m_type = Watch::Type::Process;
+
+    if (maxMilliseconds>0)
+    {
+        child->m_timer.m_fd = timerfd_create( CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK );
+        child->m_timer.m_type = Watch::Type::Timer;
+        if (child->m_timer.m_fd>=0)
+        {
+            SetTimer( child->m_timer.m_fd, maxMilliseconds );
+        }
+    }
+
+    fcntl( child->m_out.m_fd, F_SETFL, fcntl( child->m_out.m_fd, F_GETFL ) | O_NONBLOCK );
+    fcntl( child->m_err.m_fd, F_SETFL, fcntl( child->m_err.m_fd, F_GETFL ) | O_NONBLOCK );
+
+    // Events may arrive as soon as the first watch is added, and the supervisor thread closes the
+    // watches as it handles them. It handles them holding the mutex, so it only sees the child
+    // when all its watches are registered.
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_children[child.get()] = child;
+
+    for ( Watch* w: { &child->m_out, &child->m_err, &child->m_process, &child->m_timer } )
+    {
+        w->m_child = child.get();
+        if (w->m_fd<0)
+        {
+            continue;
+        }
+
+        epoll_event event;
+        memset( &event, 0, sizeof(event) );
+        event.events = EPOLLIN;
+        event.data.ptr = w;
+        epoll_ctl( m_epoll, EPOLL_CTL_ADD, w->m_fd, &event );
+    }
+
+    return true;
+}
+
+
+std::size_t ProcessSupervisor::get_running_count() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_children.size();
+}
+
+
+void ProcessSupervisor::loop()
+{
+    const int maxEvents = 64;
+    epoll_event events[maxEvents];
+
+    std::vector<Child*> finished;
+
+    AXE_SET_THREAD_NAME( "process-supervisor" );
+
+    while (true)
+    {
+        int count = epoll_wait( m_epoll, events, maxEvents, -1 );
+        if (count<0)
+        {
+            if (errno!=EINTR)
+            {
+                AXE_LOG( "run", axe::Level::Error, "Process supervisor failed: %s", strerror(errno) );
+            }
+            continue;
+        }
+
+        // Children are being registered with the mutex held.
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (int e=0; e<count; ++e)
+        {
+            Watch& watch = *(Watch*)events[e].data.ptr;
+            if (watch.m_type==Watch::Type::ReapTick)
+            {
+                on_reap_tick( finished );
+                continue;
+            }
+
+            Child& child = *watch.m_child;
+
+            // A previous event of this batch may have finished the child already.
+            if (watch.m_fd<0)
+            {
+                continue;
+            }
+
+            switch (watch.m_type)
+            {
+            case Watch::Type::Out:
+            case Watch::Type::Err:
+                read_output( watch );
+                break;
+
+            case Watch::Type::Process:
+                reap( child );
+                break;
+
+            case Watch::Type::Timer:
+                on_timer( child );
+                break;
+
+            case Watch::Type::ReapTick:
+                break;
+            }
+
+            if ( is_finished( child ) )
+            {
+                finish( child );
+                finished.push_back( &child );
+            }
+        }
+
+        // Release the children only when no more events of this batch can refer to them.
+        for ( auto c: finished )
+        {
+            m_children.erase( c );
+        }
+        finished.clear();
+    }
+}
+
+
+void ProcessSupervisor::read_output( Watch& watch )
+{
+    Child& child = *watch.m_child;
+    const OutputCallback& callback = watch.m_type==Watch::Type::Out ? child.m_outCallback : child.m_errCallback;
+
+    char buffer[4096];
+    while (true)
+    {
+        ssize_t count = read( watch.m_fd, buffer, sizeof(buffer)-1 );
+        if (count>0)
+        {
+            buffer[count] = 0;
+            if (callback)
+            {
+                callback( buffer );
+            }
+        }
+        else if (count==0)
+        {
+            close_watch( watch );
+            break;
+        }
+        else if (errno==EAGAIN || errno==EWOULDBLOCK)
+        {
+            break;
+        }
+        else if (errno!=EINTR)
+        {
+            AXE_LOG( "run", axe::Level::Error, "Failed to read the output of a process: %s", strerror(errno) );
+            close_watch( watch );
+            break;
+        }
+    }
+
+    // Without a process descriptor, the end of the output is the best sign of the exit.
+    if ( child.m_out.m_fd<0 && child.m_err.m_fd<0 )
+    {
+        watch_exit( child );
+    }
+}
+
+
+void ProcessSupervisor::reap( Child& child )
+{
+    int childStatus = 0;
+    pid_t result;
+    do
+    {
+        result = waitpid( child.m_pid, &childStatus, WNOHANG );
+    }
+    while ( result<0 && errno==EINTR );
+
+    if (result==0)
+    {
+        // Still running
+        return;
+    }
+
+    child.m_exited = true;
+    if ( result>0 && WIFEXITED(childStatus) )
+    {
+        child.m_status = WEXITSTATUS(childStatus);
+    }
+    else
+    {
+        child.m_status = -1;
+    }
+
+    close_watch( child.m_process );
+    close_watch( child.m_timer );
+}
+
+
+void ProcessSupervisor::watch_exit( Child& child )
+{
+    if ( child.m_process.m_fd>=0 || child.m_exited )
+    {
+        return;
+    }
+
+    reap( child );
+    if ( child.m_exited
+         || std::find( m_unreaped.begin(), m_unreaped.end(), &child )!=m_unreaped.end() )
+    {
+        return;
+    }
+
+    if ( m_unreaped.empty() )
+    {
+        SetTimer( m_reapTick.m_fd, ReapTickMilliseconds, ReapTickMilliseconds );
+    }
+    m_unreaped.push_back( &child );
+}
+
+
+void ProcessSupervisor::on_reap_tick( std::vector<Child*>& finished )
+{
+    uint64_t expirations = 0;
+    if ( read( m_reapTick.m_fd, &expirations, sizeof(expirations) )<0 )
+    {
+        return;
+    }
+
+    for ( std::size_t c=0; c<m_unreaped.size(); )
+    {
+        Child& child = *m_unreaped[c];
+        reap( child );
+        if (!child.m_exited)
+        {
+            ++c;
+            continue;
+        }
+
+        if ( is_finished( child ) )
+        {
+            finish( child );
+            finished.push_back( &child );
+        }
+        m_unreaped[c] = m_unreaped.back();
+        m_unreaped.pop_back();
+    }
+
+    if ( m_unreaped.empty() )
+    {
+        SetTimer( m_reapTick.m_fd, 0 );
+    }
+}
+
+
+void ProcessSupervisor::on_timer( Child& child )
+{
+    uint64_t expirations = 0;
+    if ( read( child.m_timer.m_fd, &expirations, sizeof(expirations) )<0 )
+    {
+        return;
+    }
+
+    if (child.m_killStage==0)
+    {
+        kill( child.m_pid, SIGTERM );
+        child.m_killStage = 1;
+
+        // Two seconds to die gracefully
+        SetTimer( child.m_timer.m_fd, 2000 );
+    }
+    else
+    {
+        kill( child.m_pid, SIGKILL );
+        child.m_killStage = 2;
+        close_watch( child.m_timer );
+    }
+
+    // Its output may never be closed if other processes it started are still running.
+    watch_exit( child );
+}
+
+
+void ProcessSupervisor::close_watch( Watch& watch )
+{
+    if (watch.m_fd>=0)
+    {
+        epoll_ctl( m_epoll, EPOLL_CTL_DEL, watch.m_fd, nullptr );
+        close( watch.m_fd );
+        watch.m_fd = -1;
+    }
+}
+
+
+bool ProcessSupervisor::is_finished( const Child& child ) const
+{
+    if (!child.m_exited)
+    {
+        return false;
+    }
+
+    // Other processes started by a killed one could keep the output open forever.
+    return child.m_killStage>0 || ( child.m_out.m_fd<0 && child.m_err.m_fd<0 );
+}
+
+
+void ProcessSupervisor::finish( Child& child )
+{
+    close_watch( child.m_out );
+    close_watch( child.m_err );
+    close_watch( child.m_process );
+    close_watch( child.m_timer );
+
+    AXE_GAUGE_ADD( "craft_processes_running", -1 );
+
+    if (child.m_exitCallback)
+    {
+        child.m_exitCallback( child.m_status, child.m_killStage>0 );
+    }
+}
+
+#endif
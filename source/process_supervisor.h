@@ -0,0 +1,123 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <sys/types.h>
+
+
+#ifdef __linux__
+
+//!
+//! \brief Runs child processes and watches all of them from a single thread.
+//! The thread waits with epoll on the output pipes, a pidfd and a timerfd of every child, so that
+//! output is delivered as soon as it is available and exits and timeouts are noticed without
+//! polling. Without pidfd support, exited children are reaped on a periodic tick instead, so
+//! that waiting for one never stalls the others. It can be used from any number of threads at
+//! the same time.
+//!
+class ProcessSupervisor
+{
+public:
+
+    typedef std::function<void(const char*)> OutputCallback;
+
+    //! Called once the process has exited and all its output has been delivered.
+    //! \param status exit code of the process, or -1 if it didn't exit normally.
+    //! \param killed true if it was terminated because it took too long.
+    typedef std::function<void(int status, bool killed)> ExitCallback;
+
+    //! Return the supervisor shared by the whole program, starting it the first time.
+    static ProcessSupervisor& get();
+
+    //! Start a process. All callbacks are called from the supervisor thread.
+    //! \param maxMilliseconds the process is terminated if it runs longer than this, if positive.
+    //! \return false if the process couldn't be started, in which case no callback is called.
+    bool start( const std::string& workingPath,
+                const std::string& command,
+                const std::vector<std::string>& arguments,
+                OutputCallback out,
+                OutputCallback err,
+                int maxMilliseconds,
+                ExitCallback exit );
+
+    //! Number of processes started and not finished yet.
+    std::size_t get_running_count() const;
+
+private:
+
+    ProcessSupervisor();
+
+    struct Child;
+
+    //! What an epoll event refers to
+    struct Watch
+    {
+        Child* m_child = nullptr;
+        int m_fd = -1;
+        enum class Type { Out, Err, Process, Timer, ReapTick } m_type = Type::Out;
+    };
+
+    struct Child
+    {
+        pid_t m_pid = 0;
+        Watch m_out;
+        Watch m_err;
+        Watch m_process;
+        Watch m_timer;
+
+        OutputCallback m_outCallback;
+        OutputCallback m_errCallback;
+        ExitCallback m_exitCallback;
+
+        bool m_exited = false;
+        int m_status = -1;
+
+        //! 0 running, 1 terminated, 2 killed
+        int m_killStage = 0;
+    };
+
+    void loop();
+
+    //! Read what is available in an output pipe and close it at the end of file.
+    void read_output( Watch& watch );
+
+    //! Reap the process if it has exited and remember its status.
+    void reap( Child& child );
+
+    //! Reap the process on the next ticks until it exits, if there is no process descriptor.
+    void watch_exit( Child& child );
+
+    //! Reap the children waiting for it, and return the ones that have finished.
+    void on_reap_tick( std::vector<Child*>& finished );
+
+    void on_timer( Child& child );
+
+    //! Stop watching a descriptor and close it.
+    void close_watch( Watch& watch );
+
+    bool is_finished( const Child& child ) const;
+
+    void finish( Child& child );
+
+    int m_epoll = -1;
+
+    //! Periodic timer active while m_unreaped is not empty
+    Watch m_reapTick;
+
+    //! Children without a process descriptor that must be reaped. Only used by the thread.
+    std::vector<Child*> m_unreaped;
+
+    //! Held by the thread while it handles events, and while a child is registered.
+    mutable std::mutex m_mutex;
+    std::unordered_map<Child*,std::shared_ptr<Child>> m_children;
+
+    std::thread m_thread;
+};
+
+#endif
@@ -0,0 +1,594 @@
+#include "remote_cache.h"
+
+#include "axe.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <algorithm>
+
+#ifndef _WIN32
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <netdb.h>
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+#endif
+
+
+//! Maximum number of requests sent together through a connection
+#define CRAFT_REMOTE_CACHE_BATCH    16
+
+
+namespace
+{
+    int64_t GetMilliseconds()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+    }
+
+    //! Value of a header in a block of response headers, or an empty string. Names are not case
+    //! sensitive.
+    std::string GetHeader( const std::string& headers, const char* name )
+    {
+        std::size_t nameSize = strlen(name);
+        std::size_t begin = headers.find( "\r\n" );
+        while ( begin!=std::string::npos && begin+2<headers.size() )
+        {
+            begin += 2;
+            std::size_t end = headers.find( "\r\n", begin );
+            if ( end==std::string::npos ) end = headers.size();
+
+            if ( end-begin>nameSize && headers[begin+nameSize]==':'
+                 && strncasecmp( headers.c_str()+begin, name, nameSize )==0 )
+            {
+                std::size_t value = headers.find_first_not_of( " \t", begin+nameSize+1 );
+                return value<end ? headers.substr( value, end-value ) : std::string();
+            }
+            begin = end;
+        }
+        return std::string();
+    }
+}
+
+
+RemoteCache::RemoteCache( const std::string& url, int timeoutMilliseconds )
+    : m_timeout( timeoutMilliseconds )
+{
+    // http://host[:port][/prefix]
+    const std::string scheme = "http://";
+    if ( url.compare( 0, scheme.size(), scheme )!=0 )
+    {
+        AXE_LOG( "cache", axe::Level::Warning, "Only http remote caches are supported [%s].", url.c_str() );
+        m_available = false;
+        return;
+    }
+
+    std::string address = url.substr( scheme.size() );
+    std::size_t slash = address.find( '/' );
+    if ( slash!=std::string::npos )
+    {
+        m_prefix = address.substr( slash );
+        address.resize( slash );
+    }
+    while ( m_prefix.size() && m_prefix.back()=='/' )
+    {
+        m_prefix.pop_back();
+    }
+
+    std::size_t colon = address.rfind( ':' );
+    m_host = address.substr( 0, colon );
+    m_port = colon==std::string::npos ? "80" : address.substr( colon+1 );
+
+    m_threads.emplace_back( [this](){ fetch_loop(); } );
+    m_threads.emplace_back( [this](){ fetch_loop(); } );
+    m_threads.emplace_back( [this](){ upload_loop(); } );
+}
+
+
+RemoteCache::~RemoteCache()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_condition.notify_all();
+
+    for ( auto& t: m_threads )
+    {
+        t.join();
+    }
+
+#ifndef _WIN32
+    for ( auto& c: m_connections )
+    {
+        close( c.m_fd );
+    }
+#endif
+}
+
+
+std::shared_ptr<RemoteCache> RemoteCache::create_from_environment()
+{
+    const char* url = getenv("CRAFT_REMOTE_CACHE");
+    if ( !url || !url[0] )
+    {
+        return nullptr;
+    }
+
+    int timeout = 2000;
+    if ( const char* milliseconds = getenv("CRAFT_REMOTE_CACHE_TIMEOUT") )
+    {
+        timeout = std::max( atoi( milliseconds ), 1 );
+    }
+
+    return std::make_shared<RemoteCache>( url, timeout );
+}
+
+
+void RemoteCache::prefetch( const std::string& path )
+{
+    if ( !m_available )
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if ( m_entries.find( path )==m_entries.end() )
+    {
+        m_entries[path] = Entry();
+        m_fetchQueue.push_back( path );
+        m_condition.notify_all();
+    }
+}
+
+
+bool RemoteCache::get( const std::string& path, std::string& content )
+{
+    if ( !m_available )
+    {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto it = m_entries.find( path );
+    if ( it!=m_entries.end() )
+    {
+        if ( it->second.m_state==State::Queued )
+        {
+            // Don't wait behind the rest of the queue
+            m_fetchQueue.erase( std::find( m_fetchQueue.begin(), m_fetchQueue.end(), path ) );
+            m_entries.erase( it );
+        }
+        else
+        {
+            bool sent = m_condition.wait_for( lock, std::chrono::milliseconds(m_timeout), [&]()
+            {
+                return it->second.m_state!=State::Sending || !m_available;
+            } );
+
+            if ( !sent || it->second.m_state==State::Sending )
+            {
+                lock.unlock();
+                disable( "a prefetched entry took too long" );
+                return false;
+            }
+
+            bool found = it->second.m_state==State::Found;
+            content.swap( it->second.m_content );
+            m_entries.erase( it );
+            ++( found ? m_hits : m_misses );
+            return found;
+        }
+    }
+    lock.unlock();
+
+    std::vector<Request> requests( 1 );
+    requests[0].m_method = "GET";
+    requests[0].m_path = path;
+    if ( !send( requests ) )
+    {
+        return false;
+    }
+
+    bool found = requests[0].m_status==200;
+    if ( found )
+    {
+        content.swap( requests[0].m_content );
+        m_readSize += content.size();
+    }
+    ++( found ? m_hits : m_misses );
+    return found;
+}
+
+
+void RemoteCache::put( const std::string& path, const std::string& content )
+{
+    if ( !m_available )
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_uploadQueue.push_back( std::make_pair( path, content ) );
+    m_condition.notify_all();
+}
+
+
+void RemoteCache::flush()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while ( true )
+    {
+        std::size_t pending = m_uploadQueue.size()+m_uploading;
+        bool done = m_condition.wait_for( lock, std::chrono::milliseconds(m_timeout), [&]()
+        {
+            return ( m_uploadQueue.empty() && m_uploading==0 ) || !m_available;
+        } );
+
+        // Keep waiting only while the uploads make progress
+        if ( done )
+        {
+            break;
+        }
+        if ( m_uploadQueue.size()+m_uploading>=pending )
+        {
+            lock.unlock();
+            disable( "the uploads took too long" );
+            break;
+        }
+    }
+}
+
+
+void RemoteCache::disable( const char* reason )
+{
+    if ( m_available.exchange( false ) )
+    {
+        AXE_LOG( "cache", axe::Level::Warning, "The remote cache is not used for the rest of the build: %s.", reason );
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_uploadQueue.clear();
+    m_condition.notify_all();
+}
+
+
+void RemoteCache::fetch_loop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while ( true )
+    {
+        m_condition.wait( lock, [&](){ return m_stop || !m_fetchQueue.empty(); } );
+        if ( m_stop )
+        {
+            break;
+        }
+
+        std::vector<Request> requests;
+        while ( m_fetchQueue.size() && requests.size()<CRAFT_REMOTE_CACHE_BATCH )
+        {
+            requests.push_back( Request() );
+            requests.back().m_method = "GET";
+            requests.back().m_path = m_fetchQueue.front();
+            m_entries[m_fetchQueue.front()].m_state = State::Sending;
+            m_fetchQueue.pop_front();
+        }
+
+        lock.unlock();
+        bool sent = m_available && send( requests );
+        lock.lock();
+
+        for ( auto& r: requests )
+        {
+            auto it = m_entries.find( r.m_path );
+            if ( it==m_entries.end() )
+            {
+                continue;
+            }
+
+            if ( sent && r.m_status==200 )
+            {
+                it->second.m_state = State::Found;
+                it->second.m_content.swap( r.m_content );
+                m_readSize += it->second.m_content.size();
+            }
+            else
+            {
+                it->second.m_state = State::Missing;
+            }
+        }
+        m_condition.notify_all();
+    }
+}
+
+
+void RemoteCache::upload_loop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while ( true )
+    {
+        m_condition.wait( lock, [&](){ return m_stop || !m_uploadQueue.empty(); } );
+        if ( m_stop )
+        {
+            break;
+        }
+
+        std::vector<Request> requests;
+        while ( m_uploadQueue.size() && requests.size()<CRAFT_REMOTE_CACHE_BATCH )
+        {
+            requests.push_back( Request() );
+            requests.back().m_method = "PUT";
+            requests.back().m_path.swap( m_uploadQueue.front().first );
+            requests.back().m_body.swap( m_uploadQueue.front().second );
+            m_uploadQueue.pop_front();
+        }
+        m_uploading += (int)requests.size();
+
+        lock.unlock();
+        if ( m_available && send( requests ) )
+        {
+            for ( const auto& r: requests )
+            {
+                m_writtenSize += r.m_body.size();
+            }
+        }
+        lock.lock();
+
+        m_uploading -= (int)requests.size();
+        m_condition.notify_all();
+    }
+}
+
+
+bool RemoteCache::send( std::vector<Request>& requests )
+{
+    std::string data;
+    for ( const auto& r: requests )
+    {
+        data += r.m_method+" "+m_prefix+"/"+r.m_path+" HTTP/1.1\r\n"
+                "Host: "+m_host+"\r\n"
+                "Content-Length: "+std::to_string(r.m_body.size())+"\r\n\r\n";
+        data += r.m_body;
+    }
+
+    // An idle connection may have been closed by the server, so it is tried again with a new one.
+    for ( int attempt=0; attempt<2; ++attempt )
+    {
+        Connection connection;
+        {
+            std::lock_guard<std::mutex> lock(m_connectionsMutex);
+            if ( attempt==0 && m_connections.size() )
+            {
+                connection = m_connections.back();
+                m_connections.pop_back();
+            }
+        }
+
+        bool reused = connection.m_fd>=0;
+        if ( !reused && !connect( connection ) )
+        {
+            disable( "it can't be reached" );
+            return false;
+        }
+
+        bool result = write_all( connection, data, GetMilliseconds()+m_timeout );
+        std::size_t responses = 0;
+        while ( result && responses<requests.size() )
+        {
+            Request& r = requests[responses];
+            result = read_response( connection, r, GetMilliseconds()+m_timeout );
+            if ( !result )
+            {
+                break;
+            }
+            ++responses;
+
+            if ( r.m_status!=200 && r.m_status!=201 && r.m_status!=204 && r.m_status!=404 )
+            {
+                AXE_LOG( "cache", axe::Level::Warning, "The remote cache answered %d to %s [%s].", r.m_status, r.m_method.c_str(), r.m_path.c_str() );
+                disable( "it answered with an error" );
+                result = false;
+            }
+        }
+
+        // Anything left in the buffer means the connection can't be used again
+        if ( result && connection.m_buffer.empty() )
+        {
+            std::lock_guard<std::mutex> lock(m_connectionsMutex);
+            m_connections.push_back( connection );
+            return true;
+        }
+
+#ifndef _WIN32
+        close( connection.m_fd );
+#endif
+
+        if ( result )
+        {
+            return true;
+        }
+        if ( !reused || responses>0 || !m_available )
+        {
+            disable( "a request failed or took too long" );
+            return false;
+        }
+    }
+
+    return false;
+}
+
+
+bool RemoteCache::connect( Connection& connection )
+{
+#ifdef _WIN32
+    (void)connection;
+    return false;
+#else
+    addrinfo hints;
+    memset( &hints, 0, sizeof(hints) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if ( getaddrinfo( m_host.c_str(), m_port.c_str(), &hints, &addresses )!=0 )
+    {
+        return false;
+    }
+
+    for ( addrinfo* a=addresses; a && connection.m_fd<0; a=a->ai_next )
+    {
+        int fd = socket( a->ai_family, a->ai_socktype|SOCK_CLOEXEC|SOCK_NONBLOCK, a->ai_protocol );
+        if ( fd<0 )
+        {
+            continue;
+        }
+
+        bool connected = ::connect( fd, a->ai_addr, a->ai_addrlen )==0;
+        if ( !connected && errno==EINPROGRESS )
+        {
+            pollfd p;
+            p.fd = fd;
+            p.events = POLLOUT;
+            p.revents = 0;
+            int error = 0;
+            socklen_t errorSize = sizeof(error);
+            connected = poll( &p, 1, m_timeout )==1
+                    && getsockopt( fd, SOL_SOCKET, SO_ERROR, &error, &errorSize )==0
+                    && error==0;
+        }
+
+        if ( connected )
+        {
+            // Requests are small, and each one is waited for
+            int noDelay = 1;
+            setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay) );
+            connection.m_fd = fd;
+        }
+        else
+        {
+            close( fd );
+        }
+    }
+
+    freeaddrinfo( addresses );
+    return connection.m_fd>=0;
+#endif
+}
+
+
+bool RemoteCache::write_all( Connection& connection, const std::string& data, int64_t deadline )
+{
+#ifdef _WIN32
+    (void)connection; (void)data; (void)deadline;
+    return false;
+#else
+    std::size_t written = 0;
+    while ( written<data.size() )
+    {
+        ssize_t count = ::send( connection.m_fd, data.data()+written, data.size()-written, MSG_NOSIGNAL );
+        if ( count>0 )
+        {
+            written += (std::size_t)count;
+            continue;
+        }
+        if ( count<0 && errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR )
+        {
+            return false;
+        }
+
+        int64_t remaining = deadline-GetMilliseconds();
+        pollfd p;
+        p.fd = connection.m_fd;
+        p.events = POLLOUT;
+        p.revents = 0;
+        if ( remaining<=0 || poll( &p, 1, (int)remaining )!=1 )
+        {
+            return false;
+        }
+    }
+    return true;
+#endif
+}
+
+
+bool RemoteCache::read_more( Connection& connection, int64_t deadline )
+{
+#ifdef _WIN32
+    (void)connection; (void)deadline;
+    return false;
+#else
+    while ( true )
+    {
+        char buffer[64*1024];
+        ssize_t count = recv( connection.m_fd, buffer, sizeof(buffer), 0 );
+        if ( count>0 )
+        {
+            connection.m_buffer.append( buffer, (std::size_t)count );
+            return true;
+        }
+        if ( count==0 || ( errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR ) )
+        {
+            return false;
+        }
+
+        int64_t remaining = deadline-GetMilliseconds();
+        pollfd p;
+        p.fd = connection.m_fd;
+        p.events = POLLIN;
+        p.revents = 0;
+        if ( remaining<=0 || poll( &p, 1, (int)remaining )!=1 )
+        {
+            return false;
+        }
+    }
+#endif
+}
+
+
+bool RemoteCache::read_response( Connection& connection, Request& request, int64_t deadline )
+{
+    std::size_t headersEnd;
+    while ( (headersEnd=connection.m_buffer.find( "\r\n\r\n" ))==std::string::npos )
+    {
+        if ( !read_more( connection, deadline ) )
+        {
+            return false;
+        }
+    }
+
+    std::string headers = connection.m_buffer.substr( 0, headersEnd );
+    if ( headers.compare( 0, 5, "HTTP/" )!=0 || headers.find( ' ' )==std::string::npos )
+    {
+        return false;
+    }
+    request.m_status = atoi( headers.c_str()+headers.find( ' ' )+1 );
+
+    // Only bodies with a known size are supported
+    if ( GetHeader( headers, "Transfer-Encoding" ).size() )
+    {
+        return false;
+    }
+    std::size_t size = (std::size_t)strtoull( GetHeader( headers, "Content-Length" ).c_str(), nullptr, 10 );
+
+    while ( connection.m_buffer.size()<headersEnd+4+size )
+    {
+        if ( !read_more( connection, deadline ) )
+        {
+            return false;
+        }
+    }
+
+    request.m_content = connection.m_buffer.substr( headersEnd+4, size );
+    connection.m_buffer.erase( 0, headersEnd+4+size );
+
+    // The server won't take more requests in this connection
+    if ( strncasecmp( GetHeader( headers, "Connection" ).c_str(), "close", 5 )==0 )
+    {
+        connection.m_buffer = "closed";
+    }
+
+    return true;
+}
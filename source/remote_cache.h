@@ -0,0 +1,132 @@
+#pragma once
+
+#include "platform.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+
+//!
+//! \brief Client of a build cache shared through HTTP, like the one of craft-cache-server.
+//! Entries are read with GET and written with PUT, and a missing entry is a 404:
+//!
+//!     /ac/<key>       result of an action: the manifest of a compilation, or the output of a link
+//!     /cas/<key>      content addressed files, like the objects listed in the manifests
+//!
+//! Lookups can be started in advance with prefetch: background threads send them in batches
+//! through persistent connections, pipelining the requests, while the build goes on. Writes are
+//! queued and sent in the background as well.
+//!
+//! The cache must never make the build slower than building without it: every request has a
+//! deadline, and the first connection failure, error response or missed deadline disables the
+//! remote cache for the rest of the build.
+//!
+class CRAFTCOREI_API RemoteCache
+{
+public:
+
+    //! \param url address of the cache, like http://127.0.0.1:8750 or http://cache:80/project
+    //! \param timeoutMilliseconds deadline of every request
+    RemoteCache( const std::string& url, int timeoutMilliseconds );
+    ~RemoteCache();
+
+    //! Create the cache configured in the environment: CRAFT_REMOTE_CACHE is the url and
+    //! CRAFT_REMOTE_CACHE_TIMEOUT the deadline in milliseconds, by default 2000.
+    //! \return null if there is no url.
+    static std::shared_ptr<RemoteCache> create_from_environment();
+
+    //! Start reading an entry in the background, to be taken later with get.
+    void prefetch( const std::string& path );
+
+    //! Read an entry, waiting for it if it is being prefetched.
+    //! \return false if it doesn't exist or the cache is not available.
+    bool get( const std::string& path, std::string& content );
+
+    //! Write an entry in the background.
+    void put( const std::string& path, const std::string& content );
+
+    //! Wait until all the writes have been sent, or have failed or stopped making progress.
+    void flush();
+
+    bool is_available() const { return m_available; }
+
+    uint64_t get_hits() const { return m_hits; }
+    uint64_t get_misses() const { return m_misses; }
+    uint64_t get_read_size() const { return m_readSize; }
+    uint64_t get_written_size() const { return m_writtenSize; }
+
+private:
+
+    struct Connection
+    {
+        int m_fd = -1;
+
+        //! Received data not consumed yet
+        std::string m_buffer;
+    };
+
+    struct Request
+    {
+        std::string m_method;
+        std::string m_path;
+        std::string m_body;
+
+        // Response
+        int m_status = 0;
+        std::string m_content;
+    };
+
+    //! Send a batch of requests through one connection, and read their responses in order.
+    //! \return false if the connection failed, in which case the cache is disabled.
+    bool send( std::vector<Request>& requests );
+
+    bool connect( Connection& connection );
+    bool write_all( Connection& connection, const std::string& data, int64_t deadline );
+    bool read_response( Connection& connection, Request& request, int64_t deadline );
+    bool read_more( Connection& connection, int64_t deadline );
+
+    //! Stop using the cache for the rest of the build.
+    void disable( const char* reason );
+
+    void fetch_loop();
+    void upload_loop();
+
+    std::string m_host;
+    std::string m_port;
+    std::string m_prefix;
+    int m_timeout;
+
+    std::atomic<bool> m_available{true};
+
+    //! Idle persistent connections
+    std::mutex m_connectionsMutex;
+    std::vector<Connection> m_connections;
+
+    //! State of the prefetched entries
+    enum class State { Queued, Sending, Found, Missing };
+    struct Entry
+    {
+        State m_state = State::Queued;
+        std::string m_content;
+    };
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::map<std::string,Entry> m_entries;
+    std::deque<std::string> m_fetchQueue;
+    std::deque<std::pair<std::string,std::string>> m_uploadQueue;
+    int m_uploading = 0;
+    bool m_stop = false;
+
+    std::vector<std::thread> m_threads;
+
+    std::atomic<uint64_t> m_hits{0};
+    std::atomic<uint64_t> m_misses{0};
+    std::atomic<uint64_t> m_readSize{0};
+    std::atomic<uint64_t> m_writtenSize{0};
+};
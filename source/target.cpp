@@ -10,6 +10,39 @@
 #include <vector>
 
 
+//! Return true if the output was recorded with a different command or list of dependencies, like
+//! when the link flags change or a source file is removed from a target.
+static bool HasLinkCommandChanged( ContextPlan& ctx, const std::string& target, const NodeList& dependencies, uint64_t commandHash )
+{
+    NodeList recorded;
+    uint64_t recordedHash = 0;
+    if ( !ctx.get_recorded_dependencies( target, recorded, recordedHash ) )
+    {
+        return false;
+    }
+
+    if ( recordedHash && recordedHash!=commandHash )
+    {
+        return true;
+    }
+
+    if ( recorded.size()!=dependencies.size() )
+    {
+        return true;
+    }
+
+    for ( size_t d=0; d<dependencies.size(); ++d )
+    {
+        if ( recorded[d]->m_absolutePath!=dependencies[d]->m_absolutePath )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
 CppTarget& CppTarget::source( const std::string& files )
 {
     m_sources.push_back( files );
@@ -212,7 +245,7 @@ std::shared_ptr<BuiltTarget> CppTarget::build( ContextPlan& ctx )
                 objectTasks.push_back( t );
 
                 // Add to the pending tasks list so that it is detected as an outdated dependency
-                ctx.m_tasks.push_back(t);
+                ctx.add_task(t);
             }
             objects.push_back( outputNode );
         }
@@ -238,8 +271,22 @@ void ProgramTarget::link( ContextPlan& ctx, BuiltTarget& builtTarget, const Node
     target += FileSeparator()+m_name;
     target = FileReplaceExtension(target,"");
 
+    std::vector<std::shared_ptr<BuiltTarget>> uses;
+    for(const auto& u: m_uses)
+    {
+        uses.push_back( ctx.get_built_target(u));
+    }
+
+    auto compiler = ctx.get_current_toolchain()->get_compiler();
+    compiler->set_configuration( ctx.get_current_configuration() );
+
+    NodeList dependencies;
+    compiler->get_link_program_dependencies( dependencies, objects, uses );
+    uint64_t commandHash = compiler->get_link_program_hash( target, objects, uses );
+
     // Calculate if we need to compile in this variable
     bool outdated = false;
+    NodeList pendingInputs;
 
     // Make sure the target folder exists
     std::string targetPath = FileGetPath( target );
@@ -256,22 +303,15 @@ void ProgramTarget::link( ContextPlan& ctx, BuiltTarget& builtTarget, const Node
         {
             outdated = true;
         }
+        else if ( HasLinkCommandChanged( ctx, target, dependencies, commandHash ) )
+        {
+            AXE_LOG("deps", axe::Level::Verbose, "Changed command or dependencies: [%s]", target.c_str() );
+            outdated = true;
+        }
         else
         {
-            NodeList dependencies;
-
-            std::vector<std::shared_ptr<BuiltTarget>> uses;
-            for(const auto& u: m_uses)
-            {
-                uses.push_back( ctx.get_built_target(u));
-            }
-
-            auto compiler = ctx.get_current_toolchain()->get_compiler();
-            compiler->set_configuration( ctx.get_current_configuration() );
-            compiler->get_link_program_dependencies( dependencies, objects, uses );
-
             std::shared_ptr<Node> failed;
-            outdated = ctx.IsTargetOutdated( target_time, dependencies, &failed );
+            outdated = ctx.IsTargetOutdated( target_time, dependencies, &failed, &pendingInputs );
             if (outdated)
             {
                 AXE_LOG("deps", axe::Level::Verbose, "Outdated dependency: [%s]", failed->m_absolutePath.c_str() );
@@ -286,23 +326,27 @@ void ProgramTarget::link( ContextPlan& ctx, BuiltTarget& builtTarget, const Node
     if (outdated)
     {
         std::string configuration = ctx.get_current_configuration();
-        std::vector<std::shared_ptr<BuiltTarget>> uses;
-        for(const auto& u: m_uses)
-        {
-            uses.push_back( ctx.get_built_target(u));
-        }
-
-        auto compiler = ctx.get_current_toolchain()->get_compiler();
+        ContextPlan* plan = &ctx;
         auto result = std::make_shared<Task>( "link program", builtTarget.m_outputNode,
                                          [=]()
         {
             compiler->set_configuration( configuration );
-            return compiler->link_program( target, objects, uses );
+            int status = compiler->link_program( target, objects, uses );
+            if (status==0)
+            {
+                plan->record_output( target, dependencies, commandHash );
+            }
+            return status;
         }
                     );
+        result->m_pendingInputs = pendingInputs;
 
         builtTarget.m_outputTasks.push_back( result );
     }
+    else
+    {
+        AXE_COUNTER_ADD( "craft_tasks_skipped", 1 );
+    }
 }
 
 
@@ -312,7 +356,15 @@ void StaticLibraryTarget::link( ContextPlan& ctx, BuiltTarget& builtTarget, cons
     target += FileSeparator()+m_name;
     target = FileReplaceExtension(target,"a");
 
+    std::shared_ptr<Compiler> compiler = ctx.get_current_toolchain()->get_compiler();
+    compiler->set_configuration( ctx.get_current_configuration() );
+
+    NodeList dependencies;
+    compiler->get_link_static_library_dependencies( dependencies, target, objects );
+    uint64_t commandHash = compiler->get_link_static_library_hash( target, objects );
+
     bool outdated = false;
+    NodeList pendingInputs;
 
     // Make sure the target folder exists
     std::string targetPath = FileGetPath( target );
@@ -328,15 +380,15 @@ void StaticLibraryTarget::link( ContextPlan& ctx, BuiltTarget& builtTarget, cons
         {
             outdated = true;
         }
+        else if ( HasLinkCommandChanged( ctx, target, dependencies, commandHash ) )
+        {
+            AXE_LOG("deps", axe::Level::Verbose, "Changed command or dependencies: [%s]", target.c_str() );
+            outdated = true;
+        }
         else
         {
-            auto compiler = ctx.get_current_toolchain()->get_compiler();
-            compiler->set_configuration( ctx.get_current_configuration() );
-            NodeList dependencies;
-            compiler->get_link_static_library_dependencies( dependencies, target, objects );
-
             std::shared_ptr<Node> failed;
-            outdated = ctx.IsTargetOutdated( target_time, dependencies, &failed );
+            outdated = ctx.IsTargetOutdated( target_time, dependencies, &failed, &pendingInputs );
             if (outdated)
             {
                 AXE_LOG("deps", axe::Level::Verbose, "Outdated dependency: [%s]", failed->m_absolutePath.c_str() );
@@ -351,17 +403,27 @@ void StaticLibraryTarget::link( ContextPlan& ctx, BuiltTarget& builtTarget, cons
     if (outdated)
     {
         std::string configuration = ctx.get_current_configuration();
-        std::shared_ptr<Compiler> compiler = ctx.get_current_toolchain()->get_compiler();
+        ContextPlan* plan = &ctx;
         auto result = std::make_shared<Task>( "link static library", builtTarget.m_outputNode,
                                          [=]()
         {
             compiler->set_configuration( configuration );
-            return compiler->link_static_library( target, objects );
+            int status = compiler->link_static_library( target, objects );
+            if (status==0)
+            {
+                plan->record_output( target, dependencies, commandHash );
+            }
+            return status;
         }
                     );
+        result->m_pendingInputs = pendingInputs;
 
         builtTarget.m_outputTasks.push_back( result );
     }
+    else
+    {
+        AXE_COUNTER_ADD( "craft_tasks_skipped", 1 );
+    }
 
 }
 
@@ -373,7 +435,21 @@ void DynamicLibraryTarget::link( ContextPlan& ctx, BuiltTarget& builtTarget, con
     std::string libraryName = ctx.get_current_target_platform()->get_dynamic_library_file_name( m_name );
     target += FileSeparator()+libraryName;
 
+    std::vector<std::shared_ptr<BuiltTarget>> uses;
+    for(const auto& u: m_uses)
+    {
+        uses.push_back( ctx.get_built_target(u));
+    }
+
+    auto compiler = ctx.get_current_toolchain()->get_compiler();
+    compiler->set_configuration( ctx.get_current_configuration() );
+
+    NodeList dependencies;
+    compiler->get_link_dynamic_library_dependencies( dependencies, target, objects, uses );
+    uint64_t commandHash = compiler->get_link_dynamic_library_hash( target, objects, uses );
+
     bool outdated = false;
+    NodeList pendingInputs;
 
     // Make sure the target folder exists
     std::string targetPath = FileGetPath( target );
@@ -389,22 +465,15 @@ void DynamicLibraryTarget::link( ContextPlan& ctx, BuiltTarget& builtTarget, con
         {
             outdated = true;
         }
+        else if ( HasLinkCommandChanged( ctx, target, dependencies, commandHash ) )
+        {
+            AXE_LOG("deps", axe::Level::Verbose, "Changed command or dependencies: [%s]", target.c_str() );
+            outdated = true;
+        }
         else
         {
-            NodeList dependencies;
-
-            std::vector<std::shared_ptr<BuiltTarget>> uses;
-            for(const auto& u: m_uses)
-            {
-                uses.push_back( ctx.get_built_target(u));
-            }
-
-            auto compiler = ctx.get_current_toolchain()->get_compiler();
-            compiler->set_configuration( ctx.get_current_configuration() );
-            compiler->get_link_dynamic_library_dependencies( dependencies, target, objects, uses );
-
             std::shared_ptr<Node> failed;
-            outdated = ctx.IsTargetOutdated( target_time, dependencies, &failed );
+            outdated = ctx.IsTargetOutdated( target_time, dependencies, &failed, &pendingInputs );
             if (outdated)
             {
                 AXE_LOG("deps", axe::Level::Verbose, "Outdated dependency: [%s]", failed->m_absolutePath.c_str() );
@@ -419,23 +488,27 @@ void DynamicLibraryTarget::link( ContextPlan& ctx, BuiltTarget& builtTarget, con
     if (outdated)
     {
         std::string configuration = ctx.get_current_configuration();
-        std::vector<std::shared_ptr<BuiltTarget>> uses;
-        for(const auto& u: m_uses)
-        {
-            uses.push_back( ctx.get_built_target(u));
-        }
-
-        auto compiler = ctx.get_current_toolchain()->get_compiler();
+        ContextPlan* plan = &ctx;
         auto result = std::make_shared<Task>( "link dynamic library", builtTarget.m_outputNode,
-                                         [=,&ctx]()
+                                         [=]()
         {
             compiler->set_configuration( configuration );
-            return compiler->link_dynamic_library( target, objects, uses );
+            int status = compiler->link_dynamic_library( target, objects, uses );
+            if (status==0)
+            {
+                plan->record_output( target, dependencies, commandHash );
+            }
+            return status;
         }
                     );
+        result->m_pendingInputs = pendingInputs;
 
         builtTarget.m_outputTasks.push_back( result );
     }
+    else
+    {
+        AXE_COUNTER_ADD( "craft_tasks_skipped", 1 );
+    }
 }
 
 
@@ -443,11 +516,25 @@ std::shared_ptr<Task> ObjectTarget::object( ContextPlan& ctx, const std::string&
 {
     FileCreateDirectories( ctx.get_current_path() );
 
-    std::string target = ctx.get_current_path()+FileSeparator()+ctx.get_current_configuration()+FileSeparator()+name;
+    // Sources in the workspace given with absolute paths get the same objects as relative ones, so
+    // that they don't depend on the location of the workspace.
+    std::string objectName = name;
+    const std::string& root = ctx.get_build_root();
+    if ( objectName.compare( 0, root.size()+1, root+FileSeparator() )==0 )
+    {
+        objectName = objectName.substr( root.size()+1 );
+    }
+
+    std::string target = ctx.get_current_path()+FileSeparator()+ctx.get_current_configuration()+FileSeparator()+objectName;
     target = FileReplaceExtension(target,ctx.get_current_toolchain()->get_compiler()->get_default_object_extension());
 
+    auto compiler = ctx.get_current_toolchain()->get_compiler();
+    compiler->set_configuration( ctx.get_current_configuration() );
+    uint64_t commandHash = compiler->get_compile_hash( name, target, includePaths );
+
     // Calculate if we need to compile in this variable
     bool outdated = false;
+    NodeList pendingInputs;
 
     // Make sure the target folder exists
     std::string targetPath = FileGetPath( target );
@@ -473,18 +560,29 @@ std::shared_ptr<Task> ObjectTarget::object( ContextPlan& ctx, const std::string&
             }
             else
             {
-                // Check all dependencies...
+                // Check all the dependencies recorded when it was compiled.
                 NodeList dependencies;
-
-                auto compiler = ctx.get_current_toolchain()->get_compiler();
-                compiler->set_configuration( ctx.get_current_configuration() );
-                compiler->get_compile_dependencies( dependencies, name, target, includePaths );
-
-                std::shared_ptr<Node> failed;
-                outdated = ctx.IsTargetOutdated( target_time, dependencies, &failed );
-                if (outdated)
+                uint64_t recordedHash = 0;
+                if ( !ctx.get_recorded_dependencies( target, dependencies, recordedHash ) )
+                {
+                    // The command used to build the existing file is unknown: build it once, so
+                    // that it is recorded and flag changes are noticed from now on.
+                    AXE_LOG("deps", axe::Level::Verbose, "Unknown command: [%s]", target.c_str() );
+                    outdated = true;
+                }
+                else if ( recordedHash!=commandHash )
                 {
-                    AXE_LOG("deps", axe::Level::Verbose, "Outdated dependency: [%s]", failed->m_absolutePath.c_str() );
+                    AXE_LOG("deps", axe::Level::Verbose, "Changed command: [%s]", target.c_str() );
+                    outdated = true;
+                }
+                else
+                {
+                    std::shared_ptr<Node> failed;
+                    outdated = ctx.IsTargetOutdated( target_time, dependencies, &failed, &pendingInputs );
+                    if (outdated)
+                    {
+                        AXE_LOG("deps", axe::Level::Verbose, "Outdated dependency: [%s]", failed->m_absolutePath.c_str() );
+                    }
                 }
             }
         }
@@ -498,15 +596,33 @@ std::shared_ptr<Task> ObjectTarget::object( ContextPlan& ctx, const std::string&
 
     if (outdated)
     {
+        // The remote cache can be answering while other tasks run.
+        compiler->prefetch_compile( name, target, includePaths );
+
         std::string configuration = ctx.get_current_configuration();
-        auto compiler = ctx.get_current_toolchain()->get_compiler();
+        ContextPlan* plan = &ctx;
         result = std::make_shared<Task>( "compile", targetNode,
                                          [=]()
         {
             compiler->set_configuration( configuration );
-            return compiler->compile( name, target, includePaths );
+            int status = compiler->compile( name, target, includePaths );
+            if (status==0)
+            {
+                // Keep the dependencies found while compiling for the next build.
+                NodeList dependencies;
+                if ( compiler->get_compile_dependencies( dependencies, name, target, includePaths )==0 )
+                {
+                    plan->record_output( target, dependencies, commandHash );
+                }
+            }
+            return status;
         }
                     );
+        result->m_pendingInputs = pendingInputs;
+    }
+    else
+    {
+        AXE_COUNTER_ADD( "craft_tasks_skipped", 1 );
     }
 
     return result;
@@ -0,0 +1,130 @@
+//!
+//! Benchmark of the parsing of the make rules written by the compiler with the dependencies of an
+//! object. Compiler::parse_dependencies is compared with the std::regex tokenisation it replaced,
+//! on a rule with 2000 headers.
+//!
+
+#include "compiler.h"
+#include "test_results.h"
+
+#include <regex>
+
+
+namespace
+{
+    const int HeaderCount = 2000;
+    const int Iterations = 50;
+
+    //! Expose the parser of the compilers
+    class ParsingCompiler : public CompilerGCC
+    {
+    public:
+        using Compiler::parse_dependencies;
+    };
+
+    //! The regex based parser that was used before
+    int RegexParseDependencies( NodeList& deps, const std::string& rules )
+    {
+        std::regex rule_regex("\\s\\n");
+        std::sregex_token_iterator rule_begin(rules.begin(), rules.end(), rule_regex, -1);
+        std::sregex_token_iterator rule_end;
+
+        while( rule_begin!=rule_end )
+        {
+            std::string rule = rule_begin->str();
+
+            // Remove the rule target, which may be an absolute path
+            std::string::size_type targetEnd = rule.find(':');
+            while ( targetEnd!=std::string::npos
+                    && targetEnd+1<rule.size()
+                    && !isspace((unsigned char)rule[targetEnd+1]) )
+            {
+                targetEnd = rule.find(':',targetEnd+1);
+            }
+            if (targetEnd!=std::string::npos)
+            {
+                rule.erase(0,targetEnd+1);
+            }
+
+            std::regex dep_regex(R"([\s\n\\]+|([.\w]+:))");
+            std::sregex_token_iterator dep_begin(rule.begin(), rule.end(), dep_regex, -1);
+            std::sregex_token_iterator dep_end;
+
+            while( dep_begin!=dep_end )
+            {
+                std::string dep = dep_begin->str();
+                if (dep.size())
+                {
+                    std::string dep_absolute_path;
+                    if (FileIsAbsolute(dep))
+                    {
+                        dep_absolute_path = dep;
+                    }
+                    else
+                    {
+                        dep_absolute_path = FileGetCurrentPath();
+                        dep_absolute_path += FileSeparator()+dep;
+                    }
+
+                    std::shared_ptr<Node> targetNode = std::make_shared<Node>();
+                    targetNode->m_absolutePath = dep_absolute_path;
+
+                    deps.push_back(targetNode);
+                }
+                ++dep_begin;
+            }
+
+            ++rule_begin;
+        }
+
+        return 0;
+    }
+}
+
+
+int main( int argc, const char** argv )
+{
+    TestResults results( argc, argv );
+
+    // Like the rules written with -MD: one prerequisite per line
+    std::string rules = "build/debug/source/object.o: source/object.cpp";
+    for ( int h=0; h<HeaderCount; ++h )
+    {
+        rules += " \\\n  /usr/include/library"+std::to_string(h%20)+"/header_"+std::to_string(h)+".h";
+    }
+    rules += "\n";
+
+    ParsingCompiler compiler;
+
+    std::size_t parsedCount = 0;
+    double parserSeconds = MeasureSeconds( [&]()
+    {
+        for ( int i=0; i<Iterations; ++i )
+        {
+            NodeList deps;
+            compiler.parse_dependencies( deps, rules.data(), rules.size() );
+            parsedCount = deps.size();
+        }
+    } );
+
+    std::size_t regexCount = 0;
+    double regexSeconds = MeasureSeconds( [&]()
+    {
+        for ( int i=0; i<Iterations; ++i )
+        {
+            NodeList deps;
+            RegexParseDependencies( deps, rules );
+            regexCount = deps.size();
+        }
+    } );
+
+    results.check( parsedCount==HeaderCount+1, "the parser finds all the dependencies" );
+    results.check( regexCount==HeaderCount+1, "the regex finds all the dependencies" );
+
+    results.scalar( "dependencies", HeaderCount+1 );
+    results.scalar( "parser_microseconds_per_file", parserSeconds*1e6/Iterations );
+    results.scalar( "regex_microseconds_per_file", regexSeconds*1e6/Iterations );
+    results.scalar( "speedup", parserSeconds>0 ? regexSeconds/parserSeconds : 0 );
+
+    return results.result();
+}
@@ -0,0 +1,99 @@
+//!
+//! Benchmark of the logging throughput of axe with 1, 8 and 64 threads producing events at the
+//! same time. The events are written to a log file in a temporary folder, and not to the terminal.
+//!
+
+#include "axe.h"
+#include "test_results.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <unistd.h>
+
+
+AXE_IMPLEMENT();
+
+
+namespace
+{
+    const int EventCount = 400000;
+
+    void RemoveFolder( const std::string& folder )
+    {
+        if ( DIR* dir = opendir( folder.c_str() ) )
+        {
+            while ( dirent* entry = readdir( dir ) )
+            {
+                unlink( ( folder+"/"+entry->d_name ).c_str() );
+            }
+            closedir( dir );
+        }
+        rmdir( folder.c_str() );
+    }
+}
+
+
+int main( int argc, const char** argv )
+{
+    TestResults results( argc, argv );
+
+    char folder[] = "/tmp/craft-log-benchmark-XXXXXX";
+    char previousPath[4096] = "";
+    if ( !getcwd( previousPath, sizeof(previousPath) ) || !mkdtemp( folder ) || chdir( folder )!=0 )
+    {
+        results.check( false, "create a temporary folder for the log" );
+        return results.result();
+    }
+
+    AXE_INITIALISE( "log-benchmark", 0, 0 );
+    axe::s_kernel->SetLevels( "bin:terminal=fatal" );
+
+    for ( int producers: { 1, 8, 64 } )
+    {
+        int eventsPerProducer = EventCount/producers;
+
+        // Producers are done when their events are queued, the writer when they are in the file.
+        double producerSeconds = 0;
+        double totalSeconds = MeasureSeconds( [&]()
+        {
+            producerSeconds = MeasureSeconds( [&]()
+            {
+                std::vector<std::thread> threads;
+                for ( int p=0; p<producers; ++p )
+                {
+                    threads.emplace_back( [p,eventsPerProducer]()
+                    {
+                        for ( int e=0; e<eventsPerProducer; ++e )
+                        {
+                            AXE_LOG( "benchmark", axe::Level::Info, "Event %d of producer %d", e, p );
+                        }
+                    } );
+                }
+                for ( auto& t: threads )
+                {
+                    t.join();
+                }
+            } );
+
+            axe::s_kernel->Flush();
+        } );
+
+        int total = eventsPerProducer*producers;
+        std::string prefix = "producers_"+std::to_string(producers)+"_";
+        results.scalar( prefix+"queued_events_per_second", producerSeconds>0 ? total/producerSeconds : 0 );
+        results.scalar( prefix+"written_events_per_second", totalSeconds>0 ? total/totalSeconds : 0 );
+    }
+
+    AXE_FINALISE();
+
+    if ( chdir( previousPath )!=0 )
+    {
+        results.check( false, "go back to the initial folder" );
+    }
+    RemoveFolder( folder );
+
+    return results.result();
+}
@@ -0,0 +1,132 @@
+//!
+//! Benchmark of the outdated checks done while planning: every object checks its dependencies
+//! against the outputs of all the planned tasks. The indexed pending outputs of ContextPlan are
+//! compared with a scan of all the task outputs, which is what planning used to do.
+//!
+
+#include "craft_core.h"
+#include "test_results.h"
+
+#include <cstdlib>
+
+#include <unistd.h>
+
+
+namespace
+{
+    const int TaskCount = 5000;
+    const int HeaderCount = 300;
+    const int ObjectCount = 200;
+
+    //! Pending check scanning the outputs of all the tasks
+    bool IsNodePendingByScan( const ContextPlan& plan, const Node& node )
+    {
+        for ( const auto& t: plan.m_tasks )
+        {
+            for ( const auto& o: t->m_outputs )
+            {
+                if ( o->m_absolutePath==node.m_absolutePath )
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool IsTargetOutdatedByScan( const ContextPlan& plan, FileTime targetTime, const NodeList& dependencies )
+    {
+        for ( const auto& n: dependencies )
+        {
+            if ( IsNodePendingByScan( plan, *n ) )
+            {
+                return true;
+            }
+
+            FileTime time = FileGetModificationTime( n->m_absolutePath );
+            if ( time.IsNull() || time>targetTime )
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+
+int main( int argc, const char** argv )
+{
+    TestResults results( argc, argv );
+
+    // Only the planning is measured
+    setenv( "CRAFT_CACHE_SIZE", "0", 1 );
+
+    char folder[] = "/tmp/craft-planning-benchmark-XXXXXX";
+    if ( !mkdtemp( folder ) )
+    {
+        results.check( false, "create a temporary folder" );
+        return results.result();
+    }
+
+    // The headers every object depends on
+    NodeList dependencies;
+    for ( int h=0; h<HeaderCount; ++h )
+    {
+        auto node = std::make_shared<Node>();
+        node->m_absolutePath = std::string(folder)+"/header"+std::to_string(h)+".h";
+        FILE* file = fopen( node->m_absolutePath.c_str(), "w" );
+        if ( file )
+        {
+            fclose( file );
+        }
+        dependencies.push_back( node );
+    }
+
+    Context context;
+    ContextPlan plan( context );
+    for ( int t=0; t<TaskCount; ++t )
+    {
+        auto output = std::make_shared<Node>();
+        output->m_absolutePath = std::string(folder)+"/build/object"+std::to_string(t)+".o";
+        plan.add_task( std::make_shared<Task>( "compile", output, [](){ return 0; } ) );
+    }
+
+    // Newer than all the headers
+    FileTime targetTime = FileGetModificationTime( dependencies[0]->m_absolutePath );
+    targetTime.m_time += 3600;
+
+    int indexedOutdated = 0;
+    double indexedSeconds = MeasureSeconds( [&]()
+    {
+        for ( int o=0; o<ObjectCount; ++o )
+        {
+            indexedOutdated += plan.IsTargetOutdated( targetTime, dependencies ) ? 1 : 0;
+        }
+    } );
+
+    int scanOutdated = 0;
+    double scanSeconds = MeasureSeconds( [&]()
+    {
+        for ( int o=0; o<ObjectCount; ++o )
+        {
+            scanOutdated += IsTargetOutdatedByScan( plan, targetTime, dependencies ) ? 1 : 0;
+        }
+    } );
+
+    results.check( indexedOutdated==0 && scanOutdated==0, "no object is outdated" );
+
+    results.scalar( "tasks", TaskCount );
+    results.scalar( "dependencies_per_object", HeaderCount );
+    results.scalar( "objects", ObjectCount );
+    results.scalar( "indexed_seconds", indexedSeconds );
+    results.scalar( "scan_seconds", scanSeconds );
+    results.scalar( "speedup", indexedSeconds>0 ? scanSeconds/indexedSeconds : 0 );
+
+    for ( const auto& d: dependencies )
+    {
+        unlink( d->m_absolutePath.c_str() );
+    }
+    rmdir( folder );
+
+    return results.result();
+}
@@ -0,0 +1,153 @@
+//!
+//! Test of RemoteCache against craft-cache-server, which is started on a temporary folder and a
+//! free port. It must be built in the same folder as this program.
+//!
+
+#include "remote_cache.h"
+#include "test_results.h"
+
+#include <csignal>
+#include <cstring>
+#include <string>
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+namespace
+{
+    //! Ask the system for a port nobody is listening on.
+    int FindFreePort()
+    {
+        int fd = socket( AF_INET, SOCK_STREAM, 0 );
+        sockaddr_in address;
+        memset( &address, 0, sizeof(address) );
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+        socklen_t length = sizeof(address);
+        int port = 0;
+        if ( fd>=0
+             && bind( fd, (sockaddr*)&address, sizeof(address) )==0
+             && getsockname( fd, (sockaddr*)&address, &length )==0 )
+        {
+            port = ntohs( address.sin_port );
+        }
+        if ( fd>=0 )
+        {
+            close( fd );
+        }
+        return port;
+    }
+
+    //! Wait until something accepts connections on the port.
+    bool WaitForServer( int port )
+    {
+        for ( int attempt=0; attempt<200; ++attempt )
+        {
+            int fd = socket( AF_INET, SOCK_STREAM, 0 );
+            sockaddr_in address;
+            memset( &address, 0, sizeof(address) );
+            address.sin_family = AF_INET;
+            address.sin_port = htons( (uint16_t)port );
+            address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+            bool connected = fd>=0 && connect( fd, (sockaddr*)&address, sizeof(address) )==0;
+            if ( fd>=0 )
+            {
+                close( fd );
+            }
+            if ( connected )
+            {
+                return true;
+            }
+            usleep( 10000 );
+        }
+        return false;
+    }
+
+    void RemoveFolder( const std::string& folder )
+    {
+        if ( DIR* dir = opendir( folder.c_str() ) )
+        {
+            while ( dirent* entry = readdir( dir ) )
+            {
+                std::string name = entry->d_name;
+                if ( name!="." && name!=".." )
+                {
+                    std::string path = folder+"/"+name;
+                    if ( unlink( path.c_str() )!=0 )
+                    {
+                        RemoveFolder( path );
+                    }
+                }
+            }
+            closedir( dir );
+        }
+        rmdir( folder.c_str() );
+    }
+}
+
+
+int main( int argc, const char** argv )
+{
+    TestResults results( argc, argv );
+
+    std::string program = argv[0];
+    std::string::size_type separator = program.rfind( '/' );
+    std::string server = ( separator==std::string::npos ? std::string(".") : program.substr( 0, separator ) )
+            + "/craft-cache-server";
+
+    char folder[] = "/tmp/craft-remote-cache-test-XXXXXX";
+    int port = FindFreePort();
+    if ( !mkdtemp( folder ) || !port )
+    {
+        results.check( false, "create a temporary folder and find a free port" );
+        return results.result();
+    }
+
+    std::string portText = std::to_string( port );
+    pid_t pid = fork();
+    if ( pid==0 )
+    {
+        execl( server.c_str(), server.c_str(), "-p", portText.c_str(), "-d", folder, (char*)nullptr );
+        _exit( 127 );
+    }
+
+    bool started = pid>0 && WaitForServer( port );
+    results.check( started, "start craft-cache-server" );
+    if ( started )
+    {
+        // Binary content, bigger than the buffers of both sides
+        std::string content;
+        for ( int i=0; i<1024*1024; ++i )
+        {
+            content += (char)( i*31 );
+        }
+
+        RemoteCache cache( "http://127.0.0.1:"+portText, 2000 );
+        cache.put( "cas/0123456789abcdef", content );
+        cache.put( "ac/fedcba9876543210", "manifest" );
+        cache.flush();
+
+        std::string read;
+        results.check( cache.get( "cas/0123456789abcdef", read ) && read==content, "get a stored object" );
+        results.check( cache.get( "ac/fedcba9876543210", read ) && read=="manifest", "get a stored action" );
+        results.check( !cache.get( "ac/0000000000000000", read ), "don't get a missing entry" );
+        results.check( cache.is_available(), "a missing entry doesn't disable the cache" );
+
+        results.scalar( "hits", (double)cache.get_hits() );
+        results.scalar( "misses", (double)cache.get_misses() );
+    }
+
+    if ( pid>0 )
+    {
+        kill( pid, SIGTERM );
+        waitpid( pid, nullptr, 0 );
+    }
+    RemoveFolder( folder );
+
+    return results.result();
+}
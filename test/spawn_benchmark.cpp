@@ -0,0 +1,93 @@
+//!
+//! Benchmark of the launch of short processes, like compiler invocations, with parents of
+//! increasing resident size. Run, which starts processes with posix_spawn, is compared with fork
+//! and exec, whose cost grows with the page tables of the parent.
+//!
+
+#include "platform.h"
+#include "test_results.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+
+namespace
+{
+    const int Launches = 200;
+    const char* Program = "/bin/true";
+
+    int ForkAndExec()
+    {
+        pid_t pid = fork();
+        if ( pid==0 )
+        {
+            execl( Program, Program, (char*)nullptr );
+            _exit( 127 );
+        }
+
+        int status = 0;
+        if ( pid<0 || waitpid( pid, &status, 0 )!=pid )
+        {
+            return -1;
+        }
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+}
+
+
+int main( int argc, const char** argv )
+{
+    TestResults results( argc, argv );
+
+    // Memory kept resident while launching, in megabytes
+    std::vector<char*> blocks;
+    std::size_t resident = 0;
+    for ( std::size_t size: { 0, 256, 1024 } )
+    {
+        while ( resident<size )
+        {
+            char* block = (char*)malloc( 64*1024*1024 );
+            if ( !block )
+            {
+                break;
+            }
+            memset( block, 1, 64*1024*1024 );
+            blocks.push_back( block );
+            resident += 64;
+        }
+
+        int failures = 0;
+        double spawnSeconds = MeasureSeconds( [&]()
+        {
+            for ( int l=0; l<Launches; ++l )
+            {
+                failures += Run( "", Program, {}, nullptr, nullptr, 0, nullptr )!=0 ? 1 : 0;
+            }
+        } );
+
+        double forkSeconds = MeasureSeconds( [&]()
+        {
+            for ( int l=0; l<Launches; ++l )
+            {
+                failures += ForkAndExec()!=0 ? 1 : 0;
+            }
+        } );
+
+        results.check( failures==0, "all the processes run" );
+
+        std::string prefix = "rss_"+std::to_string(resident)+"mb_";
+        results.scalar( prefix+"run_microseconds", spawnSeconds*1e6/Launches );
+        results.scalar( prefix+"fork_microseconds", forkSeconds*1e6/Launches );
+    }
+
+    for ( char* b: blocks )
+    {
+        free( b );
+    }
+
+    return results.result();
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+
+
+//!
+//! \brief Metrics of a test or benchmark program.
+//! They are printed, and written as "scalar,<name>,<value>" lines to the file given with
+//! "--output <file>", which is how the test runner of the build script collects them.
+//!
+class TestResults
+{
+public:
+
+    TestResults( int argc, const char** argv )
+    {
+        for ( int a=1; a+1<argc; ++a )
+        {
+            if ( strcmp( argv[a], "--output" )==0 )
+            {
+                m_outputPath = argv[a+1];
+            }
+        }
+    }
+
+    ~TestResults()
+    {
+        if ( m_outputPath.empty() )
+        {
+            return;
+        }
+
+        FILE* file = fopen( m_outputPath.c_str(), "w" );
+        if ( file )
+        {
+            for ( const auto& s: m_scalars )
+            {
+                fprintf( file, "scalar,%s,%g\n", s.first.c_str(), s.second );
+            }
+            fclose( file );
+        }
+    }
+
+    void scalar( const std::string& name, double value )
+    {
+        printf( "%-40s %g\n", name.c_str(), value );
+        m_scalars.push_back( std::make_pair( name, value ) );
+    }
+
+    //! Report a failed check, making the program fail.
+    void check( bool condition, const char* description )
+    {
+        if ( !condition )
+        {
+            printf( "FAILED: %s\n", description );
+            m_failed = true;
+        }
+    }
+
+    //! Exit status of the program
+    int result() const
+    {
+        return m_failed ? 1 : 0;
+    }
+
+private:
+
+    std::string m_outputPath;
+    std::vector<std::pair<std::string,double>> m_scalars;
+    bool m_failed = false;
+};
+
+
+//! Run a function and return how long it took in seconds.
+inline double MeasureSeconds( const std::function<void()>& function )
+{
+    auto start = std::chrono::steady_clock::now();
+    function();
+    return std::chrono::duration<double>( std::chrono::steady_clock::now()-start ).count();
+}